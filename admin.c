@@ -0,0 +1,161 @@
+/*
+ * admin.c - Cache invalidation (PURGE) and listing for administrators
+ *
+ * "PURGE <url>" drops the cached object for a URL and its gzip variant;
+ * a URL ending in '*' drops every object whose key starts with the rest,
+ * so a '*' right after "http://host/" empties a host and one after
+ * "http://host/img/" one directory of it.
+ * "GET /__proxy/cache?prefix=<url>" lists what is cached under a
+ * prefix, one object per line. The prefix queries are answered by the
+ * cache's key trie, not by scanning it.
+ *
+ * Both are only answered for clients in the networks given to
+ * admin_allow(), loopback by default; everybody else gets a 403.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "ratelimit.h"
+#include "admin.h"
+
+typedef struct {
+    unsigned char net[16];
+    int plen;
+} admin_acl_t;
+
+static admin_acl_t acls[ADMIN_ACLS];
+static int nacls = -1;              /* -1 = loopback only, until configured */
+static unsigned long purges = 0, listings = 0, denied = 0;
+
+static const char reply_403[] =
+    "HTTP/1.0 403 Forbidden\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 10\r\n"
+    "Connection: close\r\n\r\n"
+    "Forbidden\n";
+
+/*
+ * admin_allow - let the networks in spec ("CIDR[,CIDR...]") purge and
+ * list the cache instead of loopback only. Returns -1 on a bad spec.
+ */
+int admin_allow(char *spec)
+{
+    char *p, *save = NULL;
+
+    nacls = 0;
+    for (p = strtok_r(spec, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        if (nacls == ADMIN_ACLS ||
+            cidr_parse(p, acls[nacls].net, &acls[nacls].plen) < 0)
+            return -1;
+        nacls++;
+    }
+    return 0;
+}
+
+/*
+ * admin_allowed - may the client at sa purge and list the cache
+ */
+int admin_allowed(const struct sockaddr *sa)
+{
+    static const unsigned char loop4[16] =
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 127, 0, 0, 0};
+    static const unsigned char loop6[16] =
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    int i;
+
+    if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
+        return 0;
+    if (nacls < 0)
+        return cidr_match(sa, loop4, 104) || cidr_match(sa, loop6, 128);
+    for (i = 0; i < nacls; i++)
+        if (cidr_match(sa, acls[i].net, acls[i].plen))
+            return 1;
+    return 0;
+}
+
+/*
+ * admin_deny - refuse a purge or listing from a client not allowed to
+ */
+void admin_deny(int fd)
+{
+    __atomic_fetch_add(&denied, 1, __ATOMIC_RELAXED);
+    rio_writen(fd, (void *)reply_403, sizeof(reply_403) - 1);
+}
+
+/*
+ * admin_purge - invalidate key and its variant (NULL = none), or with
+ * prefix set every key starting with key, and tell the client how many
+ * objects went: 200 if any did, 404 if nothing was cached there
+ */
+void admin_purge(int fd, const char *key, const char *variant, int prefix)
+{
+    char buf[MAXLINE], body[64];
+    int n;
+
+    n = cache_purge(key, prefix);
+    if (!prefix && variant)
+        n += cache_purge(variant, 0);
+    __atomic_fetch_add(&purges, 1, __ATOMIC_RELAXED);
+
+    snprintf(body, sizeof(body), "purged %d\n", n);
+    snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\n"
+             "Content-Type: text/plain\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n%s",
+             n > 0 ? "200 OK" : "404 Not Found", strlen(body), body);
+    rio_writen(fd, buf, strlen(buf));
+}
+
+/*
+ * admin_list - send the objects cached under prefix ("" = all) as
+ * "size age hits expires key" lines (expires: seconds left, "-" = never).
+ * The body is delimited by closing the connection.
+ */
+void admin_list(int fd, const char *prefix)
+{
+    static const char hdrs[] = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain\r\n"
+                               "Connection: close\r\n\r\n";
+    char buf[MAXBUF], exp[24];
+    cache_obj_t **v, *obj;
+    time_t now = time(NULL);
+    int i = 0, n, len = 0;
+
+    __atomic_fetch_add(&listings, 1, __ATOMIC_RELAXED);
+    n = cache_match(prefix, &v);
+    if (rio_writen(fd, (void *)hdrs, sizeof(hdrs) - 1) < 0)
+        i = n + 1;                  /* Client gone: just release them */
+    for (; i < n; i++) {
+        obj = v[i];
+        if (obj->expires)
+            snprintf(exp, sizeof(exp), "%ld", (long)(obj->expires - now));
+        else
+            strcpy(exp, "-");
+        if (len + strlen(obj->key) + 96 > sizeof(buf)) {
+            if (rio_writen(fd, buf, len) < 0)
+                break;
+            len = 0;
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "%zu %ld %lu %s %.*s\n",
+                        obj->bodylen, (long)(now - obj->stored),
+                        __atomic_load_n(&obj->hits, __ATOMIC_RELAXED), exp,
+                        (int)(sizeof(buf) - len - 96), obj->key);
+    }
+    if (len > 0 && i == n)
+        rio_writen(fd, buf, len);
+    for (i = 0; i < n; i++)
+        cache_release(v[i]);
+    free(v);
+}
+
+/*
+ * admin_report - render the purge and listing counters as text into buf
+ */
+int admin_report(char *buf, size_t len)
+{
+    return snprintf(buf, len, "admin     purges=%lu listings=%lu denied=%lu "
+                    "acl=%s\n",
+                    __atomic_load_n(&purges, __ATOMIC_RELAXED),
+                    __atomic_load_n(&listings, __ATOMIC_RELAXED),
+                    __atomic_load_n(&denied, __ATOMIC_RELAXED),
+                    nacls < 0 ? "loopback" : "custom");
+}
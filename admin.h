@@ -0,0 +1,20 @@
+/*
+ * admin.h - Cache invalidation (PURGE) and listing for administrators
+ */
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define ADMIN_ACLS 16               /* Most networks allowed to purge */
+#define CACHE_PATH "/__proxy/cache" /* Listing, ?prefix= to narrow it */
+
+int admin_allow(char *spec);
+int admin_allowed(const struct sockaddr *sa);
+void admin_purge(int fd, const char *key, const char *variant, int prefix);
+void admin_list(int fd, const char *prefix);
+void admin_deny(int fd);
+int admin_report(char *buf, size_t len);
+
+#endif /* __ADMIN_H__ */
@@ -0,0 +1,349 @@
+/*
+ * balancer.c - Backend pools and load balancing for reverse-proxy mode
+ *
+ * Pools and routes are set up from the command line before the proxy
+ * starts accepting and never change afterwards, so lookups need no
+ * locks; the per-server counters are updated with atomics.
+ *
+ * Health is tracked passively: a server that fails EJECT_FAILS requests
+ * in a row (connect failure, broken or 5xx response) is taken out of
+ * rotation for EJECT_SECS, after which the next request probes it.
+ */
+#include "csapp.h"
+#include "balancer.h"
+
+#define EJECT_FAILS 3
+#define EJECT_SECS  10
+
+/* One routing rule: requests for host (any if empty) under prefix */
+typedef struct {
+    char host[256];
+    char prefix[MAXLINE];
+    size_t plen;
+    pool_t *pool;
+} route_t;
+
+static pool_t pools[MAX_POOLS];
+static int npools = 0;
+static route_t routes[MAX_ROUTES];
+static int nroutes = 0;
+
+/*
+ * chash - 32-bit FNV-1a with a final avalanche, for ring positions
+ */
+uint32_t chash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+    uint32_t x = ((const ring_point_t *)a)->hash;
+    uint32_t y = ((const ring_point_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * chash_build - place RING_VNODES points on the ring for each of the n
+ * named members
+ */
+void chash_build(chash_ring_t *ring, char **names, int n)
+{
+    char buf[MAXLINE];
+    int i, v, len;
+
+    ring->n = n * RING_VNODES;
+    ring->points = Malloc(ring->n * sizeof(ring_point_t));
+    for (i = 0; i < n; i++)
+        for (v = 0; v < RING_VNODES; v++) {
+            len = snprintf(buf, sizeof(buf), "%s#%d", names[i], v);
+            ring->points[i * RING_VNODES + v].hash = chash(buf, len);
+            ring->points[i * RING_VNODES + v].member = i;
+        }
+    qsort(ring->points, ring->n, sizeof(ring_point_t), cmp_point);
+}
+
+/*
+ * chash_lookup - the first member clockwise from h for which usable()
+ * says yes (usable may be NULL). Returns -1 if there is none.
+ */
+int chash_lookup(chash_ring_t *ring, uint32_t h,
+                 int (*usable)(int member, void *arg), void *arg)
+{
+    int lo = 0, hi = ring->n, i, m;
+
+    if (ring->n == 0)
+        return -1;
+    while (lo < hi) {           /* First point with hash >= h */
+        int mid = (lo + hi) / 2;
+        if (ring->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = 0; i < ring->n; i++) {
+        m = ring->points[(lo + i) % ring->n].member;
+        if (usable == NULL || usable(m, arg))
+            return m;
+    }
+    return -1;
+}
+
+static pool_t *find_pool(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < npools; i++)
+        if (strlen(pools[i].name) == len && !strncmp(pools[i].name, name, len))
+            return &pools[i];
+    return NULL;
+}
+
+/*
+ * pool_define - add a pool from "name=host:port,host:port,..."
+ * Returns -1 on a malformed spec.
+ */
+int pool_define(char *spec)
+{
+    char *eq = strchr(spec, '='), *tok, *save = NULL, *colon;
+    pool_t *p;
+    backend_t *b;
+
+    if (eq == NULL || eq == spec || (size_t)(eq - spec) >= sizeof(p->name) ||
+        npools == MAX_POOLS || find_pool(spec, eq - spec))
+        return -1;
+    p = &pools[npools];
+    memset(p, 0, sizeof(pool_t));
+    memcpy(p->name, spec, eq - spec);
+    for (tok = strtok_r(eq + 1, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (p->n == MAX_BACKENDS || (colon = strrchr(tok, ':')) == NULL ||
+            (size_t)(colon - tok) >= sizeof(b->host) ||
+            strlen(colon + 1) >= sizeof(b->port) || colon[1] == '\0')
+            return -1;
+        b = &p->servers[p->n++];
+        memcpy(b->host, tok, colon - tok);
+        b->host[colon - tok] = '\0';
+        strcpy(b->port, colon + 1);
+    }
+    if (p->n == 0)
+        return -1;
+    npools++;
+    return 0;
+}
+
+/*
+ * pool_policy - set a pool's policy from "name=rr|least|hash"
+ */
+int pool_policy(char *spec)
+{
+    char *eq = strchr(spec, '=');
+    pool_t *p;
+
+    if (eq == NULL || (p = find_pool(spec, eq - spec)) == NULL)
+        return -1;
+    if (!strcmp(eq + 1, "rr"))
+        p->policy = LB_ROUND_ROBIN;
+    else if (!strcmp(eq + 1, "least"))
+        p->policy = LB_LEAST_OUTSTANDING;
+    else if (!strcmp(eq + 1, "hash"))
+        p->policy = LB_URL_HASH;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * route_add - add a route from "[host]/prefix=pool", e.g.
+ * "/static/=assets" or "api.example.com/=app"
+ */
+int route_add(char *spec)
+{
+    char *eq = strrchr(spec, '='), *slash = strchr(spec, '/');
+    route_t *r;
+
+    if (eq == NULL || slash == NULL || slash > eq || nroutes == MAX_ROUTES)
+        return -1;
+    r = &routes[nroutes];
+    if ((size_t)(slash - spec) >= sizeof(r->host) ||
+        (size_t)(eq - slash) >= sizeof(r->prefix) ||
+        (r->pool = find_pool(eq + 1, strlen(eq + 1))) == NULL)
+        return -1;
+    memcpy(r->host, spec, slash - spec);
+    r->host[slash - spec] = '\0';
+    memcpy(r->prefix, slash, eq - slash);
+    r->prefix[eq - slash] = '\0';
+    r->plen = eq - slash;
+    nroutes++;
+    return 0;
+}
+
+int pools_defined(void)
+{
+    return npools > 0;
+}
+
+/*
+ * pools_finish - build the hash rings once all pools are defined
+ */
+void pools_finish(void)
+{
+    char *names[MAX_BACKENDS], buf[MAX_BACKENDS][300];
+    int i, j;
+
+    for (i = 0; i < npools; i++) {
+        for (j = 0; j < pools[i].n; j++) {
+            snprintf(buf[j], sizeof(buf[j]), "%s:%s",
+                     pools[i].servers[j].host, pools[i].servers[j].port);
+            names[j] = buf[j];
+        }
+        chash_build(&pools[i].ring, names, pools[i].n);
+    }
+}
+
+/*
+ * route_match - the pool for a request: the longest matching prefix,
+ * preferring routes for this Host. With a single pool and no routes,
+ * everything goes to that pool. Returns NULL if nothing matches.
+ */
+pool_t *route_match(const char *host, const char *path)
+{
+    route_t *best = NULL;
+    size_t hlen = strcspn(host, ":");
+    int i, score, best_score = -1;
+
+    if (nroutes == 0)
+        return npools == 1 ? &pools[0] : NULL;
+    for (i = 0; i < nroutes; i++) {
+        route_t *r = &routes[i];
+        if (r->host[0] && (strlen(r->host) != hlen || strncasecmp(r->host, host, hlen)))
+            continue;
+        if (strncmp(path, r->prefix, r->plen))
+            continue;
+        score = (int)r->plen + (r->host[0] ? MAXLINE : 0);
+        if (score > best_score) {
+            best = r;
+            best_score = score;
+        }
+    }
+    return best ? best->pool : NULL;
+}
+
+/* Arguments for the usable() test of a pick */
+struct pick {
+    pool_t *pool;
+    backend_t **tried;
+    int ntried;
+    time_t now;
+    int ignore_health;
+};
+
+static int usable(int i, void *arg)
+{
+    struct pick *pk = arg;
+    backend_t *b = &pk->pool->servers[i];
+    int j;
+
+    for (j = 0; j < pk->ntried; j++)
+        if (pk->tried[j] == b)
+            return 0;
+    return pk->ignore_health ||
+        __atomic_load_n(&b->ejected_until, __ATOMIC_RELAXED) <= pk->now;
+}
+
+static int pick_once(struct pick *pk, const char *url)
+{
+    pool_t *p = pk->pool;
+    int i, k, best = -1, start;
+
+    switch (p->policy) {
+    case LB_URL_HASH:
+        return chash_lookup(&p->ring, chash(url, strlen(url)), usable, pk);
+    case LB_LEAST_OUTSTANDING:
+        start = __atomic_fetch_add(&p->rr, 1, __ATOMIC_RELAXED);
+        for (k = 0; k < p->n; k++) {   /* Rotate the start to break ties */
+            i = (start + k) % p->n;
+            if (usable(i, pk) &&
+                (best < 0 || p->servers[i].outstanding < p->servers[best].outstanding))
+                best = i;
+        }
+        return best;
+    default:
+        start = __atomic_fetch_add(&p->rr, 1, __ATOMIC_RELAXED);
+        for (k = 0; k < p->n; k++)
+            if (usable((start + k) % p->n, pk))
+                return (start + k) % p->n;
+        return -1;
+    }
+}
+
+/*
+ * pool_pick - choose a server for url, skipping the ones already tried
+ * for this request. Ejected servers are used only when nothing else is
+ * left. Returns NULL once every server has been tried.
+ */
+backend_t *pool_pick(pool_t *p, const char *url, backend_t *tried[], int ntried)
+{
+    struct pick pk = {p, tried, ntried, time(NULL), 0};
+    backend_t *b;
+    int i;
+
+    if ((i = pick_once(&pk, url)) < 0) {
+        pk.ignore_health = 1;
+        if ((i = pick_once(&pk, url)) < 0)
+            return NULL;
+    }
+    b = &p->servers[i];
+    __atomic_fetch_add(&b->outstanding, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&b->requests, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+/*
+ * pool_done - a request to b has finished; ok says whether it worked
+ */
+void pool_done(backend_t *b, int ok)
+{
+    __atomic_fetch_sub(&b->outstanding, 1, __ATOMIC_RELAXED);
+    if (ok) {
+        __atomic_store_n(&b->fails, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_fetch_add(&b->failures, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&b->fails, 1, __ATOMIC_RELAXED) >= EJECT_FAILS) {
+        __atomic_store_n(&b->ejected_until, time(NULL) + EJECT_SECS, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->fails, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&b->ejections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * pool_report - render per-server counters as text into buf
+ */
+int pool_report(char *buf, size_t len)
+{
+    static const char *policies[] = {"rr", "least", "hash"};
+    time_t now = time(NULL);
+    int i, j, n = 0;
+
+    for (i = 0; i < npools && (size_t)n < len; i++) {
+        n += snprintf(buf + n, len - n, "pool      %s policy=%s\n",
+                      pools[i].name, policies[pools[i].policy]);
+        for (j = 0; j < pools[i].n && (size_t)n < len; j++) {
+            backend_t *b = &pools[i].servers[j];
+            n += snprintf(buf + n, len - n,
+                          "  backend %s:%s outstanding=%d requests=%lu "
+                          "failures=%lu ejections=%lu%s\n", b->host, b->port,
+                          b->outstanding, b->requests, b->failures,
+                          b->ejections, b->ejected_until > now ? " EJECTED" : "");
+        }
+    }
+    return n;
+}
@@ -0,0 +1,63 @@
+/*
+ * balancer.h - Backend pools and load balancing for reverse-proxy mode
+ */
+#ifndef __BALANCER_H__
+#define __BALANCER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define MAX_POOLS     16
+#define MAX_BACKENDS  32
+#define MAX_ROUTES    64
+#define RING_VNODES   160   /* Ring points per server */
+
+/* Balancing policies */
+enum { LB_ROUND_ROBIN, LB_LEAST_OUTSTANDING, LB_URL_HASH };
+
+/* Consistent-hash ring: sorted points, each owned by one member */
+typedef struct {
+    uint32_t hash;
+    int member;
+} ring_point_t;
+
+typedef struct {
+    int n;
+    ring_point_t *points;
+} chash_ring_t;
+
+typedef struct {
+    char host[256];
+    char port[8];
+    int outstanding;          /* Requests in flight (atomic) */
+    int fails;                /* Consecutive failures */
+    time_t ejected_until;     /* Out of rotation until then */
+    unsigned long requests, failures, ejections;
+} backend_t;
+
+typedef struct {
+    char name[64];
+    int policy;
+    int n;
+    backend_t servers[MAX_BACKENDS];
+    unsigned rr;              /* Round-robin cursor (atomic) */
+    chash_ring_t ring;
+} pool_t;
+
+uint32_t chash(const char *s, size_t len);
+void chash_build(chash_ring_t *ring, char **names, int n);
+int chash_lookup(chash_ring_t *ring, uint32_t h,
+                 int (*usable)(int member, void *arg), void *arg);
+
+int pool_define(char *spec);
+int pool_policy(char *spec);
+int route_add(char *spec);
+int pools_defined(void);
+void pools_finish(void);
+pool_t *route_match(const char *host, const char *path);
+backend_t *pool_pick(pool_t *p, const char *url, backend_t *tried[], int ntried);
+void pool_done(backend_t *b, int ok);
+int pool_report(char *buf, size_t len);
+
+#endif /* __BALANCER_H__ */
@@ -0,0 +1,362 @@
+/*
+ * bench.c - Microbenchmarks for the proxy's hot-path primitives
+ *
+ * Each benchmark replays inputs from the recorded corpora in corpus/
+ * (request lines and origin response headers) through one primitive.
+ * After a warmup, the benchmark is calibrated so one repetition runs
+ * for about -t milliseconds, then timed for -r repetitions. Reported
+ * per benchmark: median, min and stddev of ns/op across repetitions
+ * and the input throughput at the median.
+ *
+ * usage: benchmark [-r reps] [-t ms] [-c corpusdir] [name-filter]
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include "csapp.h"
+#include "http.h"
+#include "cache.h"
+#include "cachekey.h"
+#include "ratelimit.h"
+
+#define MAX_ITEMS 4096
+
+struct bench {
+    const char *name;
+    size_t (*run)(long n);   /* Do n operations, return bytes consumed */
+};
+
+/* Corpora */
+static char *uris[MAX_ITEMS];
+static int nuris = 0;
+static char *hdrs[MAX_ITEMS];
+static int nhdrs = 0;
+static int hdrfd = -1;       /* Header corpus replayed through rio */
+
+static volatile long sink;   /* Keeps results alive under optimization */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * load_lines - read the non-empty lines of path into v (keeping CRLF)
+ */
+static int load_lines(const char *path, char **v, int max, int keep_blank)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    int n = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "bench: cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (n < max && fgets(line, sizeof(line), fp)) {
+        if (!keep_blank && (line[0] == '\r' || line[0] == '\n'))
+            continue;
+        v[n++] = strdup(line);
+    }
+    fclose(fp);
+    return n;
+}
+
+static void load_corpus(const char *dir)
+{
+    char path[MAXLINE], *lines[MAX_ITEMS], method[MAXLINE], uri[MAXLINE];
+    char tmpl[] = "/tmp/bench-hdrXXXXXX";
+    int i, n;
+
+    snprintf(path, sizeof(path), "%s/requests.txt", dir);
+    n = load_lines(path, lines, MAX_ITEMS, 0);
+    for (i = 0; i < n; i++) {
+        if (sscanf(lines[i], "%s %s", method, uri) == 2)
+            uris[nuris++] = strdup(uri);
+        free(lines[i]);
+    }
+
+    snprintf(path, sizeof(path), "%s/headers.txt", dir);
+    nhdrs = load_lines(path, hdrs, MAX_ITEMS, 1);
+
+    /* Replay file for rio: the header corpus repeated to ~64KB */
+    if ((hdrfd = mkstemp(tmpl)) < 0)
+        unix_error("mkstemp");
+    unlink(tmpl);
+    for (n = 0; n < 65536; )
+        for (i = 0; i < nhdrs; i++) {
+            Write(hdrfd, hdrs[i], strlen(hdrs[i]));
+            n += strlen(hdrs[i]);
+        }
+
+    if (nuris == 0 || nhdrs == 0)
+        app_error("bench: empty corpus");
+}
+
+/*
+ * Benchmarks
+ */
+static size_t bench_parse_uri(long n)
+{
+    char hostname[MAXLINE], pathname[MAXLINE], port[20];
+    size_t bytes = 0;
+    long i;
+    int k = 0;
+
+    for (i = 0; i < n; i++) {
+        sink += parse_uri(uris[k], hostname, pathname, port);
+        bytes += strlen(uris[k]);
+        if (++k == nuris)
+            k = 0;
+    }
+    return bytes;
+}
+
+/* The header tests send_data() used to run on every response line */
+static size_t bench_startsWith(long n)
+{
+    size_t bytes = 0;
+    long i;
+    int k = 0;
+
+    for (i = 0; i < n; i++) {
+        sink += startsWith("Content-Type: text/html", hdrs[k]);
+        sink += startsWith("Content-Length:", hdrs[k]);
+        bytes += strlen(hdrs[k]);
+        if (++k == nhdrs)
+            k = 0;
+    }
+    return bytes;
+}
+
+/* What send_data() runs on every response line now */
+static size_t bench_http_resp_header(long n)
+{
+    http_resp_t r;
+    size_t bytes = 0;
+    long i;
+    int k = 0;
+
+    http_resp_init(&r);
+    for (i = 0; i < n; i++) {
+        sink += http_resp_header(&r, hdrs[k]);
+        bytes += strlen(hdrs[k]);
+        if (++k == nhdrs)
+            k = 0;
+    }
+    sink += r.len;
+    return bytes;
+}
+
+static size_t bench_rio_readlineb(long n)
+{
+    static rio_t rio;
+    char line[MAXLINE];
+    size_t bytes = 0;
+    ssize_t rc;
+    long i;
+
+    Lseek(hdrfd, 0, SEEK_SET);
+    rio_readinitb(&rio, hdrfd);
+    for (i = 0; i < n; i++) {
+        if ((rc = rio_readlineb(&rio, line, MAXLINE)) <= 0) {
+            Lseek(hdrfd, 0, SEEK_SET);
+            rio_readinitb(&rio, hdrfd);
+            rc = rio_readlineb(&rio, line, MAXLINE);
+        }
+        bytes += rc;
+    }
+    return bytes;
+}
+
+static size_t bench_format_log_entry(long n)
+{
+    char logstring[MAXLINE], host[MAXLINE], path[MAXLINE], port[20];
+    size_t bytes = 0;
+    long i;
+    int k = 0;
+
+    for (i = 0; i < n; i++) {
+        parse_uri(uris[k], host, path, port);
+        format_log_entry(logstring, "127.0.0.1", host, 11595, NULL);
+        bytes += strlen(logstring);
+        if (++k == nuris)
+            k = 0;
+    }
+    sink += logstring[0];
+    return bytes;
+}
+
+/* A warm cache holding every corpus URI; half the lookups miss */
+static size_t bench_cache_lookup(long n)
+{
+    static int filled = 0;
+    char miss[MAXLINE];
+    cache_obj_t *obj;
+    size_t bytes = 0;
+    long i;
+    int k = 0;
+
+    if (!filled) {
+        cache_init(1 << 30, 1 << 20, 1);
+        for (k = 0; k < nuris; k++)
+            cache_insert(uris[k], strdup("HTTP/1.0 200 OK\r\n\r\n"), 19,
+                         strdup("body"), 4, 0);
+        filled = 1;
+        k = 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (i & 1) {
+            snprintf(miss, sizeof(miss), "%s?miss", uris[k]);
+            obj = cache_lookup(miss);
+        } else
+            obj = cache_lookup(uris[k]);
+        if (obj) {
+            sink += obj->bodylen;
+            cache_release(obj);
+        }
+        bytes += strlen(uris[k]);
+        if (++k == nuris)
+            k = 0;
+    }
+    return bytes;
+}
+
+/* Cache key of every corpus URI: normalization plus its hash */
+static size_t bench_key_normalize(long n)
+{
+    char key[MAXLINE];
+    size_t bytes = 0;
+    long i;
+    int k = 0, len;
+
+    for (i = 0; i < n; i++) {
+        if ((len = key_normalize(uris[k], key, sizeof(key))) > 0)
+            sink += key_hash(key, len);
+        bytes += strlen(uris[k]);
+        if (++k == nuris)
+            k = 0;
+    }
+    return bytes;
+}
+
+/* The per-request rate-limit check for 1024 clients under a limit
+   loose enough that none is refused */
+static size_t bench_ratelimit_admit(long n)
+{
+    static struct sockaddr_in addrs[1024];
+    static int ready = 0;
+    char rule[] = "10.0.0.0/8=1000000000";
+    rl_bucket_t *b;
+    uint64_t now = now_ns();
+    long i;
+
+    if (!ready) {
+        ratelimit_rule(rule);
+        for (i = 0; i < 1024; i++) {
+            addrs[i].sin_family = AF_INET;
+            addrs[i].sin_addr.s_addr = htonl(0x0a000000 + i * 7919);
+        }
+        ready = 1;
+    }
+    for (i = 0; i < n; i++) {
+        sink += ratelimit_admit((SA *)&addrs[i & 1023], now + i, &b);
+        ratelimit_charge(b, 100);
+    }
+    return n * sizeof(struct sockaddr_in);
+}
+
+static struct bench benches[] = {
+    {"parse_uri",        bench_parse_uri},
+    {"startsWith",       bench_startsWith},
+    {"http_resp_header", bench_http_resp_header},
+    {"rio_readlineb",    bench_rio_readlineb},
+    {"format_log_entry", bench_format_log_entry},
+    {"cache_lookup",     bench_cache_lookup},
+    {"key_normalize",    bench_key_normalize},
+    {"ratelimit_admit",  bench_ratelimit_admit},
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * run_bench - warm up, calibrate and time one benchmark
+ */
+static void run_bench(struct bench *b, int reps, double rep_ms)
+{
+    double *nsop = Malloc(reps * sizeof(double));
+    double mean = 0, var = 0, med;
+    size_t bytes = 0;
+    uint64_t t0, dt;
+    long n = 1;
+    int r;
+
+    /* Warm up and calibrate: grow n until a run takes rep_ms */
+    while (1) {
+        t0 = now_ns();
+        b->run(n);
+        dt = now_ns() - t0;
+        if (dt >= rep_ms * 1e6 / 4)
+            break;
+        n *= 2;
+    }
+    n = (long)(n * (rep_ms * 1e6 / dt)) + 1;
+    b->run(n);
+
+    for (r = 0; r < reps; r++) {
+        t0 = now_ns();
+        bytes = b->run(n);
+        dt = now_ns() - t0;
+        nsop[r] = (double)dt / n;
+        mean += nsop[r];
+    }
+    mean /= reps;
+    for (r = 0; r < reps; r++)
+        var += (nsop[r] - mean) * (nsop[r] - mean);
+    var /= reps;
+    qsort(nsop, reps, sizeof(double), cmp_double);
+    med = nsop[reps / 2];
+
+    printf("%-18s %10.1f %10.1f %9.1f %11.1f %12ld\n", b->name, med,
+           nsop[0], sqrt(var), (double)bytes / n / med * 1e9 / 1e6, n);
+    Free(nsop);
+}
+
+int main(int argc, char **argv)
+{
+    char *dir = "corpus";
+    double rep_ms = 100;
+    int c, reps = 10;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "r:t:c:")) != -1) {
+        switch (c) {
+        case 'r': reps = atoi(optarg); break;
+        case 't': rep_ms = atof(optarg); break;
+        case 'c': dir = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-r reps] [-t ms] [-c corpusdir] "
+                    "[name-filter]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (reps <= 0 || rep_ms <= 0)
+        app_error("bench: -r and -t must be positive");
+    load_corpus(dir);
+
+    printf("%d reps x %.0f ms, %d URIs, %d header lines\n",
+           reps, rep_ms, nuris, nhdrs);
+    printf("%-18s %10s %10s %9s %11s %12s\n", "benchmark", "ns/op(med)",
+           "ns/op(min)", "stddev", "MB/s(med)", "ops/rep");
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+        if (optind == argc || strstr(benches[i].name, argv[optind]))
+            run_bench(&benches[i], reps, rep_ms);
+    return 0;
+}
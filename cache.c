@@ -0,0 +1,737 @@
+/*
+ * cache.c - In-memory web object cache for the proxy
+ *
+ * A chained hash table over all objects plus a list of them, both
+ * guarded by one readers-writer lock. Hits only take the read lock:
+ * recency is tracked with an atomic clock stamp on the object instead
+ * of moving it in a list. For eviction every slab class keeps its
+ * objects in a list of its own, newest at the head, and the writer
+ * that needs space works from the tail like CLOCK: an object hit since
+ * it was queued goes back to the head, and the first one that was not
+ * is the victim. At most LRU_SAMPLE objects are looked at; if all of
+ * them were hit, the least recently used of them goes. Every slab page
+ * also lists the objects holding chunks in it, so the objects of a
+ * page the allocator moves are found without a walk over the shard.
+ *
+ * Each object lives in one chunk of the slab allocator (slab.c), which
+ * holds exactly the cache's budget: an insert that finds its size
+ * class full evicts that class's oldest object, or the objects of a
+ * page the allocator moves over from another class. Slab pages are
+ * CACHE_BLOCK bytes. A response that does not fit in one keeps its key
+ * and headers in a chunk and its body in a list of page-sized blocks,
+ * so objects of any size up to the limit are stored without large
+ * contiguous allocations, and blocks are reclaimed by evicting the
+ * least recently used large object, block class and all. When no
+ * object holds blocks to give up (the insert itself has them all), a
+ * page is taken from another class instead.
+ *
+ * A radix trie (trie.c) indexes the keys of each shard as well, so the
+ * objects under a URL prefix are found without scanning the table.
+ * Purging marks them first, which makes every lookup miss at once, and
+ * then unlinks them in batches of PURGE_BATCH, so the write lock is
+ * never held long enough for readers to notice.
+ *
+ * On NUMA machines the cache is split into one shard per node, each
+ * with its own table, lock and slabs in node-local memory, and an
+ * equal part of the budget. Threads insert into their own node's shard
+ * and look there first; the other shards are searched on a local miss.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "cachekey.h"
+#include "http.h"
+#include "slab.h"
+#include "trie.h"
+#include "numa.h"
+
+#define CACHE_BUCKETS 4096
+#define PURGE_BATCH 64                    /* Unlinked per write lock */
+#define LRU_SAMPLE 32                     /* Most objects a victim search sees */
+#define LRU_LARGE SLAB_MAX_CLASSES        /* Eviction list of large objects */
+
+typedef struct {
+    cache_obj_t *buckets[CACHE_BUCKETS];
+    cache_obj_t *head;                    /* All objects, newest first */
+    cache_obj_t *lru_head[LRU_LARGE + 1]; /* Eviction list of each class, */
+    cache_obj_t *lru_tail[LRU_LARGE + 1]; /* and of the large objects */
+    page_link_t **pages;                  /* Objects with chunks in each page */
+    trie_node_t *trie;                    /* The same, by key prefix */
+    pthread_rwlock_t lock;
+    size_t used;
+    unsigned long nobjs;
+    unsigned long hits, remote_hits, inserts, evictions;
+    unsigned long large;                  /* Objects kept in blocks */
+    int block_cls;                        /* Slab class of the blocks */
+    slab_t slab;
+} shard_t;
+
+static shard_t *shards[NUMA_MAX_NODES];
+static int nshards = 1;
+static size_t capacity, max_object;
+static uint64_t lru_clock = 0;
+static unsigned long misses = 0, purges = 0;
+
+/*
+ * cache_init - set the memory budget and the largest object (key,
+ * headers and body) that will be stored, split over nshard shards
+ * (shard i on NUMA node i)
+ */
+void cache_init(size_t cap, size_t max_obj, int nshard)
+{
+    int i;
+
+    capacity = cap;
+    nshards = nshard > 0 && nshard <= NUMA_MAX_NODES ? nshard : 1;
+    max_object = max_obj < cap / nshards ? max_obj : cap / nshards;
+    for (i = 0; i < nshards; i++) {
+        if ((shards[i] = numa_alloc(sizeof(shard_t), i)) == NULL)
+            unix_error("cache_init: mmap");
+        pthread_rwlock_init(&shards[i]->lock, NULL);
+        slab_init(&shards[i]->slab, cap / nshards, CACHE_BLOCK, i);
+        if ((shards[i]->pages = numa_alloc(shards[i]->slab.max_pages *
+                                           sizeof(page_link_t *), i)) == NULL)
+            unix_error("cache_init: mmap");
+        shards[i]->block_cls = slab_class(&shards[i]->slab, CACHE_BLOCK);
+    }
+}
+
+size_t cache_max_object(void)
+{
+    return max_object;
+}
+
+/*
+ * local - the shard of the calling thread's node
+ */
+static int local(void)
+{
+    return nshards == 1 ? 0 : numa_node() % nshards;
+}
+
+static void obj_free(cache_obj_t *obj)
+{
+    slab_t *slab = &shards[obj->shard]->slab;
+    int i;
+
+    for (i = 1; i <= obj->nblocks; i++)
+        slab_free(slab, obj->iov[i].iov_base);
+    slab_free(slab, obj);
+}
+
+/*
+ * page_add - put each chunk of obj on the list of its page
+ */
+static void page_add(shard_t *s, cache_obj_t *obj)
+{
+    page_link_t *l, **head;
+    int i;
+
+    for (i = 0; i <= obj->nblocks; i++) {
+        l = &obj->plink[i];
+        head = &s->pages[slab_page(&s->slab, i ? obj->iov[i].iov_base :
+                                   (void *)obj)];
+        l->obj = obj;
+        l->prev = NULL;
+        if ((l->next = *head) != NULL)
+            (*head)->prev = l;
+        *head = l;
+    }
+}
+
+/*
+ * page_remove - take each chunk of obj off the list of its page
+ */
+static void page_remove(shard_t *s, cache_obj_t *obj)
+{
+    page_link_t *l;
+    int i;
+
+    for (i = 0; i <= obj->nblocks; i++) {
+        l = &obj->plink[i];
+        if (l->prev)
+            l->prev->next = l->next;
+        else
+            s->pages[slab_page(&s->slab, i ? obj->iov[i].iov_base :
+                               (void *)obj)] = l->next;
+        if (l->next)
+            l->next->prev = l->prev;
+    }
+}
+
+/*
+ * lru_push - put obj at the head of eviction list l
+ */
+static void lru_push(shard_t *s, int l, cache_obj_t *obj)
+{
+    int k = l == LRU_LARGE;
+
+    obj->lprev[k] = NULL;
+    obj->lnext[k] = s->lru_head[l];
+    if (s->lru_head[l])
+        s->lru_head[l]->lprev[k] = obj;
+    else
+        s->lru_tail[l] = obj;
+    s->lru_head[l] = obj;
+    obj->queued[k] = __atomic_load_n(&lru_clock, __ATOMIC_RELAXED);
+}
+
+/*
+ * lru_remove - take obj off eviction list l
+ */
+static void lru_remove(shard_t *s, int l, cache_obj_t *obj)
+{
+    int k = l == LRU_LARGE;
+
+    if (obj->lprev[k])
+        obj->lprev[k]->lnext[k] = obj->lnext[k];
+    else
+        s->lru_head[l] = obj->lnext[k];
+    if (obj->lnext[k])
+        obj->lnext[k]->lprev[k] = obj->lprev[k];
+    else
+        s->lru_tail[l] = obj->lprev[k];
+}
+
+/*
+ * unlink_obj - remove obj from its shard's table and lists. The caller
+ * holds the shard's write lock; the object is freed once its last
+ * reference is dropped.
+ */
+static void unlink_obj(shard_t *s, cache_obj_t *obj)
+{
+    cache_obj_t **pp = &s->buckets[obj->hash & (CACHE_BUCKETS - 1)];
+
+    while (*pp != obj)
+        pp = &(*pp)->hnext;
+    *pp = obj->hnext;
+    trie_remove(&s->trie, obj->key);
+    if (obj->prev)
+        obj->prev->next = obj->next;
+    else
+        s->head = obj->next;
+    if (obj->next)
+        obj->next->prev = obj->prev;
+    lru_remove(s, obj->cls, obj);
+    page_remove(s, obj);
+    s->used -= obj->size;
+    s->nobjs--;
+    if (obj->nblocks > 0) {
+        lru_remove(s, LRU_LARGE, obj);
+        s->large--;
+    }
+    cache_release(obj);
+}
+
+/*
+ * find - the object under key in shard s; h is key_hash() of the key
+ */
+static cache_obj_t *find(shard_t *s, const char *key, uint64_t h)
+{
+    cache_obj_t *obj;
+
+    for (obj = s->buckets[h & (CACHE_BUCKETS - 1)]; obj; obj = obj->hnext)
+        if (obj->hash == h && !strcmp(obj->key, key))
+            return obj;
+    return NULL;
+}
+
+/*
+ * shard_lookup - cache_lookup() within shard s
+ */
+static cache_obj_t *shard_lookup(shard_t *s, const char *key, uint64_t h)
+{
+    cache_obj_t *obj;
+    int expired = 0;
+
+    pthread_rwlock_rdlock(&s->lock);
+    obj = find(s, key, h);
+    if (obj != NULL && __atomic_load_n(&obj->purged, __ATOMIC_ACQUIRE))
+        obj = NULL;                 /* Being purged: a miss already */
+    else if (obj != NULL) {
+        if (obj->expires && obj->expires <= time(NULL)) {
+            expired = 1;
+            obj = NULL;
+        } else {
+            __atomic_fetch_add(&obj->refcnt, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&obj->last_use,
+                             __atomic_add_fetch(&lru_clock, 1, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+            __atomic_fetch_add(&obj->hits, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+
+    if (expired) {
+        pthread_rwlock_wrlock(&s->lock);
+        if ((obj = find(s, key, h)) != NULL && obj->expires &&
+            obj->expires <= time(NULL))
+            unlink_obj(s, obj);
+        pthread_rwlock_unlock(&s->lock);
+        obj = NULL;
+    }
+    return obj;
+}
+
+/*
+ * cache_lookup - return a referenced object for key, or NULL. Expired
+ * objects are dropped on the way. Release the result with
+ * cache_release().
+ */
+cache_obj_t *cache_lookup(const char *key)
+{
+    uint64_t h = key_hash(key, strlen(key));
+    int me = local(), i;
+    cache_obj_t *obj;
+
+    if ((obj = shard_lookup(shards[me], key, h)) != NULL) {
+        __atomic_fetch_add(&shards[me]->hits, 1, __ATOMIC_RELAXED);
+        return obj;
+    }
+    for (i = 0; i < nshards; i++)
+        if (i != me && (obj = shard_lookup(shards[i], key, h)) != NULL) {
+            __atomic_fetch_add(&shards[i]->remote_hits, 1, __ATOMIC_RELAXED);
+            return obj;
+        }
+    __atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * cache_contains - is there a fresh object under key? Unlike
+ * cache_lookup() this touches neither the LRU order nor the counters.
+ */
+int cache_contains(const char *key)
+{
+    uint64_t h = key_hash(key, strlen(key));
+    cache_obj_t *obj;
+    int i, found = 0;
+
+    for (i = 0; i < nshards && !found; i++) {
+        pthread_rwlock_rdlock(&shards[i]->lock);
+        found = (obj = find(shards[i], key, h)) != NULL && !obj->purged &&
+                (obj->expires == 0 || obj->expires > time(NULL));
+        pthread_rwlock_unlock(&shards[i]->lock);
+    }
+    return found;
+}
+
+/*
+ * cache_release - drop a reference taken by cache_lookup()
+ */
+void cache_release(cache_obj_t *obj)
+{
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        obj_free(obj);
+}
+
+/*
+ * lru_scan - the victim from the tail of eviction list l: the first
+ * object not hit since it was queued, moving those that were back to
+ * the head, or the least recently used of the LRU_SAMPLE looked at.
+ * NULL if the list is empty.
+ */
+static cache_obj_t *lru_scan(shard_t *s, int l)
+{
+    cache_obj_t *obj, *victim = NULL;
+    int k = l == LRU_LARGE, i;
+
+    for (i = 0; i < LRU_SAMPLE && (obj = s->lru_tail[l]) != NULL; i++) {
+        if (obj->last_use <= obj->queued[k])
+            return obj;
+        if (!victim || obj->last_use < victim->last_use)
+            victim = obj;
+        lru_remove(s, l, obj);
+        lru_push(s, l, obj);
+    }
+    return victim;
+}
+
+/*
+ * lru_victim - a least recently used object holding chunks of slab
+ * class cls, or NULL. Caller holds the write lock.
+ */
+static cache_obj_t *lru_victim(shard_t *s, int cls)
+{
+    cache_obj_t *victim = lru_scan(s, cls), *large;
+
+    if (cls == s->block_cls && (large = lru_scan(s, LRU_LARGE)) != NULL &&
+        (!victim || large->last_use < victim->last_use))
+        victim = large;
+    return victim;
+}
+
+/*
+ * evict_page - drop every object stored in slab page pg. Caller holds
+ * the write lock.
+ */
+static void evict_page(shard_t *s, int pg)
+{
+    while (s->pages[pg] != NULL) {     /* Unlinking takes it off the list */
+        unlink_obj(s, s->pages[pg]->obj);
+        s->evictions++;
+    }
+}
+
+/*
+ * alloc_chunk - a chunk of slab class cls in shard s, evicting to make
+ * room. Returns NULL if none could be had.
+ */
+static void *alloc_chunk(shard_t *s, int cls)
+{
+    cache_obj_t *victim;
+    void *p;
+    int pg, ok = 1;
+
+    while (ok && (p = slab_alloc(&s->slab, cls)) == NULL) {
+        pthread_rwlock_wrlock(&s->lock);
+        victim = lru_victim(s, cls);
+        if ((pg = slab_rebalance(&s->slab, cls, victim == NULL)) >= 0)
+            evict_page(s, pg);
+        else if (pg == -2 || victim == NULL)
+            ok = 0;                 /* Nothing to evict yet: do not store */
+        else {
+            unlink_obj(s, victim);
+            s->evictions++;
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return ok ? p : NULL;
+}
+
+/*
+ * gather - copy the next len bytes of the pieces src (from piece *i,
+ * offset *off) to dst
+ */
+static void gather(char *dst, size_t len, const struct iovec *src, int *i,
+                   size_t *off)
+{
+    size_t n;
+
+    while (len > 0) {
+        n = src[*i].iov_len - *off;
+        if (n > len)
+            n = len;
+        memcpy(dst, (char *)src[*i].iov_base + *off, n);
+        dst += n;
+        len -= n;
+        if ((*off += n) == src[*i].iov_len) {
+            (*i)++;
+            *off = 0;
+        }
+    }
+}
+
+/*
+ * new_obj - copy a response into shard me, evicting to make room. The
+ * object's chunk holds the object, key, headers (both NUL-terminated),
+ * the iovec list of the response and the page links of its chunks,
+ * then the body if the whole fits in one chunk; otherwise the body
+ * goes into CACHE_BLOCK blocks.
+ * Returns NULL if the chunks could not be had.
+ */
+static cache_obj_t *new_obj(int me, const char *key, const char *hdrs,
+                            size_t hdrlen, const struct iovec *body,
+                            int nbody, size_t bodylen, time_t expires)
+{
+    shard_t *s = shards[me];
+    size_t keylen = strlen(key), off = 0;
+    size_t head = (sizeof(cache_obj_t) + keylen + 1 + hdrlen + 1 + 7) & ~(size_t)7;
+    int cls, nblocks = 0, i, src = 0;
+    cache_obj_t *obj;
+    char *p;
+
+    if ((cls = slab_class(&s->slab, head + 2 * sizeof(struct iovec) +
+                          sizeof(page_link_t) + bodylen)) < 0) {
+        nblocks = (bodylen + CACHE_BLOCK - 1) / CACHE_BLOCK;
+        if ((cls = slab_class(&s->slab, head + (nblocks + 1) *
+                              (sizeof(struct iovec) + sizeof(page_link_t)))) < 0)
+            return NULL;
+    }
+    if ((obj = alloc_chunk(s, cls)) == NULL)
+        return NULL;
+
+    memset(obj, 0, sizeof(cache_obj_t));
+    obj->iov = (struct iovec *)((char *)obj + head);
+    for (i = 1; i <= nblocks; i++)
+        if ((obj->iov[i].iov_base = alloc_chunk(s, s->block_cls)) == NULL) {
+            while (--i > 0)
+                slab_free(&s->slab, obj->iov[i].iov_base);
+            slab_free(&s->slab, obj);
+            return NULL;
+        }
+
+    obj->key = (char *)(obj + 1);
+    memcpy(obj->key, key, keylen + 1);
+    obj->hash = key_hash(key, keylen);
+    obj->hdrs = obj->key + keylen + 1;
+    memcpy(obj->hdrs, hdrs, hdrlen);
+    obj->hdrs[hdrlen] = '\0';
+    obj->hdrlen = hdrlen;
+    obj->status = http_status(obj->hdrs);
+    obj->iov[0].iov_base = obj->hdrs;
+    obj->iov[0].iov_len = hdrlen;
+    obj->plink = (page_link_t *)(obj->iov + (nblocks ? nblocks + 1 : 2));
+    if (nblocks == 0) {
+        p = (char *)(obj->plink + 1);
+        gather(p, bodylen, body, &src, &off);
+        obj->iov[1].iov_base = p;
+        obj->iov[1].iov_len = bodylen;
+        obj->niov = 2;
+    } else {
+        for (i = 1; i <= nblocks; i++) {
+            obj->iov[i].iov_len = i < nblocks ? CACHE_BLOCK :
+                                  bodylen - (size_t)(nblocks - 1) * CACHE_BLOCK;
+            gather(obj->iov[i].iov_base, obj->iov[i].iov_len, body, &src, &off);
+        }
+        obj->niov = nblocks + 1;
+    }
+    obj->bodylen = bodylen;
+    obj->nblocks = nblocks;
+    obj->shard = me;
+    obj->cls = cls;
+    obj->size = slab_chunk_size(&s->slab, cls) +
+                (size_t)nblocks * slab_chunk_size(&s->slab, s->block_cls);
+    obj->stored = time(NULL);
+    obj->expires = expires;
+    obj->refcnt = 1;                       /* The cache's own reference */
+    return obj;
+}
+
+/*
+ * insert - link obj into its shard, replacing any older copy there or
+ * in another shard
+ */
+static void insert(cache_obj_t *obj)
+{
+    shard_t *s = shards[obj->shard];
+    cache_obj_t *old;
+    unsigned b;
+    int i;
+
+    for (i = 0; i < nshards; i++)
+        if (i != obj->shard) {
+            pthread_rwlock_wrlock(&shards[i]->lock);
+            if ((old = find(shards[i], obj->key, obj->hash)) != NULL)
+                unlink_obj(shards[i], old);
+            pthread_rwlock_unlock(&shards[i]->lock);
+        }
+
+    pthread_rwlock_wrlock(&s->lock);
+    if ((old = find(s, obj->key, obj->hash)) != NULL)
+        unlink_obj(s, old);
+    obj->last_use = __atomic_add_fetch(&lru_clock, 1, __ATOMIC_RELAXED);
+    b = obj->hash & (CACHE_BUCKETS - 1);
+    obj->hnext = s->buckets[b];
+    s->buckets[b] = obj;
+    trie_insert(&s->trie, obj->key, obj);
+    obj->next = s->head;
+    if (s->head)
+        s->head->prev = obj;
+    s->head = obj;
+    lru_push(s, obj->cls, obj);
+    page_add(s, obj);
+    s->used += obj->size;
+    s->nobjs++;
+    s->inserts++;
+    if (obj->nblocks > 0) {
+        lru_push(s, LRU_LARGE, obj);
+        s->large++;
+    }
+    pthread_rwlock_unlock(&s->lock);
+}
+
+/*
+ * cache_insert - store a response under key, replacing any older copy.
+ * The response is copied into the cache's own memory; the malloc'd
+ * hdrs and body buffers are freed either way. Returns 0 if stored.
+ */
+int cache_insert(const char *key, char *hdrs, size_t hdrlen,
+                 char *body, size_t bodylen, time_t expires)
+{
+    int rc = cache_insert_copy(key, hdrs, hdrlen, body, bodylen,
+                               time(NULL), expires);
+
+    free(hdrs);
+    free(body);
+    return rc;
+}
+
+/*
+ * cache_insert_copy - like cache_insert(), but leaves hdrs and body to
+ * the caller, and the object counts as stored at the given time
+ */
+int cache_insert_copy(const char *key, const char *hdrs, size_t hdrlen,
+                      const char *body, size_t bodylen, time_t stored,
+                      time_t expires)
+{
+    struct iovec v;
+
+    v.iov_base = (char *)body;
+    v.iov_len = bodylen;
+    return cache_insertv(key, hdrs, hdrlen, &v, 1, stored, expires);
+}
+
+/*
+ * cache_insertv - like cache_insert_copy(), for a body given as the
+ * nbody pieces of body
+ */
+int cache_insertv(const char *key, const char *hdrs, size_t hdrlen,
+                  const struct iovec *body, int nbody, time_t stored,
+                  time_t expires)
+{
+    cache_obj_t *obj;
+    size_t bodylen = 0;
+    int i;
+
+    for (i = 0; i < nbody; i++)
+        bodylen += body[i].iov_len;
+    if (strlen(key) + hdrlen + bodylen > max_object ||
+        (obj = new_obj(local(), key, hdrs, hdrlen, body, nbody, bodylen,
+                       expires)) == NULL)
+        return -1;
+    obj->stored = stored;
+    insert(obj);
+    return 0;
+}
+
+/*
+ * cache_collect - fill v with references to up to max fresh objects,
+ * for a snapshot. Returns how many; release each with cache_release().
+ */
+int cache_collect(cache_obj_t **v, int max)
+{
+    cache_obj_t *obj;
+    time_t now = time(NULL);
+    int i, n = 0;
+
+    for (i = 0; i < nshards; i++) {
+        pthread_rwlock_rdlock(&shards[i]->lock);
+        for (obj = shards[i]->head; obj && n < max; obj = obj->next)
+            if (!obj->purged && (obj->expires == 0 || obj->expires > now)) {
+                __atomic_fetch_add(&obj->refcnt, 1, __ATOMIC_RELAXED);
+                v[n++] = obj;
+            }
+        pthread_rwlock_unlock(&shards[i]->lock);
+    }
+    return n;
+}
+
+/* Objects gathered by a trie walk */
+struct matches {
+    cache_obj_t **v;
+    int n, max;
+};
+
+static void add_match(void *val, void *arg)
+{
+    struct matches *m = (struct matches *)arg;
+    cache_obj_t *obj = (cache_obj_t *)val;
+
+    if (obj->purged)
+        return;
+    if (m->n == m->max) {
+        m->max = m->max ? m->max * 2 : 64;
+        m->v = Realloc(m->v, m->max * sizeof(cache_obj_t *));
+    }
+    __atomic_fetch_add(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    m->v[m->n++] = obj;
+}
+
+/*
+ * cache_match - references to every object whose key starts with
+ * prefix ("" = all), shard by shard, in *vp (malloc'd). Returns how
+ * many; release each with cache_release() and free *vp.
+ */
+int cache_match(const char *prefix, cache_obj_t ***vp)
+{
+    struct matches m = {NULL, 0, 0};
+    int i;
+
+    for (i = 0; i < nshards; i++) {
+        pthread_rwlock_rdlock(&shards[i]->lock);
+        trie_walk(shards[i]->trie, prefix, add_match, &m);
+        pthread_rwlock_unlock(&shards[i]->lock);
+    }
+    *vp = m.v;
+    return m.n;
+}
+
+/*
+ * cache_purge - invalidate the object under key, or with prefix set
+ * every object whose key starts with it. Returns how many there were.
+ */
+int cache_purge(const char *key, int prefix)
+{
+    struct matches m = {NULL, 0, 0};
+    uint64_t h = key_hash(key, strlen(key));
+    cache_obj_t *obj;
+    shard_t *s;
+    int i, j;
+
+    if (prefix)
+        m.n = cache_match(key, &m.v);
+    else
+        for (i = 0; i < nshards; i++) {
+            pthread_rwlock_rdlock(&shards[i]->lock);
+            if ((obj = find(shards[i], key, h)) != NULL)
+                add_match(obj, &m);
+            pthread_rwlock_unlock(&shards[i]->lock);
+        }
+
+    for (i = 0; i < m.n; i++)       /* Lookups miss from here on */
+        __atomic_store_n(&m.v[i]->purged, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < m.n; i = j) {   /* Same-shard runs, a batch at a time */
+        s = shards[m.v[i]->shard];
+        pthread_rwlock_wrlock(&s->lock);
+        for (j = i; j < m.n && j - i < PURGE_BATCH &&
+             m.v[j]->shard == m.v[i]->shard; j++)
+            if (find(s, m.v[j]->key, m.v[j]->hash) == m.v[j])
+                unlink_obj(s, m.v[j]);
+        pthread_rwlock_unlock(&s->lock);
+    }
+    for (i = 0; i < m.n; i++)
+        cache_release(m.v[i]);
+    free(m.v);
+    if (m.n > 0)
+        __atomic_fetch_add(&purges, m.n, __ATOMIC_RELAXED);
+    return m.n;
+}
+
+/*
+ * cache_report - render cache counters, and the slabs of each shard,
+ * as text into buf
+ */
+int cache_report(char *buf, size_t len)
+{
+    unsigned long nobjs = 0, hits = 0, remote = 0, inserts = 0, evictions = 0;
+    unsigned long large = 0;
+    size_t used = 0;
+    int i, n;
+
+    for (i = 0; i < nshards; i++) {
+        pthread_rwlock_rdlock(&shards[i]->lock);
+        nobjs += shards[i]->nobjs;
+        used += shards[i]->used;
+        inserts += shards[i]->inserts;
+        evictions += shards[i]->evictions;
+        large += shards[i]->large;
+        pthread_rwlock_unlock(&shards[i]->lock);
+        hits += __atomic_load_n(&shards[i]->hits, __ATOMIC_RELAXED);
+        remote += __atomic_load_n(&shards[i]->remote_hits, __ATOMIC_RELAXED);
+    }
+    n = snprintf(buf, len,
+                 "cache     objects=%lu large=%lu bytes=%zu capacity=%zu "
+                 "max-object=%zu hits=%lu misses=%lu inserts=%lu "
+                 "evictions=%lu purged=%lu",
+                 nobjs, large, used, capacity, max_object, hits + remote,
+                 __atomic_load_n(&misses, __ATOMIC_RELAXED),
+                 inserts, evictions, __atomic_load_n(&purges, __ATOMIC_RELAXED));
+    if (nshards > 1 && (size_t)n < len)
+        n += snprintf(buf + n, len - n, " shards=%d remote-hits=%lu",
+                      nshards, remote);
+    if ((size_t)n < len)
+        n += snprintf(buf + n, len - n, "\n");
+    for (i = 0; i < nshards && (size_t)n < len; i++)
+        n += slab_report(&shards[i]->slab, buf + n, len - n);
+    return n;
+}
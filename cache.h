@@ -0,0 +1,75 @@
+/*
+ * cache.h - In-memory web object cache for the proxy
+ *
+ * Objects are stored whole (response header block + body) under a
+ * string key in slab chunks, and evicted in least-recently-used order
+ * within their size class once the slabs are full. A body too large
+ * for one chunk is kept in a list of CACHE_BLOCK blocks instead, so
+ * the response is handed out as pieces (iov) to be sent with writev().
+ * Lookups hand out a reference, so an
+ * object that is evicted while a thread is still sending it stays
+ * alive until cache_release().
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define CACHE_BLOCK (64 * 1024)  /* Block size of bodies too large for a chunk */
+
+/* Puts one chunk of an object on the list of its slab page */
+typedef struct page_link {
+    struct cache_obj *obj;
+    struct page_link *prev, *next;
+} page_link_t;
+
+typedef struct cache_obj {
+    char *key;
+    uint64_t hash;               /* key_hash() of key */
+    char *hdrs;                  /* Status line and headers, CRLF CRLF */
+    int status;                  /* Status code of the status line */
+    size_t hdrlen;
+    size_t bodylen;
+    struct iovec *iov;           /* The response: hdrs, then the body pieces */
+    int niov;
+    int nblocks;                 /* Body blocks, 0 = body in the object's chunk */
+    size_t size;                 /* Chunk sizes charged against the capacity */
+    time_t stored;
+    time_t expires;              /* 0 = never */
+    uint64_t last_use;           /* LRU clock value of the last hit */
+    uint64_t queued[2];          /* LRU clock when put at the head of each
+                                    eviction list */
+    unsigned long hits;
+    int refcnt;
+    int purged;                  /* Invalidated, about to be unlinked */
+    int shard;                   /* Cache shard (NUMA node) it lives in */
+    int cls;                     /* Slab class of the chunk it lives in */
+    struct cache_obj *hnext;     /* Hash chain */
+    struct cache_obj *prev, *next; /* List of all objects */
+    struct cache_obj *lprev[2], *lnext[2]; /* Eviction lists: its class's,
+                                              and the large objects' */
+    page_link_t *plink;          /* Its chunk, then each block, by page */
+} cache_obj_t;
+
+void cache_init(size_t capacity, size_t max_object, int nshard);
+cache_obj_t *cache_lookup(const char *key);
+int cache_contains(const char *key);
+void cache_release(cache_obj_t *obj);
+int cache_insert(const char *key, char *hdrs, size_t hdrlen,
+                 char *body, size_t bodylen, time_t expires);
+int cache_insert_copy(const char *key, const char *hdrs, size_t hdrlen,
+                      const char *body, size_t bodylen, time_t stored,
+                      time_t expires);
+int cache_insertv(const char *key, const char *hdrs, size_t hdrlen,
+                  const struct iovec *body, int nbody, time_t stored,
+                  time_t expires);
+int cache_collect(cache_obj_t **v, int max);
+int cache_match(const char *prefix, cache_obj_t ***vp);
+int cache_purge(const char *key, int prefix);
+size_t cache_max_object(void);
+int cache_report(char *buf, size_t len);
+
+#endif /* __CACHE_H__ */
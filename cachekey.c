@@ -0,0 +1,140 @@
+/*
+ * cachekey.c - Cache keys: URL normalization and hashing
+ *
+ * Requests for the same resource are spelled many ways; normalizing
+ * the URL before it is used as a cache key makes them share one entry:
+ * the host is lowercased, a default ":80" and any fragment are dropped,
+ * an empty path becomes "/", and the query string is kept, sorted by
+ * parameter or stripped according to key_query_mode().
+ */
+#include "csapp.h"
+#include "cachekey.h"
+
+#define MAX_PARAMS 64                /* Queries with more are not sorted */
+
+static int query_mode = KEY_QUERY_KEEP;
+
+void key_query_mode(int mode)
+{
+    query_mode = mode;
+}
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix(uint64_t w)
+{
+    return rotl(w * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+}
+
+/*
+ * key_hash - 64-bit hash of len bytes, consumed 8 at a time
+ */
+uint64_t key_hash(const char *s, size_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+
+    while (len >= 8) {
+        memcpy(&w, s, 8);
+        h = rotl(h ^ mix(w), 27) * 5 + 0x52dce729;
+        s += 8;
+        len -= 8;
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, s, len);
+        h ^= mix(w);
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int cmp_param(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * sort_query - append the len-byte query q to out with its parameters
+ * sorted and empty ones dropped. Returns the new length of out.
+ */
+static size_t sort_query(const char *q, size_t len, char *out, size_t o,
+                         size_t outlen)
+{
+    char buf[MAXLINE], *params[MAX_PARAMS], *p, *save = NULL;
+    int n = 0, i;
+
+    if (len >= sizeof(buf))
+        return o + snprintf(out + o, outlen - o, "?%.*s", (int)len, q);
+    memcpy(buf, q, len);
+    buf[len] = '\0';
+    for (p = strtok_r(buf, "&", &save); p; p = strtok_r(NULL, "&", &save)) {
+        if (n == MAX_PARAMS)
+            return o + snprintf(out + o, outlen - o, "?%.*s", (int)len, q);
+        params[n++] = p;
+    }
+    qsort(params, n, sizeof(char *), cmp_param);
+    for (i = 0; i < n && o < outlen; i++)
+        o += snprintf(out + o, outlen - o, "%c%s", i ? '&' : '?', params[i]);
+    return o;
+}
+
+/*
+ * key_normalize - write the cache key of an absolute http:// URI to out.
+ * Returns the key length, or -1 if uri is not an http URL or the key
+ * does not fit.
+ */
+int key_normalize(const char *uri, char *out, size_t outlen)
+{
+    const char *h, *hend, *port, *path, *pend, *at;
+    size_t o, i, hlen;
+
+    if (strncasecmp(uri, "http://", 7))
+        return -1;
+    h = uri + 7;
+    hend = h + strcspn(h, "/?# \r\n");
+    if ((at = memchr(h, '@', hend - h)) != NULL)   /* Drop user info */
+        h = at + 1;
+    if (*h == '[')                                 /* IPv6 literal */
+        port = memchr(h, ']', hend - h);
+    else
+        port = h;
+    port = port ? memchr(port, ':', hend - port) : NULL;
+    hlen = (port ? port : hend) - h;
+    if (hlen == 0 || 7 + hlen + 8 >= outlen)
+        return -1;
+
+    memcpy(out, "http://", 7);
+    for (i = 0; i < hlen; i++)
+        out[7 + i] = tolower((unsigned char)h[i]);
+    o = 7 + hlen;
+    if (port && hend - port > 1 &&
+        !(hend - port == 3 && port[1] == '8' && port[2] == '0'))
+        o += snprintf(out + o, outlen - o, "%.*s", (int)(hend - port), port);
+    if (o + 1 >= outlen)
+        return -1;
+
+    path = hend;
+    pend = path + strcspn(path, "?# \r\n");
+    if (path == pend)
+        out[o++] = '/';
+    o += snprintf(out + o, outlen - o, "%.*s", (int)(pend - path), path);
+    if (o >= outlen)
+        return -1;
+
+    if (*pend == '?' && query_mode != KEY_QUERY_STRIP) {
+        path = pend + 1;
+        pend = path + strcspn(path, "# \r\n");
+        if (query_mode == KEY_QUERY_SORT)
+            o = sort_query(path, pend - path, out, o, outlen);
+        else if (pend > path)
+            o += snprintf(out + o, outlen - o, "?%.*s", (int)(pend - path), path);
+    }
+    return o < outlen ? (int)o : -1;
+}
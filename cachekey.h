@@ -0,0 +1,17 @@
+/*
+ * cachekey.h - Cache keys: URL normalization and hashing
+ */
+#ifndef __CACHEKEY_H__
+#define __CACHEKEY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* What normalization does with the query string */
+enum { KEY_QUERY_KEEP, KEY_QUERY_SORT, KEY_QUERY_STRIP };
+
+void key_query_mode(int mode);
+int key_normalize(const char *uri, char *out, size_t outlen);
+uint64_t key_hash(const char *s, size_t len);
+
+#endif /* __CACHEKEY_H__ */
@@ -0,0 +1,249 @@
+/*
+ * deadline.c - Connection and request deadlines on a hierarchical timing wheel
+ *
+ * Every connection thread blocks in read(), write() or connect(), so a
+ * silent client or origin would hold it forever. Instead of a timer
+ * syscall per connection, each deadline is an intrusive node in one of
+ * DEADLINE_WHEELS timing wheels: DEADLINE_LEVELS levels of 64 slots,
+ * DEADLINE_TICK_MS per slot at the bottom and 64 times coarser at each
+ * level up (about 46 hours in all). Arming and cancelling are O(1)
+ * list operations under the wheel's lock. A single thread advances the
+ * wheels every tick; timers of a higher level are cascaded down when
+ * the level below wraps, and everything due in the current slot is
+ * expired in one batch by shutting down its descriptors, which wakes
+ * the owner with EOF or EPIPE. The owner then sees deadline_fired().
+ *
+ * An idle deadline is not re-armed on every read: deadline_touch()
+ * only stamps the current tick, and when the deadline comes due the
+ * wheel pushes it back if there was progress since.
+ */
+#include "csapp.h"
+#include "timing.h"
+#include "deadline.h"
+
+#define DEADLINE_WHEELS 16          /* Wheels (and locks), picked by fd */
+#define DEADLINE_LEVELS 4
+#define LEVEL_BITS 6
+#define SLOTS (1 << LEVEL_BITS)
+#define SPAN (1ULL << (LEVEL_BITS * DEADLINE_LEVELS))
+#define TICK_NS (DEADLINE_TICK_MS * 1000000ULL)
+
+struct wheel {
+    pthread_mutex_t lock;
+    uint64_t now;                   /* Last tick processed */
+    unsigned long pending;
+    deadline_t *slots[DEADLINE_LEVELS][SLOTS];
+};
+
+static struct wheel wheels[DEADLINE_WHEELS];
+static uint64_t clock_ticks = 0;    /* Current tick, kept by the wheel thread */
+static int started = 0;
+static unsigned long fired[NDL], pushed_back = 0;
+
+static const char *dl_names[NDL] = {
+    "none", "header", "connect", "first-byte", "idle", "request"
+};
+
+/*
+ * link_deadline - put d in the slot its expiry falls into. Caller
+ * holds the lock.
+ */
+static void link_deadline(struct wheel *w, deadline_t *d)
+{
+    deadline_t **slot;
+    uint64_t delta;
+    int lvl = 0;
+
+    if (d->expires <= w->now)
+        d->expires = w->now + 1;
+    if ((delta = d->expires - w->now) >= SPAN)
+        d->expires = w->now + (delta = SPAN - 1);
+    while (delta >= 1ULL << (LEVEL_BITS * (lvl + 1)))
+        lvl++;
+    slot = &w->slots[lvl][(d->expires >> (LEVEL_BITS * lvl)) & (SLOTS - 1)];
+    if ((d->next = *slot) != NULL)
+        d->next->pprev = &d->next;
+    *slot = d;
+    d->pprev = slot;
+}
+
+static void unlink_deadline(deadline_t *d)
+{
+    if (d->next)
+        d->next->pprev = d->pprev;
+    *d->pprev = d->next;
+    d->pprev = NULL;
+}
+
+/*
+ * expire - d is due: push an idle deadline with recent progress back,
+ * otherwise shut its descriptors down. Caller holds the lock.
+ */
+static void expire(struct wheel *w, deadline_t *d)
+{
+    uint64_t active = __atomic_load_n(&d->active, __ATOMIC_RELAXED);
+    int i;
+
+    if (d->kind == DL_IDLE && active + d->idle > w->now) {
+        d->expires = active + d->idle;
+        link_deadline(w, d);
+        pushed_back++;
+        return;
+    }
+    d->pprev = NULL;
+    w->pending--;
+    __atomic_store_n(&d->fired, d->kind, __ATOMIC_RELEASE);
+    fired[d->kind]++;
+    for (i = 0; i < 2; i++)         /* A header deadline still lets us answer */
+        if (d->fd[i] >= 0)
+            shutdown(d->fd[i], d->kind == DL_HEADER ? SHUT_RD : SHUT_RDWR);
+}
+
+/*
+ * tick - advance w by one tick: cascade the upper levels that wrapped,
+ * then expire the bottom slot. Caller holds the lock.
+ */
+static void tick(struct wheel *w)
+{
+    deadline_t *d, *next;
+    int lvl;
+
+    w->now++;
+    for (lvl = 1; lvl < DEADLINE_LEVELS &&
+         (w->now & ((1ULL << (LEVEL_BITS * lvl)) - 1)) == 0; lvl++) {
+        d = w->slots[lvl][(w->now >> (LEVEL_BITS * lvl)) & (SLOTS - 1)];
+        w->slots[lvl][(w->now >> (LEVEL_BITS * lvl)) & (SLOTS - 1)] = NULL;
+        for (; d; d = next) {
+            next = d->next;
+            link_deadline(w, d);
+        }
+    }
+    d = w->slots[0][w->now & (SLOTS - 1)];
+    w->slots[0][w->now & (SLOTS - 1)] = NULL;
+    for (; d; d = next) {
+        next = d->next;
+        expire(w, d);
+    }
+}
+
+/*
+ * deadline_thread - drive the wheels from the monotonic clock
+ */
+static void *deadline_thread(void *vargp)
+{
+    uint64_t now;
+    int i;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(DEADLINE_TICK_MS * 1000);
+        now = timing_now() / TICK_NS;
+        __atomic_store_n(&clock_ticks, now, __ATOMIC_RELAXED);
+        for (i = 0; i < DEADLINE_WHEELS; i++) {
+            pthread_mutex_lock(&wheels[i].lock);
+            while (wheels[i].now < now)
+                tick(&wheels[i]);
+            pthread_mutex_unlock(&wheels[i].lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * deadline_init - set up the wheels and start the thread that drives them
+ */
+void deadline_init(void)
+{
+    pthread_t tid;
+    int i;
+
+    clock_ticks = timing_now() / TICK_NS;
+    for (i = 0; i < DEADLINE_WHEELS; i++) {
+        pthread_mutex_init(&wheels[i].lock, NULL);
+        wheels[i].now = clock_ticks;
+    }
+    started = 1;
+    Pthread_create(&tid, NULL, deadline_thread, NULL);
+}
+
+/*
+ * deadline_arm - (re)arm d to shut fd and fd2 (-1 = none) down ms from
+ * now. A DL_IDLE deadline only fires after ms without deadline_touch().
+ * ms <= 0 just cancels d.
+ */
+void deadline_arm(deadline_t *d, int kind, int ms, int fd, int fd2)
+{
+    struct wheel *w;
+    uint64_t ticks = (ms + DEADLINE_TICK_MS - 1) / DEADLINE_TICK_MS;
+
+    deadline_cancel(d);
+    d->fired = DL_NONE;
+    if (ms <= 0 || !started)
+        return;
+    w = d->wheel = &wheels[fd % DEADLINE_WHEELS];
+    d->kind = kind;
+    d->fd[0] = fd;
+    d->fd[1] = fd2;
+    d->idle = ticks;
+    d->active = __atomic_load_n(&clock_ticks, __ATOMIC_RELAXED);
+    d->expires = d->active + ticks;
+
+    pthread_mutex_lock(&w->lock);
+    link_deadline(w, d);
+    w->pending++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+void deadline_touch(deadline_t *d)
+{
+    __atomic_store_n(&d->active, __atomic_load_n(&clock_ticks, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * deadline_cancel - disarm d. Once this returns d cannot fire, so its
+ * descriptors may be closed.
+ */
+void deadline_cancel(deadline_t *d)
+{
+    struct wheel *w = d->wheel;
+
+    if (w == NULL)
+        return;
+    pthread_mutex_lock(&w->lock);
+    if (d->pprev) {
+        unlink_deadline(d);
+        w->pending--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    d->wheel = NULL;
+}
+
+/*
+ * deadline_fired - what d went off as, DL_NONE if it has not
+ */
+int deadline_fired(deadline_t *d)
+{
+    return __atomic_load_n(&d->fired, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * deadline_report - render the pending deadlines and expirations as text
+ */
+int deadline_report(char *buf, size_t len)
+{
+    unsigned long pending = 0;
+    int i, n;
+
+    if (!started)
+        return 0;
+    for (i = 0; i < DEADLINE_WHEELS; i++)
+        pending += wheels[i].pending;
+    n = snprintf(buf, len, "deadline  pending=%lu pushed-back=%lu fired",
+                 pending, pushed_back);
+    for (i = DL_HEADER; i < NDL && (size_t)n < len; i++)
+        n += snprintf(buf + n, len - n, " %s=%lu", dl_names[i], fired[i]);
+    if ((size_t)n < len)
+        n += snprintf(buf + n, len - n, "\n");
+    return n;
+}
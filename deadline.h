@@ -0,0 +1,40 @@
+/*
+ * deadline.h - Connection and request deadlines on a hierarchical timing wheel
+ */
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DEADLINE_TICK_MS 10         /* Resolution of the wheels */
+
+/* What a deadline bounds; also what cut a request short */
+enum { DL_NONE, DL_HEADER, DL_CONNECT, DL_FIRST_BYTE, DL_IDLE, DL_REQUEST, NDL };
+
+/*
+ * A pending deadline. It lives wherever its owner keeps it (usually on
+ * the stack of the thread it guards) and must be cancelled before its
+ * descriptors are closed.
+ */
+typedef struct deadline {
+    struct deadline *next, **pprev; /* Slot list, pprev == NULL: not armed */
+    struct wheel *wheel;
+    uint64_t expires;               /* Tick it is due at */
+    uint64_t active;                /* DL_IDLE: tick of the last progress */
+    uint32_t idle;                  /* DL_IDLE: ticks of silence allowed */
+    int kind;
+    int fd[2];                      /* Shut down when it fires, -1 = none */
+    int fired;                      /* Kind it went off as, DL_NONE if not */
+} deadline_t;
+
+#define DEADLINE_INITIALIZER {NULL, NULL, NULL, 0, 0, 0, DL_NONE, {-1, -1}, DL_NONE}
+
+void deadline_init(void);
+void deadline_arm(deadline_t *d, int kind, int ms, int fd, int fd2);
+void deadline_touch(deadline_t *d);
+void deadline_cancel(deadline_t *d);
+int deadline_fired(deadline_t *d);
+int deadline_report(char *buf, size_t len);
+
+#endif /* __DEADLINE_H__ */
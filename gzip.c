@@ -0,0 +1,185 @@
+/*
+ * gzip.c - Streaming gzip compression of proxied responses
+ *
+ * A thin layer over zlib's deflate: input arrives in the pieces the
+ * origin sends it and compressed output is handed to an emit callback
+ * after each piece (Z_SYNC_FLUSH), so the client sees data as soon as
+ * the origin produces it.
+ */
+#include "csapp.h"
+#include "gzip.h"
+
+#define GZ_WINDOW (15 + 16)  /* 32KB window with a gzip wrapper */
+#define GZ_OUTBUF 16384
+
+/* Media types worth compressing; everything else is already dense */
+static const char *compressible[] = {
+    "text/", "application/javascript", "application/x-javascript",
+    "application/json", "application/xml", "application/xhtml+xml",
+    "image/svg+xml", NULL
+};
+
+/*
+ * gz_compressible - is a response with this Content-Type value worth
+ * compressing?
+ */
+int gz_compressible(const char *content_type)
+{
+    int i;
+
+    while (*content_type == ' ' || *content_type == '\t')
+        content_type++;
+    for (i = 0; compressible[i]; i++)
+        if (!strncasecmp(content_type, compressible[i], strlen(compressible[i])))
+            return 1;
+    return 0;
+}
+
+/*
+ * gz_accepts - does an Accept-Encoding value allow gzip? A coding is
+ * refused only by an explicit q=0.
+ */
+int gz_accepts(const char *ae)
+{
+    const char *p = ae;
+    size_t n;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        n = strcspn(p, ",;");
+        while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\r' || p[n - 1] == '\n'))
+            n--;
+        if ((n == 4 && !strncasecmp(p, "gzip", 4)) || (n == 1 && *p == '*')) {
+            const char *q = p + strcspn(p, ",;");
+            if (*q == ';') {
+                q++;
+                while (*q == ' ')
+                    q++;
+                if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=' && atof(q + 2) == 0)
+                    return 0;
+            }
+            return 1;
+        }
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+/*
+ * has_token - case-insensitive search for word in the n bytes at s
+ */
+static int has_token(const char *s, size_t n, const char *word)
+{
+    size_t wlen = strlen(word), i;
+
+    for (i = 0; i + wlen <= n; i++)
+        if (!strncasecmp(s + i, word, wlen))
+            return 1;
+    return 0;
+}
+
+/*
+ * gz_headers - rewrite a response header block (NUL-terminated, ending
+ * in a blank line) into out. Vary gains Accept-Encoding; with encode
+ * set, Content-Length is dropped, Content-Encoding: gzip is added and,
+ * if clen >= 0, the compressed length is set. Returns the new length.
+ */
+size_t gz_headers(const char *hdrs, char *out, size_t outlen, int encode,
+                  long clen)
+{
+    const char *line = hdrs, *eol;
+    size_t n = 0, len;
+    int vary = 0;
+
+    while (*line && *line != '\r' && *line != '\n') {
+        eol = strchr(line, '\n');
+        len = eol ? (size_t)(eol - line + 1) : strlen(line);
+        if (encode && !strncasecmp(line, "Content-Length:", 15)) {
+            line += len;
+            continue;
+        }
+        if (!strncasecmp(line, "Vary:", 5)) {
+            size_t vlen = len;
+            vary = 1;
+            while (vlen > 0 && (line[vlen - 1] == '\r' || line[vlen - 1] == '\n'))
+                vlen--;
+            if (has_token(line + 5, vlen - 5, "Accept-Encoding"))
+                n += snprintf(out + n, n < outlen ? outlen - n : 0, "%.*s", (int)len, line);
+            else
+                n += snprintf(out + n, n < outlen ? outlen - n : 0,
+                              "%.*s, Accept-Encoding\r\n", (int)vlen, line);
+        }
+        else
+            n += snprintf(out + n, n < outlen ? outlen - n : 0, "%.*s", (int)len, line);
+        line += len;
+    }
+    if (!vary)
+        n += snprintf(out + n, n < outlen ? outlen - n : 0, "Vary: Accept-Encoding\r\n");
+    if (encode) {
+        n += snprintf(out + n, n < outlen ? outlen - n : 0, "Content-Encoding: gzip\r\n");
+        if (clen >= 0)
+            n += snprintf(out + n, n < outlen ? outlen - n : 0,
+                          "Content-Length: %ld\r\n", clen);
+    }
+    n += snprintf(out + n, n < outlen ? outlen - n : 0, "\r\n");
+    return n < outlen ? n : outlen - 1;
+}
+
+int gz_init(gz_t *gz, int level, gz_emit_t emit, void *arg)
+{
+    memset(&gz->zs, 0, sizeof(z_stream));
+    gz->emit = emit;
+    gz->arg = arg;
+    if (deflateInit2(&gz->zs, level, Z_DEFLATED, GZ_WINDOW, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    return 0;
+}
+
+/*
+ * gz_run - feed the pending input through deflate with the given flush
+ * mode and emit everything produced
+ */
+static int gz_run(gz_t *gz, int flush)
+{
+    char out[GZ_OUTBUF];
+    int rc;
+
+    do {
+        gz->zs.next_out = (Bytef *)out;
+        gz->zs.avail_out = sizeof(out);
+        rc = deflate(&gz->zs, flush);
+        if (rc == Z_STREAM_ERROR)
+            return -1;
+        if (sizeof(out) - gz->zs.avail_out > 0 &&
+            gz->emit(gz->arg, out, sizeof(out) - gz->zs.avail_out) < 0)
+            return -1;
+    } while (gz->zs.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+    return 0;
+}
+
+/*
+ * gz_write - compress one piece of the body and flush it to the emitter
+ */
+int gz_write(gz_t *gz, char *buf, size_t len)
+{
+    gz->zs.next_in = (Bytef *)buf;
+    gz->zs.avail_in = len;
+    return gz_run(gz, Z_SYNC_FLUSH);
+}
+
+/*
+ * gz_finish - emit the rest of the stream and the gzip trailer
+ */
+int gz_finish(gz_t *gz)
+{
+    gz->zs.next_in = NULL;
+    gz->zs.avail_in = 0;
+    return gz_run(gz, Z_FINISH);
+}
+
+void gz_end(gz_t *gz)
+{
+    deflateEnd(&gz->zs);
+}
@@ -0,0 +1,30 @@
+/*
+ * gzip.h - Streaming gzip compression of proxied responses
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <stddef.h>
+#include <zlib.h>
+
+#define GZIP_MIN_SIZE 256  /* Bodies smaller than this are sent as is */
+
+/* Receives each piece of compressed output; returns -1 to abort */
+typedef int (*gz_emit_t)(void *arg, char *buf, size_t len);
+
+typedef struct {
+    z_stream zs;
+    gz_emit_t emit;
+    void *arg;
+} gz_t;
+
+int gz_compressible(const char *content_type);
+int gz_accepts(const char *accept_encoding);
+size_t gz_headers(const char *hdrs, char *out, size_t outlen, int encode,
+                  long clen);
+int gz_init(gz_t *gz, int level, gz_emit_t emit, void *arg);
+int gz_write(gz_t *gz, char *buf, size_t len);
+int gz_finish(gz_t *gz);
+void gz_end(gz_t *gz);
+
+#endif /* __GZIP_H__ */
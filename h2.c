@@ -0,0 +1,735 @@
+/*
+ * h2.c - HTTP/2 cleartext (h2c) connections from clients
+ *
+ * A client may start HTTP/2 on a fresh connection (prior knowledge:
+ * the request line is the preface's "PRI * HTTP/2.0") or by asking to
+ * upgrade an HTTP/1.1 GET (Upgrade: h2c), which then becomes stream 1.
+ * From there the connection's thread runs a small event loop over the
+ * client socket and one socketpair per open stream.
+ *
+ * Each stream's request headers are decoded with HPACK, written to the
+ * socketpair as an HTTP/1.0 request, and handed to stream_fn, which
+ * serves it like a connection of its own (admission, worker pool) and
+ * through the proxy's ordinary request path (cache, upstreams, gzip,
+ * ranges, ...), writing an HTTP/1.0 response back. A stream it cannot
+ * take is refused with RST_STREAM REFUSED_STREAM. The loop turns
+ * that into a HEADERS frame and DATA frames of at most H2_FRAME bytes,
+ * taking one frame per stream in turn and never more than the stream's
+ * and the connection's flow-control windows allow. A stream whose
+ * window is closed, or whose upstream is slow, only stalls its own
+ * worker: its socketpair is simply not read, and the other streams go
+ * on.
+ *
+ * Request bodies are not used (the proxy only serves GET); their bytes
+ * are handed back to the connection window right away. There is no
+ * server push and no CONNECT over HTTP/2.
+ */
+#include "csapp.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "hpack.h"
+#include "deadline.h"
+#include "h2.h"
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN 24
+#define H2_HEAD 16384               /* Largest response head of a stream */
+#define H2_BLOCK 65536              /* Largest request header block */
+#define H2_FIELDS 128               /* Most fields in one request */
+#define H2_WINDOW 65535             /* Initial flow-control window */
+
+/* Frame types, flags and error codes */
+enum { DATA, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING,
+       GOAWAY, WINDOW_UPDATE, CONTINUATION };
+#define F_END_STREAM 0x1
+#define F_ACK 0x1
+#define F_END_HEADERS 0x4
+#define F_PADDED 0x8
+#define F_PRIORITY 0x20
+enum { E_NONE, E_PROTOCOL, E_INTERNAL, E_FLOW_CONTROL, E_SETTINGS_TIMEOUT,
+       E_STREAM_CLOSED, E_FRAME_SIZE, E_REFUSED_STREAM, E_CANCEL,
+       E_COMPRESSION };
+
+struct stream {
+    uint32_t id;
+    int fd;                     /* Our end of the stream's socketpair */
+    long window;                /* Bytes we may still send on it */
+    int head_done;              /* Response HEADERS sent */
+    int eof;                    /* The stream's thread is done writing */
+    size_t headlen, outlen, outoff;
+    char head[H2_HEAD];         /* HTTP/1.0 response head so far */
+    char out[H2_FRAME];         /* Body bytes read, not yet sent */
+};
+
+struct h2conn {
+    int fd;
+    struct sockaddr_storage client;
+    long window;                /* Connection send window */
+    long initial;               /* Client's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t last_id;           /* Highest stream the client opened */
+    int nstreams, goaway;
+    struct stream *streams[H2_MAX_STREAMS];
+    hpack_t dec;
+    size_t preface;             /* Bytes of the client preface still due */
+    unsigned char in[9 + H2_FRAME];
+    size_t inlen;
+    unsigned char block[H2_BLOCK];  /* Request header block being collected */
+    size_t blocklen;
+    uint32_t block_id;          /* Stream awaiting CONTINUATION, 0 = none */
+    unsigned char frame[9 + H2_FRAME];  /* Frame being written */
+    deadline_t idle;
+};
+
+static h2_stream_fn_t stream_fn = NULL;
+static int idle_timeout_ms = 0;
+static unsigned long connections, upgrades, streams, refused, active;
+
+void h2_init(h2_stream_fn_t fn, int idle_ms)
+{
+    stream_fn = fn;
+    idle_timeout_ms = idle_ms;
+}
+
+/*
+ * h2_is_preface - is line the request line of the HTTP/2 preface?
+ */
+int h2_is_preface(const char *line)
+{
+    return !strcmp(line, "PRI * HTTP/2.0\r\n");
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+ * send_frame - write one frame to the client. Returns -1 if the client
+ * is gone.
+ */
+static int send_frame(struct h2conn *c, int type, int flags, uint32_t id,
+                      const void *p, size_t len)
+{
+    c->frame[0] = len >> 16;
+    c->frame[1] = len >> 8;
+    c->frame[2] = len;
+    c->frame[3] = type;
+    c->frame[4] = flags;
+    put32(c->frame + 5, id);
+    if (len && p != c->frame + 9)
+        memcpy(c->frame + 9, p, len);
+    deadline_touch(&c->idle);
+    return rio_writen(c->fd, c->frame, 9 + len) == (ssize_t)(9 + len) ? 0 : -1;
+}
+
+/*
+ * goaway - end the connection with error err. Always returns -1.
+ */
+static int goaway(struct h2conn *c, int err)
+{
+    unsigned char p[8];
+
+    put32(p, c->last_id);
+    put32(p + 4, err);
+    send_frame(c, GOAWAY, 0, 0, p, 8);
+    return -1;
+}
+
+static int rst_stream(struct h2conn *c, uint32_t id, int err)
+{
+    unsigned char p[4];
+
+    put32(p, err);
+    return send_frame(c, RST_STREAM, 0, id, p, 4);
+}
+
+static int window_update(struct h2conn *c, uint32_t id, uint32_t n)
+{
+    unsigned char p[4];
+
+    put32(p, n);
+    return send_frame(c, WINDOW_UPDATE, 0, id, p, 4);
+}
+
+static int stream_find(struct h2conn *c, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+        if (c->streams[i] && c->streams[i]->id == id)
+            return i;
+    return -1;
+}
+
+/*
+ * stream_close - forget stream i. Its worker sees EPIPE if it is still
+ * writing, and closes its own end.
+ */
+static void stream_close(struct h2conn *c, int i)
+{
+    close(c->streams[i]->fd);
+    free(c->streams[i]);
+    c->streams[i] = NULL;
+    c->nstreams--;
+    __atomic_fetch_sub(&active, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * stream_open - start serving the HTTP/1.0 request req as stream id
+ */
+static int stream_open(struct h2conn *c, uint32_t id, const char *req, size_t len)
+{
+    struct stream *s;
+    int sv[2], i;
+
+    for (i = 0; i < H2_MAX_STREAMS && c->streams[i]; i++)
+        ;
+    if (i == H2_MAX_STREAMS || c->goaway ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        __atomic_fetch_add(&refused, 1, __ATOMIC_RELAXED);
+        return rst_stream(c, id, E_REFUSED_STREAM);
+    }
+    rio_writen(sv[0], (void *)req, len);
+    if (stream_fn(sv[1], &c->client) < 0) { //over a cap, or no worker
+        close(sv[0]);
+        close(sv[1]);
+        __atomic_fetch_add(&refused, 1, __ATOMIC_RELAXED);
+        return rst_stream(c, id, E_REFUSED_STREAM);
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+
+    s = c->streams[i] = Malloc(sizeof(struct stream));
+    s->id = id;
+    s->fd = sv[0];
+    s->window = c->initial;
+    s->head_done = s->eof = 0;
+    s->headlen = s->outlen = s->outoff = 0;
+    c->nstreams++;
+    __atomic_fetch_add(&streams, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&active, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * field_ok - whether a decoded field is well formed (RFC 9113 8.2.1): a
+ * name of lowercase token characters, after an optional leading ':',
+ * and a value without CR, LF or NUL or whitespace at either end
+ */
+static int field_ok(const char *name, const char *value)
+{
+    const char *p = name + (name[0] == ':');
+    size_t len = strlen(value);
+
+    if (*p == '\0')
+        return 0;
+    for (; *p; p++)
+        if ((unsigned char)*p <= ' ' || (unsigned char)*p >= 0x7f ||
+            (*p >= 'A' && *p <= 'Z') || strchr("\"(),/:;<=>?@[\\]{}", *p))
+            return 0;
+    if (strpbrk(value, "\r\n"))
+        return 0;
+    return len == 0 || (value[0] != ' ' && value[0] != '\t' &&
+                        value[len - 1] != ' ' && value[len - 1] != '\t');
+}
+
+/*
+ * build_request - write the decoded request as HTTP/1.0 text into out.
+ * Returns its length, or -1 if it is malformed (a bad field, a missing,
+ * repeated, unknown or misplaced pseudo-header) or does not fit.
+ */
+static int build_request(hpack_field_t *f, int n, char *out, size_t outlen)
+{
+    static const char *skip[] = {
+        "host", "connection", "keep-alive", "proxy-connection",
+        "transfer-encoding", "upgrade", "te", NULL
+    };
+    const char *method = NULL, *path = NULL, *authority = NULL,
+               *scheme = NULL, *host = NULL, **pseudo;
+    int i, j, len;
+
+    for (i = 0; i < n; i++) {
+        if (!field_ok(f[i].name, f[i].value))
+            return -1;
+        if (f[i].name[0] != ':') {
+            if (!strcmp(f[i].name, "host") && host == NULL)
+                host = f[i].value;
+            continue;
+        }
+        if (i > 0 && f[i - 1].name[0] != ':')   /* After a regular field */
+            return -1;
+        if (!strcmp(f[i].name, ":method"))
+            pseudo = &method;
+        else if (!strcmp(f[i].name, ":path"))
+            pseudo = &path;
+        else if (!strcmp(f[i].name, ":authority"))
+            pseudo = &authority;
+        else if (!strcmp(f[i].name, ":scheme"))
+            pseudo = &scheme;
+        else
+            return -1;
+        if (*pseudo != NULL)
+            return -1;
+        *pseudo = f[i].value;
+    }
+    if (authority == NULL)
+        authority = host;
+    /* Method and path go on the request line, so no spaces in either */
+    if (method == NULL || path == NULL || authority == NULL ||
+        scheme == NULL || *method == '\0' || *path == '\0' ||
+        strchr(method, ' ') || strchr(path, ' '))
+        return -1;
+
+    len = snprintf(out, outlen, "%s %s HTTP/1.0\r\nHost: %s\r\n"
+                   H2_HEADER ": 1\r\n", method, path, authority);
+    for (i = 0; i < n && (size_t)len < outlen; i++) {
+        for (j = 0; skip[j] && strcmp(f[i].name, skip[j]); j++)
+            ;
+        if (f[i].name[0] != ':' && skip[j] == NULL)
+            len += snprintf(out + len, outlen - len, "%s: %s\r\n",
+                            f[i].name, f[i].value);
+    }
+    if ((size_t)len < outlen)
+        len += snprintf(out + len, outlen - len, "\r\n");
+    return (size_t)len < outlen ? len : -1;
+}
+
+/*
+ * end_headers - a request header block is complete: decode it and open
+ * its stream
+ */
+static int end_headers(struct h2conn *c)
+{
+    hpack_field_t f[H2_FIELDS];
+    char fields[H2_BLOCK], req[H2_BLOCK];
+    uint32_t id = c->block_id;
+    int n, len;
+
+    c->block_id = 0;
+    if ((n = hpack_decode(&c->dec, c->block, c->blocklen, f, H2_FIELDS,
+                          fields, sizeof(fields))) < 0)
+        return goaway(c, E_COMPRESSION);
+    if (id <= c->last_id)           /* Trailers, or a stream already done */
+        return 0;
+    c->last_id = id;
+    if ((len = build_request(f, n, req, sizeof(req))) < 0)
+        return rst_stream(c, id, E_PROTOCOL);
+    return stream_open(c, id, req, len);
+}
+
+/*
+ * apply_settings - take the client's SETTINGS payload
+ */
+static int apply_settings(struct h2conn *c, const unsigned char *p, size_t len)
+{
+    long delta;
+    uint32_t v;
+    int i;
+
+    for (; len >= 6; p += 6, len -= 6) {
+        v = get32(p + 2);
+        if ((p[0] << 8 | p[1]) != 0x4)  /* Only INITIAL_WINDOW_SIZE matters */
+            continue;
+        if (v > 0x7fffffff)
+            return -1;
+        delta = (long)v - c->initial;
+        c->initial = v;
+        for (i = 0; i < H2_MAX_STREAMS; i++)
+            if (c->streams[i])
+                c->streams[i]->window += delta;
+    }
+    return 0;
+}
+
+/*
+ * handle_frame - act on one frame from the client. Returns -1 when the
+ * connection has to end.
+ */
+static int handle_frame(struct h2conn *c, int type, int flags, uint32_t id,
+                        unsigned char *p, size_t len)
+{
+    struct stream *s;
+    size_t pad = 0;
+    uint32_t v;
+    int i;
+
+    if (c->block_id && (type != CONTINUATION || id != c->block_id))
+        return goaway(c, E_PROTOCOL);
+    switch (type) {
+    case DATA:                      /* A body nobody reads: give it back */
+        if (id == 0)
+            return goaway(c, E_PROTOCOL);
+        return len ? window_update(c, 0, len) : 0;
+    case HEADERS:
+        if (id == 0 || id % 2 == 0)
+            return goaway(c, E_PROTOCOL);
+        if (flags & F_PADDED) {
+            if (len < 1 || (pad = p[0]) > len - 1)
+                return goaway(c, E_PROTOCOL);
+            p++;
+            len -= 1 + pad;
+        }
+        if (flags & F_PRIORITY) {
+            if (len < 5)
+                return goaway(c, E_PROTOCOL);
+            p += 5;
+            len -= 5;
+        }
+        c->block_id = id;
+        c->blocklen = 0;
+        /* fall through */
+    case CONTINUATION:
+        if (c->block_id == 0)
+            return goaway(c, E_PROTOCOL);
+        if (c->blocklen + len > H2_BLOCK)
+            return goaway(c, E_PROTOCOL);
+        memcpy(c->block + c->blocklen, p, len);
+        c->blocklen += len;
+        return flags & F_END_HEADERS ? end_headers(c) : 0;
+    case RST_STREAM:
+        if ((i = stream_find(c, id)) >= 0)
+            stream_close(c, i);
+        return 0;
+    case SETTINGS:
+        if (id != 0)
+            return goaway(c, E_PROTOCOL);
+        if (flags & F_ACK)
+            return 0;
+        if (len % 6)
+            return goaway(c, E_FRAME_SIZE);
+        if (apply_settings(c, p, len) < 0)
+            return goaway(c, E_FLOW_CONTROL);
+        return send_frame(c, SETTINGS, F_ACK, 0, NULL, 0);
+    case PUSH_PROMISE:
+        return goaway(c, E_PROTOCOL);
+    case PING:
+        if (len != 8)
+            return goaway(c, E_FRAME_SIZE);
+        return flags & F_ACK ? 0 : send_frame(c, PING, F_ACK, 0, p, 8);
+    case GOAWAY:                    /* Finish what is open, then go */
+        c->goaway = 1;
+        return 0;
+    case WINDOW_UPDATE:
+        if (len != 4)
+            return goaway(c, E_FRAME_SIZE);
+        v = get32(p) & 0x7fffffff;
+        if (id == 0) {
+            if ((c->window += v) > 0x7fffffff)
+                return goaway(c, E_FLOW_CONTROL);
+        } else if ((i = stream_find(c, id)) >= 0) {
+            s = c->streams[i];
+            if ((s->window += v) > 0x7fffffff) {
+                stream_close(c, i);
+                return rst_stream(c, id, E_FLOW_CONTROL);
+            }
+        }
+        return 0;
+    }
+    return 0;                       /* PRIORITY, and unknown types */
+}
+
+/*
+ * parse - handle every complete frame in the input buffer
+ */
+static int parse(struct h2conn *c)
+{
+    size_t n, len;
+    int rc;
+
+    if (c->preface) {
+        n = c->inlen < c->preface ? c->inlen : c->preface;
+        if (memcmp(c->in, PREFACE + PREFACE_LEN - c->preface, n))
+            return -1;
+        c->preface -= n;
+        memmove(c->in, c->in + n, c->inlen -= n);
+        if (c->preface)
+            return 0;
+    }
+    while (c->inlen >= 9) {
+        if ((len = c->in[0] << 16 | c->in[1] << 8 | c->in[2]) > H2_FRAME)
+            return goaway(c, E_FRAME_SIZE);
+        if (c->inlen < 9 + len)
+            break;
+        rc = handle_frame(c, c->in[3], c->in[4], get32(c->in + 5) & 0x7fffffff,
+                          c->in + 9, len);
+        if (rc < 0)
+            return -1;
+        memmove(c->in, c->in + 9 + len, c->inlen -= 9 + len);
+    }
+    return 0;
+}
+
+/*
+ * send_status - answer stream s with just a status (its thread sent
+ * nothing usable) and close it
+ */
+static int send_status(struct h2conn *c, int i, int status)
+{
+    unsigned char blk[8];
+    uint32_t id = c->streams[i]->id;
+
+    stream_close(c, i);
+    return send_frame(c, HEADERS, F_END_HEADERS | F_END_STREAM, id, blk,
+                      hpack_encode_status(blk, status));
+}
+
+/*
+ * send_head - turn the HTTP/1.0 head in s->head (end bytes long) into
+ * HEADERS and CONTINUATION frames
+ */
+static int send_head(struct h2conn *c, struct stream *s, size_t end)
+{
+    static const char *skip[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+        "upgrade", NULL
+    };
+    unsigned char blk[H2_HEAD + 1024];
+    char *line = s->head, *next, *value, name[MAXLINE];
+    size_t n, len, off;
+    int i, j;
+
+    s->head[end - 1] = '\0';
+    len = hpack_encode_status(blk, !strncmp(s->head, "HTTP/1.", 7) && end > 12 ?
+                              atoi(s->head + 9) : 502);
+    for (line = strchr(line, '\n'); line && *++line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next = '\0';
+        if ((value = strchr(line, ':')) == NULL || value - line >= MAXLINE)
+            continue;
+        for (i = 0; line + i < value; i++)
+            name[i] = tolower((unsigned char)line[i]);
+        name[i] = '\0';
+        value += 1 + strspn(value + 1, " \t");
+        value[strcspn(value, "\r")] = '\0';
+        for (j = 0; skip[j] && strcmp(name, skip[j]); j++)
+            ;
+        if (i > 0 && skip[j] == NULL)
+            len += hpack_encode(blk + len, sizeof(blk) - len, name, value);
+        if (next == NULL)
+            break;
+    }
+
+    for (off = 0; off < len; off += n) {
+        n = len - off < H2_FRAME ? len - off : H2_FRAME;
+        if (send_frame(c, off ? CONTINUATION : HEADERS,
+                       off + n == len ? F_END_HEADERS : 0, s->id, blk + off, n) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * head_end - length of the response head in buf (through its blank
+ * line), 0 if it is not all there yet
+ */
+static size_t head_end(const char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i++)
+        if (buf[i] == '\n' &&
+            (buf[i + 1] == '\n' || (buf[i + 1] == '\r' && i + 2 < len &&
+                                    buf[i + 2] == '\n')))
+            return i + (buf[i + 1] == '\n' ? 2 : 3);
+    return 0;
+}
+
+/*
+ * pump - read what stream i's thread has written
+ */
+static int pump(struct h2conn *c, int i)
+{
+    struct stream *s = c->streams[i];
+    ssize_t n;
+    size_t end;
+
+    if (s->head_done) {
+        if ((n = read(s->fd, s->out, H2_FRAME)) > 0)
+            s->outlen = n;
+        else if (n == 0 || errno != EAGAIN)
+            s->eof = 1;
+        return 0;
+    }
+
+    n = read(s->fd, s->head + s->headlen, H2_HEAD - s->headlen);
+    if (n < 0 && errno == EAGAIN)
+        return 0;
+    if (n <= 0)                     /* Ended before a whole head */
+        return send_status(c, i, 502);
+    s->headlen += n;
+    if ((end = head_end(s->head, s->headlen)) == 0)
+        return s->headlen == H2_HEAD ? send_status(c, i, 502) : 0;
+    if (send_head(c, s, end) < 0)
+        return -1;
+    s->head_done = 1;
+    memcpy(s->out, s->head + end, s->outlen = s->headlen - end);
+    return 0;
+}
+
+/*
+ * flush - send one DATA frame of stream i, as far as the windows allow.
+ * Returns 1 if there is more it could send right away, -1 if the
+ * client is gone.
+ */
+static int flush(struct h2conn *c, int i)
+{
+    struct stream *s = c->streams[i];
+    long n = s->outlen - s->outoff;
+    uint32_t id = s->id;
+
+    if (!s->head_done)
+        return 0;
+    if (n == 0) {
+        if (!s->eof)
+            return 0;
+        stream_close(c, i);
+        return send_frame(c, DATA, F_END_STREAM, id, NULL, 0);
+    }
+    if (n > s->window)
+        n = s->window;
+    if (n > c->window)
+        n = c->window;
+    if (n <= 0)
+        return 0;
+    if (send_frame(c, DATA, 0, id, s->out + s->outoff, n) < 0)
+        return -1;
+    s->window -= n;
+    c->window -= n;
+    if ((s->outoff += n) == s->outlen)
+        s->outoff = s->outlen = 0;
+    return s->outlen > 0 && s->window > 0 && c->window > 0;
+}
+
+/*
+ * base64url - decode the HTTP2-Settings header into out. Returns the
+ * bytes decoded.
+ */
+static size_t base64url(const char *s, unsigned char *out, size_t outlen)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned bits = 0, nbits = 0;
+    const char *d;
+    size_t n = 0;
+
+    for (; *s && (d = strchr(digits, *s)) != NULL; s++) {
+        bits = bits << 6 | (d - digits);
+        if ((nbits += 6) >= 8 && n < outlen)
+            out[n++] = bits >> (nbits -= 8);
+    }
+    return n;
+}
+
+/*
+ * h2_serve - run an HTTP/2 connection on fd until the client closes it
+ * or it stays idle too long. rp holds what has been read so far: the
+ * preface's request line (prior knowledge), or a whole HTTP/1.1 request
+ * that asked to upgrade, in which case upgrade is that request as
+ * HTTP/1.0 text and settings its HTTP2-Settings. Returns 0; the streams
+ * account for themselves.
+ */
+int h2_serve(int fd, rio_t *rp, const char *upgrade, const char *settings)
+{
+    static const char *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                                   "Connection: Upgrade\r\n"
+                                   "Upgrade: h2c\r\n\r\n";
+    struct h2conn *c = Calloc(1, sizeof(struct h2conn));
+    struct pollfd pfd[1 + H2_MAX_STREAMS];
+    int map[1 + H2_MAX_STREAMS], i, n, busy = 0, rc;
+    unsigned char p[6];
+    socklen_t len = sizeof(c->client);
+    ssize_t r;
+    int one = 1;
+
+    c->fd = fd;
+    getpeername(fd, (SA *)&c->client, &len);
+    //frames are written as they are ready; small ones must not wait
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->window = c->initial = H2_WINDOW;
+    hpack_init(&c->dec);
+    deadline_arm(&c->idle, DL_IDLE, idle_timeout_ms, fd, -1);
+    __atomic_fetch_add(&connections, 1, __ATOMIC_RELAXED);
+
+    if (upgrade) {
+        __atomic_fetch_add(&upgrades, 1, __ATOMIC_RELAXED);
+        rio_writen(fd, (void *)switching, strlen(switching));
+        c->preface = PREFACE_LEN;
+    } else
+        c->preface = PREFACE_LEN - strlen("PRI * HTTP/2.0\r\n");
+    p[0] = 0;
+    p[1] = 0x3;                     /* SETTINGS_MAX_CONCURRENT_STREAMS */
+    put32(p + 2, H2_MAX_STREAMS);
+    rc = send_frame(c, SETTINGS, 0, 0, p, 6);
+    if (upgrade) {
+        n = base64url(settings, c->block, sizeof(c->block));
+        apply_settings(c, c->block, n - n % 6);
+        c->last_id = 1;
+        stream_open(c, 1, upgrade, strlen(upgrade));
+    }
+
+    /* Bytes the client sent behind what was read are in rio's buffer */
+    memcpy(c->in, rp->rio_bufptr, c->inlen = rp->rio_cnt);
+    if (rc == 0)
+        rc = parse(c);
+
+    while (rc == 0 && !(c->goaway && c->nstreams == 0)) {
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        for (i = 0, n = 1; i < H2_MAX_STREAMS; i++)
+            if (c->streams[i] && c->streams[i]->outlen == 0 && !c->streams[i]->eof) {
+                pfd[n].fd = c->streams[i]->fd;
+                pfd[n].events = POLLIN;
+                map[n++] = i;
+            }
+        if (poll(pfd, n, busy ? 0 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[0].revents) {
+            if ((r = read(fd, c->in + c->inlen, sizeof(c->in) - c->inlen)) <= 0)
+                break;
+            deadline_touch(&c->idle);
+            c->inlen += r;
+            if ((rc = parse(c)) < 0)
+                break;
+        }
+        /* Streams are read and written one frame each, in turn */
+        for (i = 1; i < n && rc == 0; i++)
+            if (pfd[i].revents && c->streams[map[i]] &&
+                c->streams[map[i]]->fd == pfd[i].fd)
+                rc = pump(c, map[i]);
+        for (i = 0, busy = 0; i < H2_MAX_STREAMS && rc == 0; i++)
+            if (c->streams[i] && (rc = flush(c, i)) > 0) {
+                busy = 1;
+                rc = 0;
+            }
+    }
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+        if (c->streams[i])
+            stream_close(c, i);
+    deadline_cancel(&c->idle);
+    hpack_free(&c->dec);
+    free(c);
+    return 0;
+}
+
+/*
+ * h2_report - render the HTTP/2 counters as text into buf
+ */
+int h2_report(char *buf, size_t len)
+{
+    if (connections == 0)
+        return 0;
+    return snprintf(buf, len, "h2        connections=%lu upgrades=%lu "
+                    "streams=%lu active=%lu refused=%lu\n", connections,
+                    upgrades, streams, active, refused);
+}
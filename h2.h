@@ -0,0 +1,24 @@
+/*
+ * h2.h - HTTP/2 cleartext (h2c) connections from clients
+ */
+#ifndef __H2_H__
+#define __H2_H__
+
+#include <stddef.h>
+#include "csapp.h"
+
+#define H2_HEADER "X-Proxy-H2"      /* Marks requests that came in as streams */
+#define H2_MAX_STREAMS 100          /* Concurrent streams per connection */
+#define H2_FRAME 16384              /* Largest frame payload we send or take */
+
+/* Starts serving one stream: an HTTP/1.0 request is read from fd and
+   the response written to it. client is the address of the connection's
+   client. Returns 0 once fd is taken over, -1 to refuse the stream. */
+typedef int (*h2_stream_fn_t)(int fd, struct sockaddr_storage *client);
+
+void h2_init(h2_stream_fn_t fn, int idle_ms);
+int h2_is_preface(const char *line);
+int h2_serve(int fd, rio_t *rp, const char *upgrade, const char *settings);
+int h2_report(char *buf, size_t len);
+
+#endif /* __H2_H__ */
@@ -0,0 +1,158 @@
+/*
+ * handoff.c - Zero-downtime restart by passing the listening socket
+ *
+ * A running proxy offers its listening socket on a Unix-domain control
+ * socket. A new proxy started with the same control path connects to
+ * it and receives the listener as SCM_RIGHTS ancillary data, so the
+ * port is never closed and connections queued in the backlog are not
+ * lost. Once the new process confirms it has the descriptor, the old
+ * one is told (through handoff_fd()) to stop accepting and drain.
+ * Before giving the listener away the old process runs a hook, which
+ * the proxy uses to save its cache snapshot for the new one to load.
+ */
+#include "csapp.h"
+#include <sys/un.h>
+#include "handoff.h"
+
+static int ctlfd = -1;          /* Control socket we listen on */
+static int listener = -1;       /* The descriptor we hand out */
+static int done_pipe[2] = {-1, -1};
+static handoff_fn_t before_give = NULL;
+
+static int unix_address(struct sockaddr_un *sun, const char *path)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path))
+        return -1;
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+/*
+ * handoff_take - ask the process serving the control socket at path
+ * for its listening socket. Returns the descriptor, or -1 if nobody is
+ * there (a cold start).
+ */
+int handoff_take(const char *path)
+{
+    struct sockaddr_un sun;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte, cbuf[CMSG_SPACE(sizeof(int))];
+    int fd, lfd = -1;
+
+    if (unix_address(&sun, path) < 0 ||
+        (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (SA *)&sun, sizeof(sun)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(fd, &msg, 0) == 1 && (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+        cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&lfd, CMSG_DATA(cmsg), sizeof(int));
+        if (write(fd, "k", 1) != 1) {   /* Tell the old process to let go */
+            close(lfd);
+            lfd = -1;
+        }
+    }
+    close(fd);
+    return lfd;
+}
+
+/*
+ * give - send the listener to one new process; 0 once it confirmed
+ */
+static int give(int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte = 'L', cbuf[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listener, sizeof(int));
+
+    if (sendmsg(fd, &msg, 0) != 1 || read(fd, &byte, 1) != 1)
+        return -1;
+    return 0;
+}
+
+/*
+ * handoff_thread - wait for a new process and hand it the listener
+ */
+static void *handoff_thread(void *vargp)
+{
+    int fd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if ((fd = accept(ctlfd, NULL, NULL)) < 0)
+            continue;
+        if (before_give)
+            before_give();
+        if (give(fd) == 0) {
+            close(fd);
+            break;
+        }
+        close(fd);          /* It went away before confirming; keep serving */
+    }
+    close(ctlfd);
+    if (write(done_pipe[1], "x", 1) < 0)
+        perror("handoff");
+    return NULL;
+}
+
+/*
+ * handoff_offer - serve listenfd to the next process that asks on the
+ * control socket at path (replacing any stale one), calling before (if
+ * not NULL) right before it is handed over. Returns -1 on error.
+ */
+int handoff_offer(const char *path, int listenfd, handoff_fn_t before)
+{
+    struct sockaddr_un sun;
+    pthread_t tid;
+
+    if (unix_address(&sun, path) < 0 || pipe(done_pipe) < 0 ||
+        (ctlfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    unlink(path);
+    if (bind(ctlfd, (SA *)&sun, sizeof(sun)) < 0 || listen(ctlfd, 1) < 0) {
+        close(ctlfd);
+        return -1;
+    }
+    listener = listenfd;
+    before_give = before;
+    Pthread_create(&tid, NULL, handoff_thread, NULL);
+    return 0;
+}
+
+/*
+ * handoff_fd - a descriptor that becomes readable once the listener has
+ * been handed to a new process and this one should stop accepting
+ */
+int handoff_fd(void)
+{
+    return done_pipe[0];
+}
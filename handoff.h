@@ -0,0 +1,14 @@
+/*
+ * handoff.h - Zero-downtime restart by passing the listening socket
+ */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+/* Runs in the old process just before the listener is handed over */
+typedef void (*handoff_fn_t)(void);
+
+int handoff_take(const char *path);
+int handoff_offer(const char *path, int listenfd, handoff_fn_t before);
+int handoff_fd(void);
+
+#endif /* __HANDOFF_H__ */
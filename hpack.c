@@ -0,0 +1,407 @@
+/*
+ * hpack.c - HPACK header compression for HTTP/2 (RFC 7541)
+ *
+ * The decoder handles every representation a client may send: indexed
+ * fields, literals with and without indexing, Huffman-coded strings
+ * and dynamic table size updates. Its dynamic table is capped at the
+ * default HPACK_TABLE_SIZE, which is what the proxy advertises.
+ *
+ * The encoder is deliberately simple: responses carry :status from the
+ * static table where it is there, and everything else as literals
+ * without indexing and without Huffman coding. That costs a few bytes
+ * per header but keeps no state, so streams can be encoded in any
+ * order.
+ */
+#include "csapp.h"
+#include "hpack.h"
+
+#define NSTATIC 61
+
+static const char *static_table[NSTATIC][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Huffman code lengths by symbol (256 = EOS). The code is canonical:
+   codes are assigned in order of length, then symbol. */
+static const unsigned char huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static unsigned huff_first[31];     /* First code of each length */
+static unsigned short huff_count[31];
+static unsigned short huff_offset[31];  /* Into huff_syms */
+static unsigned short huff_syms[257];   /* By length, then symbol */
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+
+/*
+ * huff_build - derive the canonical decoding tables from huff_len
+ */
+static void huff_build(void)
+{
+    unsigned code = 0;
+    int len, sym, n = 0;
+
+    for (len = 1; len <= 30; len++) {
+        huff_first[len] = code;
+        huff_offset[len] = n;
+        for (sym = 0; sym < 257; sym++)
+            if (huff_len[sym] == len)
+                huff_syms[n++] = sym;
+        huff_count[len] = n - huff_offset[len];
+        code = (code + huff_count[len]) << 1;
+    }
+}
+
+/*
+ * huff_decode - decode len Huffman-coded bytes into out. Returns the
+ * length decoded, or -1 if the string is malformed or does not fit.
+ */
+static int huff_decode(const unsigned char *p, size_t len, char *out, size_t outlen)
+{
+    unsigned code = 0, bits = 0;
+    size_t i, n = 0;
+    int b, sym;
+
+    for (i = 0; i < len; i++)
+        for (b = 7; b >= 0; b--) {
+            code = (code << 1) | ((p[i] >> b) & 1);
+            if (++bits > 30)
+                return -1;
+            if (code - huff_first[bits] >= huff_count[bits])
+                continue;
+            sym = huff_syms[huff_offset[bits] + code - huff_first[bits]];
+            if (sym == 256 || n == outlen)
+                return -1;
+            out[n++] = sym;
+            code = bits = 0;
+        }
+    /* What is left must be padding: under a byte of EOS's leading 1s */
+    if (bits > 7 || code != (1U << bits) - 1)
+        return -1;
+    return n;
+}
+
+/*
+ * get_int - decode an integer with an n-bit prefix
+ */
+static int get_int(const unsigned char **pp, const unsigned char *end, int n,
+                   size_t *v)
+{
+    const unsigned char *p = *pp;
+    unsigned max = (1 << n) - 1;
+    int shift = 0;
+
+    if (p == end)
+        return -1;
+    if ((*v = *p++ & max) == max) {
+        do {
+            if (p == end || shift > 21)
+                return -1;
+            *v += (size_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+    }
+    *pp = p;
+    return 0;
+}
+
+/*
+ * get_string - decode a string literal into buf, NUL-terminated.
+ * Returns the position after it in buf, or NULL. A NUL inside the
+ * string is stored as a CR: that keeps its length (and so the dynamic
+ * table's size in step with the peer's) and leaves it just as invalid
+ * a field for the caller to refuse.
+ */
+static char *get_string(const unsigned char **pp, const unsigned char *end,
+                        char *buf, char *bufend)
+{
+    int huff = **pp & 0x80, n, i;
+    ptrdiff_t room = bufend - buf - 1;  /* Bytes left before the NUL */
+    size_t len;
+
+    if (room < 0 || get_int(pp, end, 7, &len) < 0 ||
+        len > (size_t)(end - *pp))
+        return NULL;
+    if (huff)
+        n = huff_decode(*pp, len, buf, (size_t)room);
+    else if ((n = len) <= room)
+        memcpy(buf, *pp, len);
+    else
+        n = -1;
+    if (n < 0)
+        return NULL;
+    *pp += len;
+    for (i = 0; i < n; i++)
+        if (buf[i] == '\0')
+            buf[i] = '\r';
+    buf[n] = '\0';
+    return buf + n + 1;
+}
+
+/*
+ * evict - drop the oldest entries until the table fits in max
+ */
+static void evict(hpack_t *h, size_t max)
+{
+    int i;
+
+    while (h->count > 0 && h->size > max) {
+        i = (h->head + h->count - 1) % HPACK_MAX_ENTRIES;
+        h->size -= h->sizes[i];
+        free(h->ents[i]);
+        h->count--;
+    }
+}
+
+/*
+ * add - insert a field at the front of the dynamic table
+ */
+static void add(hpack_t *h, const char *name, const char *value)
+{
+    size_t nlen = strlen(name), vlen = strlen(value), size = nlen + vlen + 32;
+
+    evict(h, size <= h->max ? h->max - size : 0);
+    if (size > h->max)                  /* Too big: the table just empties */
+        return;
+    h->head = (h->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    h->ents[h->head] = Malloc(nlen + vlen + 2);
+    memcpy(h->ents[h->head], name, nlen + 1);
+    memcpy(h->ents[h->head] + nlen + 1, value, vlen + 1);
+    h->sizes[h->head] = size;
+    h->size += size;
+    h->count++;
+}
+
+/*
+ * lookup - the name and value at index i (1-based, static table first)
+ */
+static int lookup(hpack_t *h, size_t i, const char **name, const char **value)
+{
+    char *e;
+
+    if (i == 0)
+        return -1;
+    if (i <= NSTATIC) {
+        *name = static_table[i - 1][0];
+        *value = static_table[i - 1][1];
+        return 0;
+    }
+    if ((i -= NSTATIC + 1) >= (size_t)h->count)
+        return -1;
+    e = h->ents[(h->head + i) % HPACK_MAX_ENTRIES];
+    *name = e;
+    *value = e + strlen(e) + 1;
+    return 0;
+}
+
+void hpack_init(hpack_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->max = HPACK_TABLE_SIZE;
+    pthread_once(&huff_once, huff_build);
+}
+
+void hpack_free(hpack_t *h)
+{
+    evict(h, 0);
+}
+
+/*
+ * hpack_decode - decode a complete header block into at most maxf
+ * fields, whose strings are stored in buf. Returns the number of
+ * fields, or -1 on a compression error (after which the table is out
+ * of step with the peer's and the connection has to go).
+ */
+int hpack_decode(hpack_t *h, const unsigned char *p, size_t len,
+                 hpack_field_t *f, int maxf, char *buf, size_t buflen)
+{
+    const unsigned char *end = p + len;
+    char *b = buf, *bufend = buf + buflen, *name, *value;
+    const char *sname, *svalue;
+    size_t i;
+    int n = 0, prefix, index;
+
+    while (p < end) {
+        if ((*p & 0xe0) == 0x20) {          /* Dynamic table size update */
+            if (get_int(&p, end, 5, &i) < 0 || i > HPACK_TABLE_SIZE)
+                return -1;
+            h->max = i;
+            evict(h, i);
+            continue;
+        }
+        if (n == maxf)
+            return -1;
+        if (*p & 0x80) {                    /* Indexed field */
+            if (get_int(&p, end, 7, &i) < 0 || lookup(h, i, &sname, &svalue) < 0)
+                return -1;
+            if (strlen(sname) + strlen(svalue) + 2 > (size_t)(bufend - b))
+                return -1;
+            f[n].name = strcpy(b, sname);
+            b += strlen(b) + 1;
+            f[n++].value = strcpy(b, svalue);
+            b += strlen(b) + 1;
+            continue;
+        }
+
+        /* A literal: with incremental indexing, without, or never */
+        index = (*p & 0xc0) == 0x40;
+        prefix = index ? 6 : 4;
+        if (get_int(&p, end, prefix, &i) < 0)
+            return -1;
+        name = b;
+        if (i == 0)
+            b = get_string(&p, end, b, bufend);
+        else if (lookup(h, i, &sname, &svalue) < 0 ||
+                 strlen(sname) + 1 > (size_t)(bufend - b))
+            return -1;
+        else
+            b = strcpy(b, sname) + strlen(sname) + 1;
+        if (b == NULL || (b = get_string(&p, end, value = b, bufend)) == NULL)
+            return -1;
+        f[n].name = name;
+        f[n++].value = value;
+        if (index)
+            add(h, name, value);
+    }
+    return n;
+}
+
+/*
+ * hpack_encode_status - encode :status. Returns the bytes written (at
+ * most 5).
+ */
+size_t hpack_encode_status(unsigned char *out, int status)
+{
+    static const int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    int i;
+
+    for (i = 0; i < 7; i++)
+        if (indexed[i] == status)
+            break;
+    if (i < 7) {
+        out[0] = 0x80 | (8 + i);
+        return 1;
+    }
+    status = status > 0 && status < 1000 ? status : 502;
+    out[0] = 0x08;                      /* Literal, name :status, no index */
+    out[1] = 3;
+    out[2] = '0' + status / 100;
+    out[3] = '0' + status / 10 % 10;
+    out[4] = '0' + status % 10;
+    return 5;
+}
+
+/*
+ * put_string - a raw string literal; returns the bytes written or 0
+ */
+static size_t put_string(unsigned char *out, size_t outlen, const char *s)
+{
+    size_t len = strlen(s), n = 0, v = len;
+
+    if (outlen < len + 4)
+        return 0;
+    if (v < 127)
+        out[n++] = v;
+    else {
+        out[n++] = 127;
+        for (v -= 127; v >= 128; v >>= 7)
+            out[n++] = (v & 0x7f) | 0x80;
+        out[n++] = v;
+    }
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+/*
+ * hpack_encode - encode a field (name in lowercase) as a literal
+ * without indexing. Returns the bytes written, 0 if it does not fit.
+ */
+size_t hpack_encode(unsigned char *out, size_t outlen,
+                    const char *name, const char *value)
+{
+    size_t n, m;
+
+    if (outlen < 1)
+        return 0;
+    out[0] = 0x00;
+    if ((n = put_string(out + 1, outlen - 1, name)) == 0 ||
+        (m = put_string(out + 1 + n, outlen - 1 - n, value)) == 0)
+        return 0;
+    return 1 + n + m;
+}
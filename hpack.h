@@ -0,0 +1,34 @@
+/*
+ * hpack.h - HPACK header compression for HTTP/2 (RFC 7541)
+ */
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#include <stddef.h>
+
+#define HPACK_TABLE_SIZE 4096   /* Dynamic table we allow (the default) */
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+/* A decoded header field; both strings are NUL-terminated (a NUL the
+   peer sent inside one is decoded as a CR) */
+typedef struct {
+    const char *name, *value;
+} hpack_field_t;
+
+/* The decoder's dynamic table: a ring, newest entry at head */
+typedef struct {
+    char *ents[HPACK_MAX_ENTRIES];  /* "name\0value\0" */
+    size_t sizes[HPACK_MAX_ENTRIES];
+    int head, count;
+    size_t size, max;
+} hpack_t;
+
+void hpack_init(hpack_t *h);
+void hpack_free(hpack_t *h);
+int hpack_decode(hpack_t *h, const unsigned char *p, size_t len,
+                 hpack_field_t *f, int maxf, char *buf, size_t buflen);
+size_t hpack_encode_status(unsigned char *out, int status);
+size_t hpack_encode(unsigned char *out, size_t outlen,
+                    const char *name, const char *value);
+
+#endif /* __HPACK_H__ */
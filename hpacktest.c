@@ -0,0 +1,67 @@
+/*
+ * hpacktest.c - Checks of the HPACK decoder against malformed blocks
+ *
+ * Each case decodes one header block into a field buffer with guard
+ * bytes behind it, and checks the result and that the guard is intact.
+ * Exits nonzero if any case fails.
+ *
+ * usage: hpacktest
+ */
+#include "csapp.h"
+#include "hpack.h"
+
+#define GUARD 64                 /* Guard bytes behind the field buffer */
+
+static int failed = 0;
+
+/*
+ * check - decode block with a field buffer of buflen bytes and compare
+ * the number of fields returned with want
+ */
+static void check(const char *name, const unsigned char *block, size_t len,
+                  size_t buflen, int want)
+{
+    hpack_t h;
+    hpack_field_t f[8];
+    char *buf = Malloc(buflen + GUARD);
+    int n, i, ok;
+
+    memset(buf + buflen, 0x5a, GUARD);
+    hpack_init(&h);
+    n = hpack_decode(&h, block, len, f, 8, buf, buflen);
+    for (ok = n == want, i = 0; i < GUARD; i++)
+        if (buf[buflen + i] != 0x5a)
+            ok = 0;
+    hpack_free(&h);
+    Free(buf);
+    printf("%-28s %s (got %d, want %d)\n", name, ok ? "ok" : "FAIL", n, want);
+    failed |= !ok;
+}
+
+int main(void)
+{
+    /* A literal "abcde: 123456789", which takes exactly 16 bytes */
+    static const unsigned char fill[] = {
+        0x00, 0x05, 'a', 'b', 'c', 'd', 'e',
+        0x09, '1', '2', '3', '4', '5', '6', '7', '8', '9'
+    };
+    /* The same, then a literal whose name is Huffman-coded "a" */
+    static const unsigned char fill_huff[] = {
+        0x00, 0x05, 'a', 'b', 'c', 'd', 'e',
+        0x09, '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        0x00, 0x81, 0x1f, 0x81, 0x1f
+    };
+    /* The same, then a literal whose name is raw "a" */
+    static const unsigned char fill_raw[] = {
+        0x00, 0x05, 'a', 'b', 'c', 'd', 'e',
+        0x09, '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        0x00, 0x01, 'a', 0x01, 'a'
+    };
+
+    check("exact fill", fill, sizeof(fill), 16, 1);
+    check("one byte short", fill, sizeof(fill), 15, -1);
+    check("huffman after exact fill", fill_huff, sizeof(fill_huff), 16, -1);
+    check("raw after exact fill", fill_raw, sizeof(fill_raw), 16, -1);
+    check("huffman with room", fill_huff, sizeof(fill_huff), 20, 2);
+    return failed;
+}
@@ -0,0 +1,349 @@
+/*
+ * http.c - HTTP parsing and logging helpers for the proxy
+ *
+ * These live apart from proxy.c so that the microbenchmarks in bench.c
+ * can drive them without the rest of the proxy.
+ */
+#include "csapp.h"
+#include "http.h"
+
+/*
+ * startsWith check if the second string has the first string as a predicate.
+ * Takes two valid string constants and returns the bool value (int).
+ */
+int startsWith(const char *pre, const char *str)
+{
+    size_t lenpre = strlen(pre),
+    lenstr = strlen(str);
+    return lenstr < lenpre ? 0 : strncmp(pre, str, lenpre) == 0;
+}
+
+/*
+ * parse_uri - URI parser
+ *
+ * Given a URI from an HTTP proxy GET request (i.e., a URL), extract
+ * the host name, path name, and port.  The memory for hostname and
+ * pathname must already be allocated and should be at least MAXLINE
+ * bytes. Return -1 if there are any problems.
+ */
+int parse_uri(char *uri, char *hostname, char *pathname, char *port)
+{
+    char *hostbegin;
+    char *hostend;
+    char *pathbegin;
+    int len;
+
+    if (strncasecmp(uri, "http://", 7) != 0) {
+        hostname[0] = '\0';
+        return -1;
+    }
+
+    /* Extract the host name */
+    hostbegin = uri + 7;
+    hostend = strpbrk(hostbegin, " :/\r\n\0");
+    if (hostend == NULL)
+        hostend = hostbegin + strlen(hostbegin);
+    len = hostend - hostbegin;
+    strncpy(hostname, hostbegin, len);
+    hostname[len] = '\0';
+
+    /* Extract the port number (digits only, not the path behind it) */
+    if (*hostend == ':') {
+        len = strspn(hostend + 1, "0123456789");
+        if (len == 0 || len > 5)
+            return -1;
+        strncpy(port, hostend + 1, len);
+        port[len] = '\0';
+    }
+    else
+        strcpy(port,"80");/* default */
+
+    /* Extract the path */
+    pathbegin = strchr(hostbegin, '/');
+    if (pathbegin == NULL) {
+        pathname[0] = '\0';
+    }
+    else {
+        pathbegin++;
+        strcpy(pathname, pathbegin);
+    }
+
+    return 0;
+}
+
+/*
+ * parse_authority - split a CONNECT target "host:port" (or "[v6]:port")
+ * into hostname and port. Returns -1 if there is no valid port.
+ */
+int parse_authority(char *authority, char *hostname, char *port)
+{
+    char *colon = strrchr(authority, ':');
+    char *host = authority;
+    size_t len, plen;
+
+    if (colon == NULL)
+        return -1;
+    plen = strspn(colon + 1, "0123456789");
+    if (plen == 0 || plen > 5 || colon[1 + plen] != '\0')
+        return -1;
+    len = colon - host;
+    if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+        host++;
+        len -= 2;
+    }
+    if (len == 0 || len >= MAXLINE)
+        return -1;
+    memcpy(hostname, host, len);
+    hostname[len] = '\0';
+    strcpy(port, colon + 1);
+    return 0;
+}
+
+/*
+ * format_log_entry - Create a formatted log entry in logstring. 
+ * 
+ * The inputs are the socket address of the requesting client
+ * (sockaddr), the URI from the request (uri), the size in bytes
+ * of the response from the server (size), and an optional trailer
+ * such as the phase timing breakdown (extra, may be NULL).
+ */
+void format_log_entry(char *logstring, char* ipaddr, char *uri, int size,
+                      char *extra)
+{
+    time_t now;
+    char time_str[MAXLINE];
+
+    /* Get a formatted time string */
+    now = time(NULL);
+    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime(&now));
+
+    //storing the formatted log entry string in logstring
+    if (extra)
+        sprintf(logstring, "%s %s %s %d %s\n", time_str, ipaddr, uri, size, extra);
+    else
+        sprintf(logstring, "%s %s %s %d\n", time_str, ipaddr, uri, size);
+}
+
+/*
+ * http_header - find header "name" in a NUL-terminated header block and
+ * copy its value, without leading blanks or the line end, into value.
+ * Returns 1 if the header is present, 0 if not.
+ */
+int http_header(const char *hdrs, const char *name, char *value, size_t len)
+{
+    size_t nlen = strlen(name), vlen;
+    const char *line = hdrs, *v;
+
+    while (line && *line) {
+        if (!strncasecmp(line, name, nlen) && line[nlen] == ':') {
+            v = line + nlen + 1;
+            v += strspn(v, " \t");
+            vlen = strcspn(v, "\r\n");
+            if (vlen >= len)
+                vlen = len - 1;
+            memcpy(value, v, vlen);
+            value[vlen] = '\0';
+            return 1;
+        }
+        if ((line = strchr(line, '\n')) != NULL)
+            line++;
+    }
+    return 0;
+}
+
+/*
+ * Header names by a perfect hash of their length and first and last
+ * characters (lowercase), so recognizing one costs a scan to the colon
+ * and a single comparison, however many names there are. The slots
+ * and multipliers were found by a search over the names; adding one
+ * means searching again (h2.h's H2_HEADER and peer.h's PEER_HEADER are
+ * in it, lowercase).
+ */
+static const struct {
+    const char *name;
+    unsigned char len, id;
+} hdr_names[HTTP_HDR_SLOTS] = {
+    [0] = {"set-cookie", 10, HDR_SET_COOKIE},
+    [1] = {"date", 4, HDR_DATE},
+    [2] = {"last-modified", 13, HDR_LAST_MODIFIED},
+    [6] = {"if-range", 8, HDR_IF_RANGE},
+    [7] = {"http2-settings", 14, HDR_HTTP2_SETTINGS},
+    [8] = {"etag", 4, HDR_ETAG},
+    [12] = {"content-type", 12, HDR_CONTENT_TYPE},
+    [13] = {"pragma", 6, HDR_PRAGMA},
+    [17] = {"range", 5, HDR_RANGE},
+    [20] = {"upgrade", 7, HDR_UPGRADE},
+    [22] = {"content-encoding", 16, HDR_CONTENT_ENCODING},
+    [25] = {"if-none-match", 13, HDR_IF_NONE_MATCH},
+    [26] = {"location", 8, HDR_LOCATION},
+    [27] = {"connection", 10, HDR_CONNECTION},
+    [30] = {"proxy-connection", 16, HDR_PROXY_CONNECTION},
+    [32] = {"age", 3, HDR_AGE},
+    [34] = {"x-proxy-peer", 12, HDR_X_PROXY_PEER},
+    [35] = {"vary", 4, HDR_VARY},
+    [36] = {"host", 4, HDR_HOST},
+    [39] = {"user-agent", 10, HDR_USER_AGENT},
+    [40] = {"keep-alive", 10, HDR_KEEP_ALIVE},
+    [42] = {"accept-encoding", 15, HDR_ACCEPT_ENCODING},
+    [49] = {"transfer-encoding", 17, HDR_TRANSFER_ENCODING},
+    [50] = {"expires", 7, HDR_EXPIRES},
+    [53] = {"content-length", 14, HDR_CONTENT_LENGTH},
+    [54] = {"content-range", 13, HDR_CONTENT_RANGE},
+    [60] = {"if-modified-since", 17, HDR_IF_MODIFIED_SINCE},
+    [62] = {"x-proxy-h2", 10, HDR_X_PROXY_H2},
+    [63] = {"cache-control", 13, HDR_CACHE_CONTROL},
+};
+
+#define HDR_HASH(len, first, last) \
+    ((((len) * 10) ^ ((first) * 59) ^ (last)) & (HTTP_HDR_SLOTS - 1))
+#define LOWER(c) ((unsigned char)((c) - 'A') < 26 ? (c) + ('a' - 'A') : (c))
+
+/*
+ * http_header_id - which header a "Name: value" line is (HDR_OTHER if
+ * none we know), compared case-insensitively. If value is not NULL it
+ * is pointed at the value, past leading blanks.
+ */
+int http_header_id(const char *line, const char **value)
+{
+    const char *colon = strchr(line, ':'), *v;
+    size_t len;
+    int h;
+
+    if (colon == NULL || (len = colon - line) == 0 || len > 255)
+        return HDR_OTHER;
+    if (value) {
+        for (v = colon + 1; *v == ' ' || *v == '\t'; v++)
+            ;
+        *value = v;
+    }
+    h = HDR_HASH(len, LOWER(line[0]), LOWER(line[len - 1]));
+    if (hdr_names[h].len != len || strncasecmp(line, hdr_names[h].name, len))
+        return HDR_OTHER;
+    return hdr_names[h].id;
+}
+
+/*
+ * http_status - the status code of a response's status line, 0 if it
+ * does not have one
+ */
+int http_status(const char *line)
+{
+    int status = 0;
+
+    sscanf(line, "HTTP/%*s %d", &status);
+    return status;
+}
+
+/*
+ * http_resp_init - no status and none of the headers seen yet
+ */
+void http_resp_init(http_resp_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->len = -1;
+    r->maxage = -1;
+}
+
+/*
+ * cache_control - apply the directives of a Cache-Control value: any
+ * of no-store, no-cache and private forbid storing, s-maxage takes
+ * precedence over max-age
+ */
+static void cache_control(http_resp_t *r, const char *v)
+{
+    int shared = 0;
+    size_t n;
+
+    while (*v && *v != '\r' && *v != '\n') {
+        v += strspn(v, " \t,");
+        n = strcspn(v, " \t,=\r\n");
+        if ((n == 8 && !strncasecmp(v, "no-store", 8)) ||
+            (n == 8 && !strncasecmp(v, "no-cache", 8)) ||
+            (n == 7 && !strncasecmp(v, "private", 7)))
+            r->nostore = 1;
+        else if (n == 8 && !strncasecmp(v, "s-maxage", 8) && v[n] == '=') {
+            r->maxage = atol(v + n + 1);
+            shared = 1;
+        } else if (n == 7 && !strncasecmp(v, "max-age", 7) && v[n] == '=' &&
+                   !shared)
+            r->maxage = atol(v + n + 1);
+        v += n;
+        v += strcspn(v, ",\r\n");  /* Skip the rest of the directive */
+    }
+}
+
+/*
+ * http_resp_header - record what a response header line says, if it is
+ * one the proxy acts on. Returns the line's header id.
+ */
+int http_resp_header(http_resp_t *r, const char *line)
+{
+    const char *v;
+    size_t n, i;
+    int id = http_header_id(line, &v);
+
+    switch (id) {
+    case HDR_CONTENT_LENGTH:
+        r->len = atol(v);
+        break;
+    case HDR_TRANSFER_ENCODING:
+        r->chunked = 1;
+        break;
+    case HDR_CONTENT_ENCODING:
+        r->encoded = 1;
+        break;
+    case HDR_CONTENT_TYPE:
+        n = strcspn(v, "; \t\r\n");
+        if (n >= sizeof(r->type))
+            n = sizeof(r->type) - 1;
+        for (i = 0; i < n; i++)
+            r->type[i] = tolower((unsigned char)v[i]);
+        r->type[n] = '\0';
+        r->ishtml = !strcmp(r->type, "text/html");
+        break;
+    case HDR_CACHE_CONTROL:
+        cache_control(r, v);
+        break;
+    }
+    return id;
+}
+
+/*
+ * http_writev - send bytes off..off+len-1 of a body held in the n
+ * pieces of body, with writev() in batches of HTTP_IOV_BATCH pieces.
+ * Returns the bytes sent, or -1 on a write error.
+ */
+long http_writev(int fd, const struct iovec *body, int n, long off, long len)
+{
+    struct iovec v[HTTP_IOV_BATCH];
+    long sent = 0, want;
+    ssize_t w;
+    int i = 0, j, k;
+    size_t o;
+
+    while (i < n && off >= (long)body[i].iov_len) {
+        off -= body[i].iov_len;
+        i++;
+    }
+    while (sent < len) {
+        for (k = 0, j = i, o = off, want = 0;
+             k < HTTP_IOV_BATCH && j < n && want < len - sent; j++, o = 0) {
+            v[k].iov_base = (char *)body[j].iov_base + o;
+            v[k].iov_len = body[j].iov_len - o;
+            if ((long)v[k].iov_len > len - sent - want)
+                v[k].iov_len = len - sent - want;
+            want += v[k++].iov_len;
+        }
+        if (k == 0)
+            break;
+        if ((w = writev(fd, v, k)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += w;
+        for (off += w; i < n && off >= (long)body[i].iov_len; i++)
+            off -= body[i].iov_len;
+    }
+    return sent;
+}
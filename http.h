@@ -0,0 +1,49 @@
+/*
+ * http.h - HTTP parsing and logging helpers for the proxy
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define HTTP_IOV_BATCH 64           /* Pieces per writev() */
+#define HTTP_HDR_SLOTS 64           /* Perfect hash table of header names */
+
+/* Header names http_header_id() recognizes, HDR_OTHER for the rest */
+enum {
+    HDR_OTHER, HDR_ACCEPT_ENCODING, HDR_AGE, HDR_CACHE_CONTROL,
+    HDR_CONNECTION, HDR_CONTENT_ENCODING, HDR_CONTENT_LENGTH,
+    HDR_CONTENT_RANGE, HDR_CONTENT_TYPE, HDR_DATE, HDR_ETAG, HDR_EXPIRES,
+    HDR_HOST, HDR_HTTP2_SETTINGS, HDR_IF_MODIFIED_SINCE, HDR_IF_NONE_MATCH,
+    HDR_IF_RANGE, HDR_KEEP_ALIVE, HDR_LAST_MODIFIED, HDR_LOCATION,
+    HDR_PRAGMA, HDR_PROXY_CONNECTION, HDR_RANGE, HDR_SET_COOKIE,
+    HDR_TRANSFER_ENCODING, HDR_UPGRADE, HDR_USER_AGENT, HDR_VARY,
+    HDR_X_PROXY_H2, HDR_X_PROXY_PEER, NHDR
+};
+
+/* What the proxy acts on in a response's status line and headers */
+typedef struct {
+    int status;
+    long len;                   /* Content-Length, -1 if absent */
+    int chunked;                /* Has a Transfer-Encoding */
+    int encoded;                /* Has a Content-Encoding */
+    int ishtml;                 /* Content-Type is text/html */
+    char type[64];              /* Content-Type media type, lowercase */
+    int nostore;                /* Cache-Control forbids storing it */
+    long maxage;                /* Cache-Control (s-)max-age, -1 if absent */
+} http_resp_t;
+
+int parse_uri(char *uri, char *hostname, char *pathname, char *port);
+int parse_authority(char *authority, char *hostname, char *port);
+int startsWith(const char *pre, const char *str);
+int http_header(const char *hdrs, const char *name, char *value, size_t len);
+int http_header_id(const char *line, const char **value);
+int http_status(const char *line);
+void http_resp_init(http_resp_t *r);
+int http_resp_header(http_resp_t *r, const char *line);
+void format_log_entry(char *logstring, char *ipaddr, char *uri, int size,
+                      char *extra);
+long http_writev(int fd, const struct iovec *body, int n, long off, long len);
+
+#endif /* __HTTP_H__ */
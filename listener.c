@@ -0,0 +1,147 @@
+/*
+ * listener.c - Listening socket options and batched accept
+ *
+ * The main thread used to take one connection per poll() wakeup, so a
+ * storm of short connections cost a poll and an accept per client.
+ * Here the listener is non-blocking and listener_accept() drains up to
+ * a batch of connections per wakeup with accept4(SOCK_CLOEXEC), which
+ * also saves the fcntl() calls. The accepted sockets stay blocking:
+ * their threads read them with rio.
+ *
+ * listener_tune() applies the socket options, to a listener we opened
+ * or one taken over from another process alike:
+ *   - a larger backlog, so bursts queue in the kernel instead of being
+ *     dropped (capped by net.core.somaxconn);
+ *   - TCP_DEFER_ACCEPT, so a connection is only queued once its first
+ *     data has arrived and its thread never waits for the request line;
+ *   - TCP_FASTOPEN, so returning clients can send the request in the
+ *     SYN (the server side must be enabled in net.ipv4.tcp_fastopen).
+ *
+ * One descriptor is kept in reserve: when accept() fails with EMFILE
+ * the connection would stay queued and wake us up forever, so the
+ * reserve is given up to accept it and close it right away.
+ */
+#include "csapp.h"
+#include <netinet/tcp.h>
+#include <sys/syscall.h>
+#include "listener.h"
+
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 23
+#endif
+
+static int backlog_len = LISTENQ, defer = 0, fastopen_qlen = 0;
+static int reserve = -1;            /* Given up when out of descriptors */
+static unsigned long accepted = 0, wakeups = 0, max_batch = 0;
+static unsigned long full_batches = 0, refused = 0;
+
+/*
+ * somaxconn - the kernel's cap on listen backlogs, 0 if unknown
+ */
+static int somaxconn(void)
+{
+    FILE *fp = fopen("/proc/sys/net/core/somaxconn", "r");
+    int n = 0;
+
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%d", &n) != 1)
+        n = 0;
+    fclose(fp);
+    return n;
+}
+
+/*
+ * listener_tune - make listenfd non-blocking and apply the backlog,
+ * TCP_DEFER_ACCEPT (defer_secs, 0 = off) and TCP_FASTOPEN (queue of
+ * fastopen pending connections, 0 = off)
+ */
+void listener_tune(int listenfd, int backlog, int defer_secs, int fastopen)
+{
+    int max = somaxconn();
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    if (backlog > 0) {
+        if (max > 0 && backlog > max)
+            fprintf(stderr, "backlog %d is capped at net.core.somaxconn=%d\n",
+                    backlog, max);
+        if (listen(listenfd, backlog) == 0) //a listening socket just resizes
+            backlog_len = (max > 0 && backlog > max) ? max : backlog;
+    }
+    if (setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   &defer_secs, sizeof(int)) == 0)
+        defer = defer_secs;
+    if (fastopen > 0) {
+        if (setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+                       &fastopen, sizeof(int)) == 0)
+            fastopen_qlen = fastopen;
+        else
+            fprintf(stderr, "TCP Fast Open unavailable: %s\n", strerror(errno));
+    }
+    if (reserve < 0)
+        reserve = open("/dev/null", O_RDONLY);
+}
+
+/*
+ * refuse - out of descriptors: accept one connection on the reserve
+ * descriptor and close it, so it does not wake us up again
+ */
+static void refuse(int listenfd)
+{
+    int fd;
+
+    if (reserve < 0)
+        return;
+    close(reserve);
+    if ((fd = accept(listenfd, NULL, NULL)) >= 0) {
+        close(fd);
+        refused++;
+    }
+    reserve = open("/dev/null", O_RDONLY);
+}
+
+/*
+ * listener_accept - take up to max connections off the non-blocking
+ * listenfd. Returns how many were put into conns; 0 when none was
+ * pending (another process may have taken it).
+ */
+int listener_accept(int listenfd, accepted_t *conns, int max)
+{
+    int n = 0, fd;
+
+    while (n < max) {
+        conns[n].addrlen = sizeof(struct sockaddr_storage);
+        fd = syscall(SYS_accept4, listenfd, (SA *)&conns[n].addr,
+                     &conns[n].addrlen, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            conns[n++].fd = fd;
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (errno == EMFILE || errno == ENFILE)
+            refuse(listenfd);
+        break;                      /* EAGAIN: the queue is empty */
+    }
+    wakeups++;
+    accepted += n;
+    if (n > max_batch)
+        max_batch = n;
+    if (n == max)
+        full_batches++;
+    return n;
+}
+
+/*
+ * listener_report - render the listener settings and accept counters
+ * as text into buf
+ */
+int listener_report(char *buf, size_t len)
+{
+    return snprintf(buf, len, "listener  backlog=%d defer-accept=%ds "
+                    "fastopen=%d accepted=%lu wakeups=%lu max-batch=%lu "
+                    "full-batches=%lu refused=%lu\n",
+                    backlog_len, defer, fastopen_qlen, accepted, wakeups,
+                    max_batch, full_batches, refused);
+}
@@ -0,0 +1,23 @@
+/*
+ * listener.h - Listening socket options and batched accept
+ */
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+#include <stddef.h>
+#include "csapp.h"
+
+#define LISTENER_BATCH 64           /* Most connections taken per wakeup */
+
+/* A connection taken off the listen queue */
+typedef struct {
+    int fd;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} accepted_t;
+
+void listener_tune(int listenfd, int backlog, int defer_secs, int fastopen);
+int listener_accept(int listenfd, accepted_t *conns, int max);
+int listener_report(char *buf, size_t len);
+
+#endif /* __LISTENER_H__ */
@@ -0,0 +1,503 @@
+/*
+ * loadgen.c - HTTP load generator for benchmarking the proxy
+ *
+ * Drives the proxy (or any HTTP server) from localhost and reports
+ * throughput and latency percentiles. Two modes:
+ *
+ *   closed loop  -c N connections each issue the next request as soon
+ *                as the previous one finishes.
+ *   open loop    -r R requests/s arrive on a fixed schedule no matter
+ *                how fast the server answers. Latency is measured from
+ *                the scheduled arrival time, so a stalled server is
+ *                charged for the requests queued behind it.
+ *
+ * Targets are URLs with optional weights (URL@weight). A URL may contain
+ * "{size}", which is replaced by a size drawn from the -z mix, e.g.
+ *   loadgen -x localhost:15213 -z 1024:60,65536:30,1048576:10 \
+ *           -u 'http://localhost:8000/bytes/{size}'
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include "csapp.h"
+
+#define MAX_TARGETS 64
+#define MAX_SIZES   32
+
+struct target {
+    char host[MAXLINE];
+    char port[16];
+    char url[MAXLINE];       /* As given, possibly containing {size} */
+    char path[MAXLINE];      /* Origin-form request target */
+    int weight;
+};
+
+struct size_class {
+    long size;
+    int weight;
+};
+
+struct worker {
+    pthread_t tid;
+    unsigned seed;
+    uint64_t *lat;           /* Latency samples (ns) */
+    size_t nlat, caplat;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t connects;
+};
+
+/* Configuration */
+static struct target targets[MAX_TARGETS];
+static int ntargets = 0, target_weight = 0;
+static struct size_class sizes[MAX_SIZES];
+static int nsizes = 0, size_weight = 0;
+static char proxy_host[MAXLINE], proxy_port[16];
+static int use_proxy = 0;
+static int nconns = 1;
+static double rate = 0;      /* 0 = closed loop */
+static double duration = 10;
+static long max_requests = 0;
+static int keepalive = 0;
+static int json = 0;
+
+/* Shared run state */
+static uint64_t start_ns, end_ns;
+static uint64_t next_slot = 0;   /* Open loop: index of next arrival */
+static long issued = 0;          /* Requests handed out so far */
+static volatile int stop = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000000ULL;
+    ts.tv_nsec = t % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] -u URL[@weight] [-u URL[@weight] ...]\n"
+            "  -x host:port    send requests through this proxy\n"
+            "  -c N            concurrent connections (default 1)\n"
+            "  -r R            open loop at R requests/s (default closed loop)\n"
+            "  -d SECS         test duration (default 10)\n"
+            "  -n N            stop after N requests\n"
+            "  -z S:W,...      object size mix substituted for {size}\n"
+            "  -k              keep connections alive between requests\n"
+            "  -j              print the report as JSON\n", prog);
+    exit(1);
+}
+
+/*
+ * parse_url - split http://host[:port]/path into a target
+ */
+static int parse_url(char *url, struct target *t)
+{
+    char *p, *host, *slash, *colon;
+    size_t len;
+
+    if (strncasecmp(url, "http://", 7) != 0)
+        return -1;
+    host = url + 7;
+    slash = strchr(host, '/');
+    len = slash ? (size_t)(slash - host) : strlen(host);
+    if (len == 0 || len >= sizeof(t->host))
+        return -1;
+    strncpy(t->host, host, len);
+    t->host[len] = '\0';
+    if ((colon = strchr(t->host, ':')) != NULL) {
+        *colon = '\0';
+        snprintf(t->port, sizeof(t->port), "%s", colon + 1);
+    } else
+        strcpy(t->port, "80");
+    snprintf(t->path, sizeof(t->path), "%s", slash ? slash : "/");
+    snprintf(t->url, sizeof(t->url), "%s", url);
+    if ((p = strchr(t->url, ' ')) != NULL)
+        *p = '\0';
+    return 0;
+}
+
+static void add_target(char *arg)
+{
+    char *at = strrchr(arg, '@');
+    int weight = 1;
+
+    if (ntargets == MAX_TARGETS)
+        app_error("too many targets");
+    if (at) {
+        *at = '\0';
+        weight = atoi(at + 1);
+    }
+    if (parse_url(arg, &targets[ntargets]) < 0 || weight <= 0) {
+        fprintf(stderr, "bad target: %s\n", arg);
+        exit(1);
+    }
+    targets[ntargets++].weight = weight;
+    target_weight += weight;
+}
+
+static void parse_sizes(char *arg)
+{
+    char *tok, *save = NULL;
+
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(tok, ':');
+        if (nsizes == MAX_SIZES)
+            app_error("too many size classes");
+        sizes[nsizes].size = atol(tok);
+        sizes[nsizes].weight = colon ? atoi(colon + 1) : 1;
+        if (sizes[nsizes].size < 0 || sizes[nsizes].weight <= 0) {
+            fprintf(stderr, "bad size class: %s\n", tok);
+            exit(1);
+        }
+        size_weight += sizes[nsizes++].weight;
+    }
+}
+
+/*
+ * pick - weighted random choice of target and object size
+ */
+static struct target *pick(struct worker *w, long *size)
+{
+    int i, r;
+
+    r = rand_r(&w->seed) % target_weight;
+    for (i = 0; r >= targets[i].weight; i++)
+        r -= targets[i].weight;
+    *size = 0;
+    if (nsizes) {
+        int j, s = rand_r(&w->seed) % size_weight;
+        for (j = 0; s >= sizes[j].weight; j++)
+            s -= sizes[j].weight;
+        *size = sizes[j].size;
+    }
+    return &targets[i];
+}
+
+/*
+ * expand - copy src to dst replacing {size} with size
+ */
+static void expand(char *dst, size_t len, const char *src, long size)
+{
+    const char *p = strstr(src, "{size}");
+
+    if (p == NULL)
+        snprintf(dst, len, "%s", src);
+    else
+        snprintf(dst, len, "%.*s%ld%s", (int)(p - src), src, size, p + 6);
+}
+
+/*
+ * has_word - case-insensitive substring test for header values
+ */
+static int has_word(const char *s, const char *word)
+{
+    size_t n = strlen(word);
+
+    for (; *s; s++)
+        if (strncasecmp(s, word, n) == 0)
+            return 1;
+    return 0;
+}
+
+static int connect_target(struct target *t)
+{
+    if (use_proxy)
+        return open_clientfd(proxy_host, proxy_port);
+    return open_clientfd(t->host, t->port);
+}
+
+/*
+ * read_response - consume one HTTP response from rp. Returns the body
+ * length, or -1 on error. *reuse is cleared when the connection cannot
+ * carry another request.
+ */
+static long read_response(rio_t *rp, int *reuse)
+{
+    char line[MAXLINE], buf[MAXBUF];
+    long clen = -1, body = 0;
+    int chunked = 0, http11 = 0;
+    ssize_t n;
+
+    if (rio_readlineb(rp, line, MAXLINE) <= 0)
+        return -1;
+    if (strncmp(line, "HTTP/", 5) != 0)
+        return -1;
+    http11 = strncmp(line, "HTTP/1.1", 8) == 0;
+    if (!http11)
+        *reuse = 0;
+
+    while (1) {
+        if (rio_readlineb(rp, line, MAXLINE) <= 0)
+            return -1;
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+            break;
+        if (!strncasecmp(line, "Content-Length:", 15))
+            clen = atol(line + 15);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18) &&
+                 has_word(line + 18, "chunked"))
+            chunked = 1;
+        else if (!strncasecmp(line, "Connection:", 11)) {
+            if (has_word(line + 11, "close"))
+                *reuse = 0;
+            else if (has_word(line + 11, "keep-alive"))
+                *reuse = 1;
+        }
+    }
+
+    if (chunked) {
+        while (1) {
+            long csize;
+            if (rio_readlineb(rp, line, MAXLINE) <= 0)
+                return -1;
+            csize = strtol(line, NULL, 16);
+            if (csize == 0)
+                break;
+            while (csize > 0) {
+                n = rio_readnb(rp, buf, csize < MAXBUF ? csize : MAXBUF);
+                if (n <= 0)
+                    return -1;
+                csize -= n;
+                body += n;
+            }
+            if (rio_readlineb(rp, line, MAXLINE) <= 0) /* CRLF */
+                return -1;
+        }
+        /* Trailers up to the blank line */
+        do {
+            if (rio_readlineb(rp, line, MAXLINE) <= 0)
+                return -1;
+        } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    } else if (clen >= 0) {
+        while (body < clen) {
+            long want = clen - body;
+            n = rio_readnb(rp, buf, want < MAXBUF ? want : MAXBUF);
+            if (n <= 0)
+                return -1;
+            body += n;
+        }
+    } else {
+        while ((n = rio_readnb(rp, buf, MAXBUF)) > 0)
+            body += n;
+        if (n < 0)
+            return -1;
+        *reuse = 0;
+    }
+    return body;
+}
+
+static void record(struct worker *w, uint64_t lat)
+{
+    if (w->nlat == w->caplat) {
+        w->caplat = w->caplat ? w->caplat * 2 : 4096;
+        w->lat = Realloc(w->lat, w->caplat * sizeof(uint64_t));
+    }
+    w->lat[w->nlat++] = lat;
+}
+
+/*
+ * next_arrival - the time this worker's next request is due, or 0 when
+ * the run is over
+ */
+static uint64_t next_arrival(void)
+{
+    uint64_t t;
+
+    if (stop)
+        return 0;
+    if (max_requests && __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED) >= max_requests)
+        return 0;
+    if (rate > 0) {
+        uint64_t i = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+        t = start_ns + (uint64_t)(i * (1e9 / rate));
+        if (t >= end_ns)
+            return 0;
+        sleep_until(t);
+        return t;
+    }
+    t = now_ns();
+    return t < end_ns ? t : 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct target *t;
+    char target[MAXLINE], req[2 * MAXBUF];
+    uint64_t sched;
+    int fd = -1, reuse = 0;
+    long size, body;
+    rio_t rio;
+
+    while ((sched = next_arrival()) != 0) {
+        t = pick(w, &size);
+        expand(target, sizeof(target), use_proxy ? t->url : t->path, size);
+        /* A request too long to send whole counts as an error */
+        if (snprintf(req, sizeof(req), "GET %s HTTP/%s\r\nHost: %s:%s\r\n"
+                     "User-Agent: loadgen\r\n%s\r\n",
+                     target, keepalive ? "1.1" : "1.0", t->host, t->port,
+                     keepalive ? "" : "Connection: close\r\n") >=
+            (int)sizeof(req)) {
+            w->errors++;
+            continue;
+        }
+
+        if (fd < 0) {
+            if ((fd = connect_target(t)) < 0) {
+                w->errors++;
+                continue;
+            }
+            w->connects++;
+            rio_readinitb(&rio, fd);
+        }
+        reuse = keepalive;
+        if (rio_writen(fd, req, strlen(req)) < 0 ||
+            (body = read_response(&rio, &reuse)) < 0) {
+            w->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        record(w, now_ns() - sched);
+        w->bytes += body;
+        if (!reuse) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct(uint64_t *v, size_t n, double q)
+{
+    size_t i;
+
+    if (n == 0)
+        return 0;
+    i = (size_t)(q * n);
+    if (i >= n)
+        i = n - 1;
+    return v[i] / 1000.0;
+}
+
+static void report(struct worker *ws, double elapsed)
+{
+    uint64_t *all, bytes = 0, errors = 0, connects = 0, sum = 0;
+    size_t n = 0, i, j;
+    double mean;
+
+    for (i = 0; i < (size_t)nconns; i++)
+        n += ws[i].nlat;
+    all = Malloc((n ? n : 1) * sizeof(uint64_t));
+    for (i = 0, n = 0; i < (size_t)nconns; i++) {
+        for (j = 0; j < ws[i].nlat; j++) {
+            all[n++] = ws[i].lat[j];
+            sum += ws[i].lat[j];
+        }
+        bytes += ws[i].bytes;
+        errors += ws[i].errors;
+        connects += ws[i].connects;
+    }
+    qsort(all, n, sizeof(uint64_t), cmp_u64);
+    mean = n ? sum / 1000.0 / n : 0;
+
+    if (json) {
+        printf("{\"mode\":\"%s\",\"connections\":%d,\"rate\":%.1f,"
+               "\"keepalive\":%s,\"duration_s\":%.3f,\"requests\":%zu,"
+               "\"errors\":%lu,\"connects\":%lu,\"bytes\":%lu,"
+               "\"rps\":%.1f,\"mbps\":%.2f,\"latency_us\":{\"mean\":%.1f,"
+               "\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,"
+               "\"max\":%.1f}}\n",
+               rate > 0 ? "open" : "closed", nconns, rate,
+               keepalive ? "true" : "false", elapsed, n,
+               (unsigned long)errors, (unsigned long)connects,
+               (unsigned long)bytes, n / elapsed,
+               bytes * 8 / elapsed / 1e6, mean,
+               pct(all, n, 0.50), pct(all, n, 0.90), pct(all, n, 0.99),
+               pct(all, n, 0.999), n ? all[n - 1] / 1000.0 : 0);
+    } else {
+        printf("mode:        %s loop, %d connections%s\n",
+               rate > 0 ? "open" : "closed", nconns,
+               keepalive ? ", keep-alive" : "");
+        if (rate > 0)
+            printf("target rate: %.1f req/s\n", rate);
+        printf("duration:    %.3f s\n", elapsed);
+        printf("requests:    %zu (%lu errors, %lu connects)\n", n,
+               (unsigned long)errors, (unsigned long)connects);
+        printf("throughput:  %.1f req/s, %.2f Mbit/s\n", n / elapsed,
+               bytes * 8 / elapsed / 1e6);
+        printf("latency us:  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+               "p999 %.1f  max %.1f\n", mean,
+               pct(all, n, 0.50), pct(all, n, 0.90), pct(all, n, 0.99),
+               pct(all, n, 0.999), n ? all[n - 1] / 1000.0 : 0);
+    }
+    Free(all);
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *ws;
+    int c, i;
+    char *colon;
+
+    while ((c = getopt(argc, argv, "u:x:c:r:d:n:z:kjh")) != -1) {
+        switch (c) {
+        case 'u': add_target(optarg); break;
+        case 'x':
+            if ((colon = strrchr(optarg, ':')) == NULL)
+                usage(argv[0]);
+            *colon = '\0';
+            snprintf(proxy_host, sizeof(proxy_host), "%s", optarg);
+            snprintf(proxy_port, sizeof(proxy_port), "%s", colon + 1);
+            use_proxy = 1;
+            break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'n': max_requests = atol(optarg); break;
+        case 'z': parse_sizes(optarg); break;
+        case 'k': keepalive = 1; break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (ntargets == 0 || nconns <= 0 || duration <= 0)
+        usage(argv[0]);
+    Signal(SIGPIPE, SIG_IGN);
+
+    ws = Calloc(nconns, sizeof(struct worker));
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)(duration * 1e9);
+    for (i = 0; i < nconns; i++) {
+        ws[i].seed = (unsigned)(start_ns >> 10) + i * 7919;
+        Pthread_create(&ws[i].tid, NULL, worker_main, &ws[i]);
+    }
+    for (i = 0; i < nconns; i++)
+        Pthread_join(ws[i].tid, NULL);
+
+    report(ws, (now_ns() - start_ns) / 1e9);
+    for (i = 0; i < nconns; i++)
+        free(ws[i].lat);
+    Free(ws);
+    return 0;
+}
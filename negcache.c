@@ -0,0 +1,284 @@
+/*
+ * negcache.c - Negative caching and circuit breaking for upstream servers
+ *
+ * Failures are remembered per upstream host:port for a short TTL so a
+ * broken server is not hit again by every client that retries: a
+ * failed DNS lookup or connect fails fast at once, and error responses
+ * (5xx, or no response at all) open the circuit after max_failures in
+ * a row. While the circuit is open requests get a synthesized 502/503
+ * without touching the network. When the TTL runs out one request is
+ * let through as a probe; if it succeeds the circuit closes, if not it
+ * stays open for another TTL. A probe that never reports back simply
+ * lets the next one through a TTL later.
+ *
+ * Error responses that HTTP allows to be cached by default (404, 410,
+ * ...) are stored in the response cache for the same TTL, unless the
+ * origin gave a max-age of its own; see neg_cacheable().
+ *
+ * Upstreams are kept in a fixed table of NEG_SLOTS slots, found by the
+ * hash of their "host:port" name within NEG_PROBE slots of its home. A
+ * slot whose circuit is not open, or is past its TTL, is taken over by
+ * the next new upstream that needs one, and failing those the open
+ * circuit nearest its end, so a client naming ever more upstreams
+ * cannot fill the table and turn the breaker off. Checks of a known
+ * upstream take no locks; taking a slot, and recording a failure or
+ * the recovery that clears one, take the table's lock. The id handed
+ * to neg_done() carries the slot's generation, so the outcome of a
+ * request whose slot was taken over in between is dropped.
+ */
+#include "csapp.h"
+#include "cachekey.h"
+#include "negcache.h"
+
+#define NEG_SLOT_BITS 10
+#define NEG_SLOTS (1 << NEG_SLOT_BITS)
+#define NEG_PROBE 8                 /* Slots searched from an upstream's home */
+#define NEG_GEN_MASK ((1 << 20) - 1)
+#define NEG_NAME 96                 /* Bytes of the name kept for the report */
+
+struct upstream {
+    uint64_t hash;              /* key_hash() of "host:port", 0 = free */
+    unsigned gen;               /* Bumped when the slot changes hands */
+    int fails;                  /* Failures in a row */
+    int why;                    /* Kind of the last failure */
+    time_t open_until;          /* Failing fast until then, 0 = closed */
+    unsigned long rejected;
+    char name[NEG_NAME];        /* "host:port", maybe cut short */
+};
+
+static int ttl = 5;             /* 0 = off */
+static int max_fails = 5;
+static struct upstream ups[NEG_SLOTS];
+static pthread_mutex_t ups_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long failures[NNEG], rejected = 0;
+
+static const char *neg_names[NNEG] = {"ok", "dns", "connect", "error"};
+
+void neg_init(int ttl_secs, int max_failures)
+{
+    ttl = ttl_secs > 0 ? ttl_secs : 0;
+    max_fails = max_failures > 0 ? max_failures : 1;
+}
+
+int neg_ttl(void)
+{
+    return ttl;
+}
+
+/*
+ * neg_cacheable - may a response with this status be cached for the
+ * negative TTL? (The statuses HTTP lets caches keep by default.)
+ */
+int neg_cacheable(int status)
+{
+    return ttl > 0 && (status == 404 || status == 405 || status == 410 ||
+                       status == 414 || status == 501);
+}
+
+/*
+ * neg_result - what a response status (0 = none) says about its server
+ */
+int neg_result(int status)
+{
+    return status == 0 || (status >= 500 && status != 501) ? NEG_ERROR : NEG_NONE;
+}
+
+/*
+ * find - the slot of the upstream with hash h, or -1. Sets *gen to the
+ * slot's generation as it was before the match.
+ */
+static int find(uint64_t h, unsigned *gen)
+{
+    int i, s;
+
+    for (i = 0; i < NEG_PROBE; i++) {
+        s = (h + i) & (NEG_SLOTS - 1);
+        *gen = __atomic_load_n(&ups[s].gen, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ups[s].hash, __ATOMIC_ACQUIRE) == h)
+            return s;
+    }
+    return -1;
+}
+
+/*
+ * claim - give the upstream with hash h a slot: a free one, else one
+ * whose circuit is closed (clean ones first), else one past its TTL,
+ * else the open one that closes soonest. Returns the slot.
+ */
+static int claim(uint64_t h, const char *name, unsigned *gen, time_t now)
+{
+    int i, s, best = h & (NEG_SLOTS - 1), rank, best_rank = 5;
+    struct upstream *u;
+
+    pthread_mutex_lock(&ups_lock);
+    if ((s = find(h, gen)) >= 0) {          /* Another thread was first */
+        pthread_mutex_unlock(&ups_lock);
+        return s;
+    }
+    for (i = 0; i < NEG_PROBE && best_rank > 0; i++) {
+        u = &ups[(h + i) & (NEG_SLOTS - 1)];
+        if (u->hash == 0)
+            rank = 0;
+        else if (u->open_until == 0)
+            rank = u->fails ? 2 : 1;
+        else if (u->open_until <= now)
+            rank = 3;
+        else
+            rank = 4;
+        if (rank < best_rank ||
+            (rank == 4 && best_rank == 4 &&
+             u->open_until < ups[best].open_until)) {
+            best = (h + i) & (NEG_SLOTS - 1);
+            best_rank = rank;
+        }
+    }
+    u = &ups[best];
+    __atomic_store_n(&u->hash, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&u->gen, (u->gen + 1) & NEG_GEN_MASK, __ATOMIC_RELEASE);
+    __atomic_store_n(&u->fails, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&u->why, NEG_NONE, __ATOMIC_RELAXED);
+    __atomic_store_n(&u->open_until, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&u->rejected, 0, __ATOMIC_RELAXED);
+    snprintf(u->name, sizeof(u->name), "%s", name);
+    *gen = u->gen;
+    __atomic_store_n(&u->hash, h, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ups_lock);
+    return best;
+}
+
+/*
+ * neg_check - may a request go to host:port now? Returns NEG_NONE and
+ * sets *id for neg_done(), or the kind of failure it is refused for.
+ */
+int neg_check(const char *host, const char *port, int *id)
+{
+    char name[MAXLINE];
+    struct upstream *u;
+    time_t until, now;
+    unsigned gen;
+    uint64_t h;
+    int i, n, s;
+
+    *id = -1;
+    if (ttl == 0)
+        return NEG_NONE;
+    n = snprintf(name, sizeof(name), "%s:%s", host, port);
+    if (n >= (int)sizeof(name))
+        return NEG_NONE;
+    for (i = 0; i < n; i++)
+        name[i] = tolower((unsigned char)name[i]);
+    if ((h = key_hash(name, n)) == 0)
+        h = 1;
+    now = time(NULL);
+    if ((s = find(h, &gen)) < 0)
+        s = claim(h, name, &gen, now);
+
+    u = &ups[s];
+    *id = (int)(gen << NEG_SLOT_BITS) | s;
+    if ((until = __atomic_load_n(&u->open_until, __ATOMIC_RELAXED)) == 0)
+        return NEG_NONE;
+    /* Past the TTL: whoever moves the deadline on is the probe */
+    if (now >= until &&
+        __atomic_compare_exchange_n(&u->open_until, &until, now + ttl, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return NEG_NONE;
+    if (__atomic_load_n(&u->gen, __ATOMIC_ACQUIRE) != gen)
+        return NEG_NONE;            /* Taken over meanwhile: not ours */
+    __atomic_fetch_add(&u->rejected, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rejected, 1, __ATOMIC_RELAXED);
+    *id = -1;
+    return __atomic_load_n(&u->why, __ATOMIC_RELAXED);
+}
+
+/*
+ * neg_done - record how a request admitted by neg_check() went. Only
+ * a change of state takes the lock, and only if the slot is still the
+ * one the request was admitted under.
+ */
+void neg_done(int id, int result)
+{
+    struct upstream *u;
+    int n;
+
+    if (id < 0)
+        return;
+    u = &ups[id & (NEG_SLOTS - 1)];
+    if (result == NEG_NONE && !__atomic_load_n(&u->fails, __ATOMIC_RELAXED) &&
+        !__atomic_load_n(&u->open_until, __ATOMIC_RELAXED))
+        return;                     /* Nothing to clear */
+    pthread_mutex_lock(&ups_lock);
+    if (u->gen != (unsigned)id >> NEG_SLOT_BITS)
+        ;                           /* Taken over since: not ours */
+    else if (result == NEG_NONE) {
+        __atomic_store_n(&u->fails, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&u->open_until, 0, __ATOMIC_RELAXED);
+    } else {
+        n = __atomic_add_fetch(&u->fails, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&failures[result], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&u->why, result, __ATOMIC_RELAXED);
+        if (result != NEG_ERROR || n >= max_fails)
+            __atomic_store_n(&u->open_until, time(NULL) + ttl, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ups_lock);
+}
+
+/*
+ * neg_reject - answer a request refused by neg_check(); the caller
+ * closes fd
+ */
+void neg_reject(int fd, int why)
+{
+    char buf[MAXLINE];
+    const char *status, *msg;
+    int n;
+
+    if (why == NEG_DNS) {
+        status = "502 Bad Gateway";
+        msg = "Upstream host not found\n";
+    } else if (why == NEG_CONNECT) {
+        status = "502 Bad Gateway";
+        msg = "Upstream refused the connection\n";
+    } else {
+        status = "503 Service Unavailable";
+        msg = "Upstream server is failing\n";
+    }
+    n = snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\n"
+                 "Retry-After: %d\r\n"
+                 "Content-Type: text/plain\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n%s",
+                 status, ttl, strlen(msg), msg);
+    send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * neg_report - render the failure counters and open circuits as text
+ */
+int neg_report(char *buf, size_t len)
+{
+    time_t now = time(NULL), until;
+    int i, n;
+
+    if (ttl == 0)
+        return 0;
+    n = snprintf(buf, len, "negative  ttl=%ds threshold=%d rejected=%lu",
+                 ttl, max_fails, rejected);
+    for (i = NEG_DNS; i < NNEG && (size_t)n < len; i++)
+        n += snprintf(buf + n, len - n, " %s=%lu", neg_names[i], failures[i]);
+    if ((size_t)n < len)
+        n += snprintf(buf + n, len - n, "\n");
+    pthread_mutex_lock(&ups_lock);          /* Names hold still */
+    for (i = 0; i < NEG_SLOTS && (size_t)n < len; i++) {
+        if (ups[i].hash == 0 || (until = ups[i].open_until) == 0)
+            continue;
+        if (until > now)
+            n += snprintf(buf + n, len - n, "  open    %s %s %lds rejected=%lu\n",
+                          ups[i].name, neg_names[ups[i].why],
+                          (long)(until - now), ups[i].rejected);
+        else                    /* The next request probes it */
+            n += snprintf(buf + n, len - n, "  probe   %s %s rejected=%lu\n",
+                          ups[i].name, neg_names[ups[i].why], ups[i].rejected);
+    }
+    pthread_mutex_unlock(&ups_lock);
+    return n;
+}
@@ -0,0 +1,21 @@
+/*
+ * negcache.h - Negative caching and circuit breaking for upstream servers
+ */
+#ifndef __NEGCACHE_H__
+#define __NEGCACHE_H__
+
+#include <stddef.h>
+
+/* How a request to an upstream went, and why one is being refused */
+enum { NEG_NONE, NEG_DNS, NEG_CONNECT, NEG_ERROR, NNEG };
+
+void neg_init(int ttl_secs, int max_failures);
+int neg_ttl(void);
+int neg_cacheable(int status);
+int neg_result(int status);
+int neg_check(const char *host, const char *port, int *id);
+void neg_done(int id, int result);
+void neg_reject(int fd, int why);
+int neg_report(char *buf, size_t len);
+
+#endif /* __NEGCACHE_H__ */
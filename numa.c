@@ -0,0 +1,172 @@
+/*
+ * numa.c - NUMA topology, thread placement and node-local memory
+ *
+ * On a multi-socket machine a thread that runs on one node and touches
+ * memory of another pays for every access across the interconnect. In
+ * NUMA mode the proxy reads the node layout from sysfs once, moves the
+ * pool worker that takes a connection to the node whose CPU took the
+ * connection's packets (SO_INCOMING_CPU), and gives every node its own
+ * cache shard in memory preferred on that node. Workers are shared by
+ * all nodes, so a worker's stack stays where it was first touched;
+ * only the cache, and what a worker allocates after a move, is local.
+ *
+ * This uses the raw syscalls (sched_setaffinity, getcpu, mbind) rather
+ * than libnuma. Without numa_init() everything runs as a single node.
+ */
+#include "csapp.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "numa.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#define MPOL_PREFERRED 1
+
+#define MASK_WORDS (NUMA_MAX_CPUS / (8 * sizeof(unsigned long)))
+
+static int nnodes = 1;
+static int cpu_node[NUMA_MAX_CPUS];                    /* -1 = offline */
+static unsigned long node_cpus[NUMA_MAX_NODES][MASK_WORDS];
+static unsigned long rebinds[NUMA_MAX_NODES], steered = 0, unknown = 0;
+static __thread int my_node = -1;
+
+/*
+ * parse_cpulist - mark the CPUs of a sysfs list such as "0-3,8-11"
+ */
+static void parse_cpulist(const char *s, int node)
+{
+    char *end;
+    long lo, hi;
+
+    while (*s && *s != '\n') {
+        lo = hi = strtol(s, &end, 10);
+        if (end == s)
+            return;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (; lo <= hi && lo < NUMA_MAX_CPUS; lo++) {
+            cpu_node[lo] = node;
+            node_cpus[node][lo / (8 * sizeof(unsigned long))] |=
+                1UL << (lo % (8 * sizeof(unsigned long)));
+        }
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+/*
+ * numa_init - read the node layout. Returns the number of nodes with
+ * CPUs (1 on machines without NUMA).
+ */
+int numa_init(void)
+{
+    char path[64], buf[MAXLINE];
+    FILE *f;
+    int node, n = 0;
+
+    memset(cpu_node, -1, sizeof(cpu_node));
+    for (node = 0; node < NUMA_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        if ((f = fopen(path, "r")) == NULL)
+            break;
+        if (fgets(buf, sizeof(buf), f) && buf[0] != '\n') {
+            parse_cpulist(buf, node);
+            n = node + 1;
+        }
+        fclose(f);
+    }
+    nnodes = n > 0 ? n : 1;
+    return nnodes;
+}
+
+int numa_nodes(void)
+{
+    return nnodes;
+}
+
+/*
+ * numa_node - the node the calling thread runs on: the one it is
+ * bound to, or where it first asked
+ */
+int numa_node(void)
+{
+    unsigned cpu, node;
+
+    if (my_node < 0) {
+        if (nnodes == 1 || syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+            node = 0;
+        my_node = node < (unsigned)nnodes ? node : 0;
+    }
+    return my_node;
+}
+
+/*
+ * numa_bind_thread - keep the calling thread on the CPUs of node.
+ * Each move of a thread to another node counts as a rebind.
+ */
+int numa_bind_thread(int node)
+{
+    if (node < 0 || node >= nnodes)
+        return -1;
+    my_node = node;
+    if (nnodes == 1)
+        return 0;
+    __atomic_fetch_add(&rebinds[node], 1, __ATOMIC_RELAXED);
+    return syscall(SYS_sched_setaffinity, 0, sizeof(node_cpus[node]),
+                   node_cpus[node]) < 0 ? -1 : 0;
+}
+
+/*
+ * numa_socket_node - the node of the CPU that received fd's packets,
+ * or -1 if the kernel does not say
+ */
+int numa_socket_node(int fd)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 ||
+        cpu < 0 || cpu >= NUMA_MAX_CPUS || cpu_node[cpu] < 0) {
+        __atomic_fetch_add(&unknown, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_fetch_add(&steered, 1, __ATOMIC_RELAXED);
+    return cpu_node[cpu];
+}
+
+/*
+ * numa_alloc - len bytes of zeroed memory, placed on node where the
+ * kernel can (pages are only allocated when first touched). NULL on
+ * failure.
+ */
+void *numa_alloc(size_t len, int node)
+{
+    unsigned long mask = 1UL << node;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+    if (nnodes > 1)
+        syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, NUMA_MAX_NODES + 1, 0);
+    return p;
+}
+
+/*
+ * numa_report - render the placement counters as text into buf
+ */
+int numa_report(char *buf, size_t len)
+{
+    int i, n;
+
+    if (nnodes == 1)
+        return 0;
+    n = snprintf(buf, len, "numa      nodes=%d steered=%lu unknown=%lu rebinds",
+                 nnodes, steered, unknown);
+    for (i = 0; i < nnodes && (size_t)n < len; i++)
+        n += snprintf(buf + n, len - n, " %d:%lu", i, rebinds[i]);
+    if ((size_t)n < len)
+        n += snprintf(buf + n, len - n, "\n");
+    return n;
+}
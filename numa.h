@@ -0,0 +1,20 @@
+/*
+ * numa.h - NUMA topology, thread placement and node-local memory
+ */
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stddef.h>
+
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_CPUS 1024
+
+int numa_init(void);
+int numa_nodes(void);
+int numa_node(void);
+int numa_bind_thread(int node);
+int numa_socket_node(int fd);
+void *numa_alloc(size_t len, int node);
+int numa_report(char *buf, size_t len);
+
+#endif /* __NUMA_H__ */
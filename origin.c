@@ -0,0 +1,391 @@
+/*
+ * origin.c - Configurable local origin server for testing the proxy
+ *
+ * A pre-threaded HTTP/1.1 server whose responses are shaped by the
+ * command line defaults and, per request, by query parameters:
+ *
+ *   size=N         body length in bytes (also /bytes/N as the path)
+ *   type=html|bin  text/html (compressible) or application/octet-stream
+ *   latency=DIST   delay before the response: MS, uniform:MIN:MAX or
+ *                  exp:MEAN (all in milliseconds)
+ *   chunked=1      Transfer-Encoding: chunked instead of Content-Length
+ *   maxage=N       Cache-Control: max-age=N (nostore=1 for no-store)
+ *   etag=1         ETag header; a matching If-None-Match gets a 304
+ *   drip=B:MS      write the body B bytes at a time, MS ms apart
+ *   reset=P        reset the connection (RST) mid-body with probability P
+ *   status=N       response status code
+ *   stall=1        accept the request and never answer, like nop-server.py
+ *                  (the connection is closed when the client gives up,
+ *                  or after STALL_SECS)
+ *
+ * e.g.  curl 'http://localhost:8000/a.html?size=20000&type=html&maxage=60'
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+
+#define BODY_BLOCK 65536  /* Size of the pre-generated body patterns */
+#define STALL_SECS 300    /* Longest a stalled request holds its worker */
+
+struct latency {
+    char kind;            /* 'f'ixed, 'u'niform or 'e'xponential */
+    double a, b;          /* ms: fixed value, min/max or mean */
+};
+
+struct response {
+    long size;
+    int html;
+    struct latency lat;
+    int chunked;
+    long maxage;          /* -1 = no Cache-Control */
+    int nostore;
+    int etag;
+    long drip_bytes;
+    long drip_ms;
+    double reset;
+    int status;
+    int stall;
+};
+
+static struct response defaults = {
+    1024, 0, {'f', 0, 0}, 0, -1, 0, 0, 0, 0, 0.0, 200, 0
+};
+static char html_body[BODY_BLOCK], bin_body[BODY_BLOCK];
+static int keepalive = 1;
+
+static void usage(char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] <port>\n"
+            "  -t N          worker threads (default 16)\n"
+            "  -s N          default body size (default 1024)\n"
+            "  -T html|bin   default content type (default bin)\n"
+            "  -l DIST       default latency: MS, uniform:MIN:MAX, exp:MEAN\n"
+            "  -C            chunked framing by default\n"
+            "  -m N          default Cache-Control max-age\n"
+            "  -e            send ETags by default\n"
+            "  -d B:MS       slow-drip bodies by default\n"
+            "  -r P          default reset probability\n"
+            "  -K            close after every response (no keep-alive)\n"
+            "Per request, the same settings can be given as query "
+            "parameters\n(size, type, latency, chunked, maxage, nostore, "
+            "etag, drip, reset, status, stall).\n", prog);
+    exit(1);
+}
+
+static int parse_latency(const char *s, struct latency *l)
+{
+    if (!strncmp(s, "uniform:", 8)) {
+        l->kind = 'u';
+        return sscanf(s + 8, "%lf:%lf", &l->a, &l->b) == 2 ? 0 : -1;
+    }
+    if (!strncmp(s, "exp:", 4)) {
+        l->kind = 'e';
+        return sscanf(s + 4, "%lf", &l->a) == 1 ? 0 : -1;
+    }
+    l->kind = 'f';
+    return sscanf(s, "%lf", &l->a) == 1 ? 0 : -1;
+}
+
+static double sample_latency(struct latency *l, unsigned *seed)
+{
+    double u = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+
+    switch (l->kind) {
+    case 'u': return l->a + u * (l->b - l->a);
+    case 'e': return -l->a * log(u);
+    default:  return l->a;
+    }
+}
+
+static void sleep_ms(double ms)
+{
+    struct timespec ts;
+
+    if (ms <= 0)
+        return;
+    ts.tv_sec = (time_t)(ms / 1000);
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1e6);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * apply_param - set one key=value pair on r
+ */
+static void apply_param(struct response *r, char *key, char *val)
+{
+    if (!strcmp(key, "size"))
+        r->size = atol(val);
+    else if (!strcmp(key, "type"))
+        r->html = !strcmp(val, "html");
+    else if (!strcmp(key, "latency"))
+        parse_latency(val, &r->lat);
+    else if (!strcmp(key, "chunked"))
+        r->chunked = atoi(val);
+    else if (!strcmp(key, "maxage"))
+        r->maxage = atol(val);
+    else if (!strcmp(key, "nostore"))
+        r->nostore = atoi(val);
+    else if (!strcmp(key, "etag"))
+        r->etag = atoi(val);
+    else if (!strcmp(key, "drip"))
+        sscanf(val, "%ld:%ld", &r->drip_bytes, &r->drip_ms);
+    else if (!strcmp(key, "reset"))
+        r->reset = atof(val);
+    else if (!strcmp(key, "status"))
+        r->status = atoi(val);
+    else if (!strcmp(key, "stall"))
+        r->stall = atoi(val);
+}
+
+/*
+ * parse_target - derive the response shape from the request target
+ */
+static void parse_target(char *target, struct response *r)
+{
+    char *query, *tok, *save = NULL;
+
+    *r = defaults;
+    if (!strncmp(target, "/bytes/", 7))
+        r->size = atol(target + 7);
+    if ((query = strchr(target, '?')) == NULL)
+        return;
+    *query++ = '\0';
+    for (tok = strtok_r(query, "&", &save); tok; tok = strtok_r(NULL, "&", &save)) {
+        char *eq = strchr(tok, '=');
+        if (eq) {
+            *eq = '\0';
+            apply_param(r, tok, eq + 1);
+        } else
+            apply_param(r, tok, "1");
+    }
+    if (r->size < 0)
+        r->size = 0;
+}
+
+static const char *reason(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default:  return "Status";
+    }
+}
+
+/*
+ * reset_conn - abort the connection with a TCP RST
+ */
+static void reset_conn(int fd)
+{
+    struct linger lg = {1, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+/*
+ * send_body - write size bytes of the pattern, honoring chunking, drip
+ * and reset. Returns -1 on a write error and -2 if the connection was
+ * reset (and its descriptor closed).
+ */
+static int send_body(int fd, struct response *r, unsigned *seed)
+{
+    char *pattern = r->html ? html_body : bin_body;
+    long left = r->size, reset_at = -1, sent = 0;
+    long step = r->drip_bytes > 0 ? r->drip_bytes : BODY_BLOCK;
+    char hdr[32];
+
+    if (r->reset > 0 && rand_r(seed) < r->reset * ((double)RAND_MAX + 1.0))
+        reset_at = r->size / 2;
+
+    while (left > 0) {
+        long n = left < step ? left : step;
+        if (n > BODY_BLOCK)
+            n = BODY_BLOCK;
+        if (reset_at >= 0 && sent + n > reset_at) {
+            rio_writen(fd, pattern, reset_at - sent);
+            reset_conn(fd);
+            return -2;
+        }
+        if (r->chunked) {
+            sprintf(hdr, "%lx\r\n", n);
+            if (rio_writen(fd, hdr, strlen(hdr)) < 0)
+                return -1;
+        }
+        if (rio_writen(fd, pattern, n) < 0)
+            return -1;
+        if (r->chunked && rio_writen(fd, "\r\n", 2) < 0)
+            return -1;
+        sent += n;
+        left -= n;
+        if (r->drip_bytes > 0 && left > 0)
+            sleep_ms(r->drip_ms);
+    }
+    if (r->chunked && rio_writen(fd, "0\r\n\r\n", 5) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * stall - hold fd without answering until the client closes it, or
+ * for STALL_SECS; whatever else it sends is read and dropped
+ */
+static void stall(int fd)
+{
+    struct pollfd p = {fd, POLLIN, 0};
+    time_t end = time(NULL) + STALL_SECS, left;
+    char buf[MAXLINE];
+
+    while ((left = end - time(NULL)) > 0 && poll(&p, 1, left * 1000) > 0 &&
+           read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/*
+ * serve - answer requests on fd until the client goes away. Returns -1
+ * if the descriptor has already been closed.
+ */
+static int serve(int fd, unsigned *seed)
+{
+    char line[MAXLINE], method[MAXLINE], target[MAXLINE], version[MAXLINE];
+    char hdr[MAXBUF], inm[MAXLINE], etag[64];
+    struct response r;
+    rio_t rio;
+    int http11, conn_close, head, rc;
+
+    rio_readinitb(&rio, fd);
+    while (1) {
+        if (rio_readlineb(&rio, line, MAXLINE) <= 0)
+            return 0;
+        if (sscanf(line, "%s %s %s", method, target, version) != 3)
+            return 0;
+        http11 = !strcmp(version, "HTTP/1.1");
+        conn_close = !http11 || !keepalive;
+        head = !strcasecmp(method, "HEAD");
+        inm[0] = '\0';
+        while (rio_readlineb(&rio, line, MAXLINE) > 0 && strcmp(line, "\r\n")) {
+            if (!strncasecmp(line, "Connection:", 11)) {
+                if (strstr(line + 11, "close"))
+                    conn_close = 1;
+                else if (strstr(line + 11, "eep-alive") && keepalive)
+                    conn_close = 0;
+            } else if (!strncasecmp(line, "If-None-Match:", 14))
+                sscanf(line + 14, " %s", inm);
+        }
+
+        parse_target(target, &r);
+        if (r.stall) {
+            stall(fd);
+            return 0;
+        }
+        sleep_ms(sample_latency(&r.lat, seed));
+
+        sprintf(etag, "\"%lx-%lx\"", r.size, (unsigned long)r.html);
+        if (r.etag && inm[0] && !strcmp(inm, etag))
+            r.status = 304;
+
+        sprintf(hdr, "HTTP/1.%d %d %s\r\nServer: origin\r\n"
+                "Content-Type: %s\r\n", http11, r.status, reason(r.status),
+                r.html ? "text/html" : "application/octet-stream");
+        if (r.nostore)
+            strcat(hdr, "Cache-Control: no-store\r\n");
+        else if (r.maxage >= 0)
+            sprintf(hdr + strlen(hdr), "Cache-Control: max-age=%ld\r\n", r.maxage);
+        if (r.etag)
+            sprintf(hdr + strlen(hdr), "ETag: %s\r\n", etag);
+        if (r.status == 304)
+            r.size = 0;
+        if (r.chunked && http11 && r.status != 304)
+            strcat(hdr, "Transfer-Encoding: chunked\r\n");
+        else {
+            r.chunked = 0;
+            sprintf(hdr + strlen(hdr), "Content-Length: %ld\r\n", r.size);
+        }
+        strcat(hdr, conn_close ? "Connection: close\r\n\r\n"
+                               : "Connection: keep-alive\r\n\r\n");
+        if (rio_writen(fd, hdr, strlen(hdr)) < 0)
+            return 0;
+        if (!head && r.status != 304 && (rc = send_body(fd, &r, seed)) < 0)
+            return rc == -2 ? -1 : 0;
+        if (conn_close)
+            return 0;
+    }
+}
+
+static void *worker(void *vargp)
+{
+    int listenfd = *(int *)vargp, connfd, one = 1;
+    unsigned seed = (unsigned)(uintptr_t)pthread_self();
+
+    while (1) {
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (serve(connfd, &seed) == 0)
+            close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * init_bodies - build the body patterns: readable HTML for text
+ * responses, pseudo-random bytes for binary ones
+ */
+static void init_bodies(void)
+{
+    static const char *line =
+        "<p>The quick brown fox jumps over the lazy dog. 0123456789</p>\n";
+    size_t i, n = strlen(line);
+    unsigned x = 2463534242u;
+
+    for (i = 0; i < BODY_BLOCK; i++) {
+        html_body[i] = line[i % n];
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        bin_body[i] = (char)x;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static int listenfd;            /* Outlives main's thread */
+    int c, i, nthreads = 16;
+    pthread_t tid;
+
+    while ((c = getopt(argc, argv, "t:s:T:l:Cm:ed:r:K")) != -1) {
+        switch (c) {
+        case 't': nthreads = atoi(optarg); break;
+        case 's': defaults.size = atol(optarg); break;
+        case 'T': defaults.html = !strcmp(optarg, "html"); break;
+        case 'l':
+            if (parse_latency(optarg, &defaults.lat) < 0)
+                usage(argv[0]);
+            break;
+        case 'C': defaults.chunked = 1; break;
+        case 'm': defaults.maxage = atol(optarg); break;
+        case 'e': defaults.etag = 1; break;
+        case 'd':
+            sscanf(optarg, "%ld:%ld", &defaults.drip_bytes, &defaults.drip_ms);
+            break;
+        case 'r': defaults.reset = atof(optarg); break;
+        case 'K': keepalive = 0; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nthreads <= 0)
+        usage(argv[0]);
+
+    Signal(SIGPIPE, SIG_IGN);
+    init_bodies();
+    listenfd = Open_listenfd(argv[optind]);
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, worker, &listenfd);
+    Pthread_exit(NULL);             /* The workers go on serving */
+    return 0;
+}
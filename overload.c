@@ -0,0 +1,172 @@
+/*
+ * overload.c - Connection caps and load shedding for the proxy
+ *
+ * Three limits keep an overloaded proxy answering quickly instead of
+ * slowing down for everyone: a cap on connections being served, a cap
+ * on requests in flight to upstream servers, and CoDel-style shedding
+ * on queue delay (the time from accept() until a thread picks the
+ * connection up). A shed connection gets a canned 503 and is closed.
+ *
+ * The queue rule follows CoDel: a delay above target is tolerated
+ * until it has lasted a whole interval; then one connection is shed,
+ * and the next ones at interval/sqrt(count) spacing for as long as the
+ * delay stays above target.
+ */
+#include "csapp.h"
+#include "overload.h"
+
+static int max_conns = 0;        /* 0 = unlimited */
+static int max_upstream = 0;     /* 0 = unlimited */
+static uint64_t target_ns = 0;   /* 0 = no queue-delay shedding */
+static uint64_t interval_ns = 0;
+
+static int conns = 0, upstream = 0;
+static unsigned long shed[NSHED];
+
+/* CoDel state, under codel_lock */
+static pthread_mutex_t codel_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t first_above = 0; /* When the delay may first count as bad */
+static uint64_t drop_next = 0;
+static unsigned drop_count = 0;
+static int dropping = 0;
+
+/* Sent as is to every shed connection */
+static const char reply_503[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Connection: close\r\n\r\n"
+    "Proxy is overloaded\n";
+
+static const char *shed_names[NSHED] = {"conns", "upstream", "queue"};
+
+void overload_init(int conns_cap, int upstream_cap, int target_ms,
+                   int interval_ms)
+{
+    max_conns = conns_cap;
+    max_upstream = upstream_cap;
+    target_ns = (uint64_t)target_ms * 1000000ULL;
+    interval_ns = (uint64_t)interval_ms * 1000000ULL;
+}
+
+/*
+ * admit - take a slot of counter unless it is already at cap
+ */
+static int admit(int *counter, int cap)
+{
+    int n = __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+
+    if (cap > 0 && n > cap) {
+        __atomic_fetch_sub(counter, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * conn_admit - count a new connection; 0 if it is over the cap
+ */
+int conn_admit(void)
+{
+    return admit(&conns, max_conns);
+}
+
+void conn_done(void)
+{
+    __atomic_fetch_sub(&conns, 1, __ATOMIC_RELAXED);
+}
+
+int conn_active(void)
+{
+    return __atomic_load_n(&conns, __ATOMIC_RELAXED);
+}
+
+/*
+ * upstream_admit - count a request about to go upstream; 0 if it is
+ * over the cap
+ */
+int upstream_admit(void)
+{
+    return admit(&upstream, max_upstream);
+}
+
+void upstream_done(void)
+{
+    __atomic_fetch_sub(&upstream, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t isqrt(uint64_t x)
+{
+    uint64_t r = 0, bit = 1ULL << 62;
+
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else
+            r >>= 1;
+        bit >>= 2;
+    }
+    return r;
+}
+
+/*
+ * queue_admit - a connection was picked up after waiting sojourn_ns;
+ * may it be served? (CoDel's dequeue decision.)
+ */
+int queue_admit(uint64_t sojourn_ns, uint64_t now)
+{
+    int ok = 1;
+
+    if (target_ns == 0)
+        return 1;
+    pthread_mutex_lock(&codel_lock);
+    if (sojourn_ns < target_ns) {
+        first_above = 0;
+        dropping = 0;
+    } else if (first_above == 0)
+        first_above = now + interval_ns;
+    else if (!dropping && now >= first_above) {
+        /* Resume near the old rate if we were dropping recently */
+        dropping = 1;
+        drop_count = (drop_count > 2 && now - drop_next < 16 * interval_ns) ?
+            drop_count - 2 : 1;
+        drop_next = now + interval_ns / isqrt(drop_count);
+        ok = 0;
+    } else if (dropping && now >= drop_next) {
+        drop_count++;
+        drop_next += interval_ns / isqrt(drop_count);
+        ok = 0;
+    }
+    pthread_mutex_unlock(&codel_lock);
+    return ok;
+}
+
+/*
+ * overload_reject - send the canned 503 without blocking and count it;
+ * the caller closes fd
+ */
+void overload_reject(int fd, int why)
+{
+    __atomic_fetch_add(&shed[why], 1, __ATOMIC_RELAXED);
+    send(fd, reply_503, sizeof(reply_503) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * overload_report - render the limits and shed counters as text into buf
+ */
+int overload_report(char *buf, size_t len)
+{
+    int i, n;
+
+    n = snprintf(buf, len, "overload  conns=%d/%d upstream=%d/%d shed",
+                 conns, max_conns, upstream, max_upstream);
+    for (i = 0; i < NSHED && (size_t)n < len; i++)
+        n += snprintf(buf + n, len - n, " %s=%lu", shed_names[i], shed[i]);
+    if ((size_t)n < len)
+        n += snprintf(buf + n, len - n, "\n");
+    return n;
+}
@@ -0,0 +1,24 @@
+/*
+ * overload.h - Connection caps and load shedding for the proxy
+ */
+#ifndef __OVERLOAD_H__
+#define __OVERLOAD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Why a request was shed */
+enum { SHED_CONNS, SHED_UPSTREAM, SHED_QUEUE, NSHED };
+
+void overload_init(int max_conns, int max_upstream, int target_ms,
+                   int interval_ms);
+int conn_admit(void);
+void conn_done(void);
+int conn_active(void);
+int upstream_admit(void);
+void upstream_done(void);
+int queue_admit(uint64_t sojourn_ns, uint64_t now);
+void overload_reject(int fd, int why);
+int overload_report(char *buf, size_t len);
+
+#endif /* __OVERLOAD_H__ */
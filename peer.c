@@ -0,0 +1,195 @@
+/*
+ * peer.c - Cache peering between proxy instances
+ *
+ * Every instance of a fleet is started with the same peer list. The
+ * URL space is split among the peers with a consistent-hash ring, and
+ * a cache miss for a URL some other peer owns is fetched through that
+ * peer, so the fleet keeps one copy of each object instead of one per
+ * instance. Fetches made for a peer carry PEER_HEADER and are never
+ * passed on again, which bounds every request to one peer hop.
+ *
+ * A peer that cannot be reached or does not answer within the timeout
+ * is skipped for PEER_RETRY_SECS; its URLs go straight to the origin
+ * in the meantime.
+ */
+#include "csapp.h"
+#include "balancer.h"
+#include "peer.h"
+
+#define PEER_RETRY_SECS 5
+
+struct peer {
+    char name[300];             /* host:port as given */
+    struct addrinfo *addr;      /* Resolved once at startup */
+    time_t down_until;          /* Skipped until then */
+    unsigned long fetches, failures;
+};
+
+static struct peer peers[MAX_PEERS];
+static int npeers = 0;
+static int self = -1;
+static char self_name[300] = "";
+static chash_ring_t ring;
+static unsigned long served = 0;  /* Requests answered for peers */
+
+/*
+ * peer_define - add peers from "host:port,host:port,...". The list
+ * should name every instance of the fleet, this one included.
+ */
+int peer_define(char *list)
+{
+    char *tok, *save = NULL;
+
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (npeers == MAX_PEERS || strlen(tok) >= sizeof(peers[0].name) ||
+            strrchr(tok, ':') == NULL)
+            return -1;
+        strcpy(peers[npeers++].name, tok);
+    }
+    return 0;
+}
+
+/*
+ * peer_self - which entry of the peer list is this instance
+ */
+int peer_self(char *name)
+{
+    if (strlen(name) >= sizeof(self_name))
+        return -1;
+    strcpy(self_name, name);
+    return 0;
+}
+
+/*
+ * peers_finish - find this instance in the list (localhost:port unless
+ * set with peer_self), resolve the others and build the ring. Returns
+ * -1 with a message on stderr if the configuration is unusable.
+ */
+int peers_finish(char *port)
+{
+    char *names[MAX_PEERS], host[300], *colon;
+    struct addrinfo hints;
+    int i, rc;
+
+    if (npeers == 0)
+        return 0;
+    if (!self_name[0])
+        sprintf(self_name, "localhost:%.8s", port);
+    for (i = 0; i < npeers; i++) {
+        names[i] = peers[i].name;
+        if (!strcmp(peers[i].name, self_name)) {
+            self = i;
+            continue;
+        }
+        strcpy(host, peers[i].name);
+        colon = strrchr(host, ':');
+        *colon = '\0';
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        if ((rc = getaddrinfo(host, colon + 1, &hints, &peers[i].addr)) != 0) {
+            fprintf(stderr, "peer %s: %s\n", peers[i].name, gai_strerror(rc));
+            return -1;
+        }
+    }
+    if (self < 0) {
+        fprintf(stderr, "peer list does not include this proxy (%s)\n", self_name);
+        return -1;
+    }
+    chash_build(&ring, names, npeers);
+    return 0;
+}
+
+int peers_enabled(void)
+{
+    return npeers > 0;
+}
+
+const char *peer_name(int peer)
+{
+    return peer < 0 ? self_name : peers[peer].name;
+}
+
+/*
+ * peer_owner - the peer to fetch key through, or -1 if this instance
+ * owns it (or its owner is currently skipped)
+ */
+int peer_owner(const char *key)
+{
+    int m;
+
+    if (npeers == 0)
+        return -1;
+    m = chash_lookup(&ring, chash(key, strlen(key)), NULL, NULL);
+    if (m < 0 || m == self ||
+        __atomic_load_n(&peers[m].down_until, __ATOMIC_RELAXED) > time(NULL))
+        return -1;
+    return m;
+}
+
+/*
+ * peer_connect - connect to a peer with connect, send and receive
+ * timeouts of timeout_ms. Returns the descriptor or -1.
+ */
+int peer_connect(int peer, int timeout_ms)
+{
+    struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    struct addrinfo *p;
+    int fd = -1;
+
+    for (p = peers[peer].addr; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+            connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            return fd;
+        close(fd);
+        fd = -1;
+    }
+    return -1;
+}
+
+/*
+ * peer_done - account a fetch through a peer; a failed one takes the
+ * peer out of use for PEER_RETRY_SECS
+ */
+void peer_done(int peer, int ok)
+{
+    __atomic_fetch_add(&peers[peer].fetches, 1, __ATOMIC_RELAXED);
+    if (ok)
+        return;
+    __atomic_fetch_add(&peers[peer].failures, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&peers[peer].down_until, time(NULL) + PEER_RETRY_SECS,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * peer_served - count a request answered on behalf of a peer
+ */
+void peer_served(void)
+{
+    __atomic_fetch_add(&served, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * peer_report - render the peering counters as text into buf
+ */
+int peer_report(char *buf, size_t len)
+{
+    time_t now = time(NULL);
+    int i, n;
+
+    if (npeers == 0)
+        return 0;
+    n = snprintf(buf, len, "peering   self=%s served-for-peers=%lu\n",
+                 self_name, served);
+    for (i = 0; i < npeers && (size_t)n < len; i++) {
+        if (i == self)
+            continue;
+        n += snprintf(buf + n, len - n, "  peer    %s fetches=%lu failures=%lu%s\n",
+                      peers[i].name, peers[i].fetches, peers[i].failures,
+                      peers[i].down_until > now ? " DOWN" : "");
+    }
+    return n;
+}
@@ -0,0 +1,25 @@
+/*
+ * peer.h - Cache peering between proxy instances
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stddef.h>
+
+#define MAX_PEERS 32
+
+/* Request header that marks a fetch made on behalf of a peer */
+#define PEER_HEADER "X-Proxy-Peer"
+
+int peer_define(char *list);
+int peer_self(char *name);
+int peers_finish(char *port);
+int peers_enabled(void);
+const char *peer_name(int peer);
+int peer_owner(const char *key);
+int peer_connect(int peer, int timeout_ms);
+void peer_done(int peer, int ok);
+void peer_served(void);
+int peer_report(char *buf, size_t len);
+
+#endif /* __PEER_H__ */
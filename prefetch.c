@@ -0,0 +1,221 @@
+/*
+ * prefetch.c - Speculative prefetch of assets linked from HTML pages
+ *
+ * When an HTML page passes through the proxy, its src= and href= links
+ * to same-origin images, scripts, stylesheets and fonts are queued, and
+ * a small pool of background threads fetches them into the cache, so
+ * the browser's follow-up requests are hits. Prefetching stays out of
+ * the way of client traffic: the queue is bounded (links that do not
+ * fit are dropped), each page queues at most per_page links, and the
+ * workers run at the lowest CPU priority.
+ */
+#include "csapp.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "cache.h"
+#include "cachekey.h"
+#include "prefetch.h"
+
+static int per_page_cap = 16;
+static prefetch_fn_t fetch_fn = NULL;
+
+/* The queue: a ring of malloc'd URLs */
+static char *queue[PREFETCH_QUEUE];
+static int qhead = 0, qcount = 0;
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long pages, queued, dropped, fetched;
+
+static const char *asset_ext[] = {
+    ".css", ".js", ".png", ".jpg", ".jpeg", ".gif", ".svg", ".webp",
+    ".ico", ".woff", ".woff2", NULL
+};
+
+/*
+ * is_asset - does url (path part) end in an asset extension?
+ */
+static int is_asset(const char *url)
+{
+    size_t len = strcspn(url, "?#"), n;
+    int i;
+
+    for (i = 0; asset_ext[i]; i++) {
+        n = strlen(asset_ext[i]);
+        if (len > n && !strncasecmp(url + len - n, asset_ext[i], n))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * resolve - make link (llen bytes) from page into an absolute URL on
+ * the page's origin. Returns -1 for other origins and schemes.
+ */
+static int resolve(const char *page, const char *link, size_t llen,
+                   char *out, size_t outlen)
+{
+    const char *host = strstr(page, "://"), *slash;
+    size_t olen, blen;
+
+    if (host == NULL || strncasecmp(page, "http://", 7))
+        return -1;
+    slash = strchr(host + 3, '/');
+    olen = slash ? (size_t)(slash - page) : strlen(page);    /* http://host:port */
+    llen = strcspn(link, "#") < llen ? strcspn(link, "#") : llen;
+    if (llen == 0 || llen >= outlen / 2)
+        return -1;
+
+    if (llen > 7 && !strncasecmp(link, "http://", 7)) {
+        if (llen <= olen || strncasecmp(link, page, olen) || link[olen] != '/')
+            return -1;
+        snprintf(out, outlen, "%.*s", (int)llen, link);
+    } else if (llen > 2 && link[0] == '/' && link[1] == '/') {
+        if (llen <= olen - 5 || strncasecmp(link, page + 5, olen - 5) ||
+            link[olen - 5] != '/')
+            return -1;
+        snprintf(out, outlen, "http:%.*s", (int)llen, link);
+    } else if (link[0] == '/')
+        snprintf(out, outlen, "%.*s%.*s", (int)olen, page, (int)llen, link);
+    else {
+        if (memchr(link, ':', strcspn(link, "/?")) != NULL)
+            return -1;                          /* https:, data:, ... */
+        blen = strcspn(page, "?");              /* Up to the last '/' */
+        while (blen > olen && page[blen - 1] != '/')
+            blen--;
+        if (blen == olen)
+            snprintf(out, outlen, "%.*s/%.*s", (int)olen, page, (int)llen, link);
+        else
+            snprintf(out, outlen, "%.*s%.*s", (int)blen, page, (int)llen, link);
+    }
+    return strstr(out, "..") || strpbrk(out, " \t\r\n\"'<>") ? -1 : 0;
+}
+
+/*
+ * enqueue - queue url unless it is already queued or there is no room
+ */
+static int enqueue(const char *url)
+{
+    int i, ok = 0;
+
+    pthread_mutex_lock(&qlock);
+    for (i = 0; i < qcount; i++)
+        if (!strcmp(queue[(qhead + i) % PREFETCH_QUEUE], url))
+            break;
+    if (i == qcount) {
+        if (qcount == PREFETCH_QUEUE)
+            dropped++;
+        else {
+            queue[(qhead + qcount++) % PREFETCH_QUEUE] = strdup(url);
+            queued++;
+            ok = 1;
+            pthread_cond_signal(&qcond);
+        }
+    }
+    pthread_mutex_unlock(&qlock);
+    return ok;
+}
+
+/*
+ * prefetch_scan - queue the asset links of an HTML page served as page.
+ * Returns how many were queued.
+ */
+int prefetch_scan(const char *page, const char *html, size_t len)
+{
+    const char *p = html, *end = html + len, *v;
+    char url[MAXLINE], key[MAXLINE];
+    size_t n, vlen;
+    int count = 0;
+    char q;
+
+    if (fetch_fn == NULL)
+        return 0;
+    __atomic_fetch_add(&pages, 1, __ATOMIC_RELAXED);
+    for (; p < end && count < per_page_cap; p++) {
+        if (p == html || !isspace((unsigned char)p[-1]))
+            continue;
+        if (end - p > 4 && !strncasecmp(p, "src=", 4))
+            n = 4;
+        else if (end - p > 5 && !strncasecmp(p, "href=", 5))
+            n = 5;
+        else
+            continue;
+
+        v = p + n;
+        q = (*v == '"' || *v == '\'') ? *v++ : 0;
+        for (vlen = 0; v + vlen < end; vlen++)
+            if (q ? v[vlen] == q : (isspace((unsigned char)v[vlen]) || v[vlen] == '>'))
+                break;
+        if (v + vlen == end)
+            break;
+        p = v + vlen;
+
+        if (resolve(page, v, vlen, url, sizeof(url)) == 0 && is_asset(url) &&
+            key_normalize(url, key, sizeof(key)) > 0 &&
+            !cache_contains(key) && enqueue(key))
+            count++;
+    }
+    return count;
+}
+
+/*
+ * prefetch_thread - background worker: fetch queued URLs at low priority
+ */
+static void *prefetch_thread(void *vargp)
+{
+    char *url;
+
+    Pthread_detach(pthread_self());
+    /* On Linux the nice value is per thread */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    while (1) {
+        pthread_mutex_lock(&qlock);
+        while (qcount == 0)
+            pthread_cond_wait(&qcond, &qlock);
+        url = queue[qhead];
+        qhead = (qhead + 1) % PREFETCH_QUEUE;
+        qcount--;
+        pthread_mutex_unlock(&qlock);
+
+        if (!cache_contains(url)) {
+            fetch_fn(url);
+            __atomic_fetch_add(&fetched, 1, __ATOMIC_RELAXED);
+        }
+        free(url);
+    }
+    return NULL;
+}
+
+/*
+ * prefetch_init - start nthreads workers that fetch with fn; each page
+ * queues at most per_page links. nthreads == 0 leaves prefetch off.
+ */
+void prefetch_init(int nthreads, int per_page, prefetch_fn_t fn)
+{
+    pthread_t tid;
+    int i;
+
+    if (nthreads <= 0)
+        return;
+    per_page_cap = per_page;
+    fetch_fn = fn;
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, prefetch_thread, NULL);
+}
+
+int prefetch_enabled(void)
+{
+    return fetch_fn != NULL;
+}
+
+/*
+ * prefetch_report - render the prefetch counters as text into buf
+ */
+int prefetch_report(char *buf, size_t len)
+{
+    if (fetch_fn == NULL)
+        return 0;
+    return snprintf(buf, len, "prefetch  pages=%lu queued=%lu dropped=%lu "
+                    "fetched=%lu waiting=%d\n", pages, queued, dropped,
+                    fetched, qcount);
+}
@@ -0,0 +1,19 @@
+/*
+ * prefetch.h - Speculative prefetch of assets linked from HTML pages
+ */
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stddef.h>
+
+#define PREFETCH_QUEUE 256     /* URLs waiting to be fetched */
+
+/* Fetches one URL into the cache */
+typedef void (*prefetch_fn_t)(char *url);
+
+void prefetch_init(int nthreads, int per_page, prefetch_fn_t fn);
+int prefetch_enabled(void);
+int prefetch_scan(const char *page, const char *html, size_t len);
+int prefetch_report(char *buf, size_t len);
+
+#endif /* __PREFETCH_H__ */
@@ -6,115 +6,891 @@
  * It also logs all requests from the web-server/client.
  */
 
+#include <getopt.h>
+#include <poll.h>
 #include "csapp.h"
 #include "string.h"
+#include "timing.h"
+#include "http.h"
+#include "cache.h"
+#include "gzip.h"
+#include "range.h"
+#include "tunnel.h"
+#include "balancer.h"
+#include "peer.h"
+#include "handoff.h"
+#include "overload.h"
+#include "ratelimit.h"
+#include "prefetch.h"
+#include "cachekey.h"
+#include "negcache.h"
+#include "snapshot.h"
+#include "numa.h"
+#include "deadline.h"
+#include "h2.h"
+#include "listener.h"
+#include "workers.h"
+#include "admin.h"
 
-/* Recommended max cache and object sizes */
+/* Default cache and object sizes (--cache-size, --max-object) */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* What send_data() learns from the origin's response headers */
 struct reqData {
-    ssize_t len;
-    int ishtml;
+    http_resp_t hdr;    /* Status and the headers we act on */
+    int compressible;   /* Content-Type worth gzipping */
+    int complete;       /* The whole body was received */
 };
 
+/* What handle_request() learns from the client's request headers */
+struct clientReq {
+    int gzip_ok;              /* Accept-Encoding allows gzip */
+    range_req_t range;        /* Requested byte ranges, range.n == 0: none */
+    char if_range[MAXLINE];   /* If-Range value, "" if absent */
+    char host[MAXLINE];       /* Host header, "" if absent */
+    int status;               /* Status send_data() got, 0 if none */
+    int from_peer;            /* Sent by a peer proxy: never pass it on */
+    int nostore;              /* Do not cache the response here */
+    int no_prefetch;          /* Do not scan the response for links */
+    int timeout;              /* Deadline that cut the response short */
+    int h2;                   /* Came in as an HTTP/2 stream */
+    int h2_upgrade;           /* Asked to upgrade to h2c */
+    char h2_settings[MAXLINE];  /* Its HTTP2-Settings, "" if absent */
+};
+
+/* How send_data() answers a Range request on a cache miss */
+enum { RANGE_NONE, RANGE_STREAM, RANGE_BUFFER, RANGE_416 };
+
+/* A response body being collected for the cache while it is relayed,
+   in blocks of CACHE_BLOCK bytes (the first one grows up to that) */
+struct capture {
+    struct iovec *iov;
+    int n, max;         /* Blocks in use, slots in iov */
+    size_t len, cap;    /* Bytes in all blocks, capacity of the last one */
+    int overflow;       /* Outgrew the largest cacheable object */
+};
+
+#define CAPTURE_INITIALIZER {NULL, 0, 0, 0, 0, 0}
+
+/* Where gzip output goes: the client, and a capture for the cache */
+struct gz_sink {
+    int fd;
+    struct capture *cap;
+    size_t sent;
+};
+
+/* A freshly accepted connection handed to a fetch() thread */
+struct conn {
+    int fd;
+    uint64_t accepted;  /* timing_now() when accept() returned */
+    struct sockaddr_storage addr;   /* Client address */
+    int node;           /* NUMA node to serve it on, -1 = anywhere */
+    int h2;             /* An HTTP/2 stream's socketpair, not a client */
+};
+
+/* Path of the proxy's own status page (origin-form request) */
+#define STATS_PATH "/__proxy/stats"
+
+static uint64_t slow_request_ns = 0; /* 0 = slow-request dump disabled */
+static int log_timing = 0;           /* append phase breakdown to proxy.log */
+static int gzip_level = 6;           /* zlib level, 0 = never compress */
+static int tunnel_idle_ms = 60000;   /* CONNECT tunnel idle timeout */
+static int peer_timeout_ms = 500;    /* Give up on a peer after this */
+static char *upgrade_path = NULL;    /* Listener handoff control socket */
+static int drain_secs = 30;          /* Longest wait for in-flight requests */
+static int max_conns = 0;            /* Connection cap, 0 = none */
+static int max_upstream = 0;         /* Upstream request cap, 0 = none */
+static int codel_target_ms = 5;      /* Queue delay target, 0 = no shedding */
+static int codel_interval_ms = 100;
+static int prefetch_threads = 0;     /* Prefetch workers, 0 = no prefetch */
+static int prefetch_per_page = 16;   /* Most links queued per page */
+static int neg_ttl_secs = 5;         /* Upstream failures remembered, 0 = off */
+static int breaker_failures = 5;     /* Error responses that open the circuit */
+static char *snapshot_path = NULL;   /* Cache snapshot file, NULL = none */
+static int snapshot_interval = 0;    /* Seconds between saves, 0 = at exit */
+static int stop_pipe[2] = {-1, -1};  /* Written by the SIGTERM handler */
+static int numa_mode = 0;            /* Per-node cache shards and threads */
+static int header_timeout_ms = 10000;      /* Client must send its request */
+static int connect_timeout_ms = 5000;      /* Upstream connect() */
+static int first_byte_timeout_ms = 30000;  /* Request sent -> status line */
+static int idle_timeout_ms = 60000;        /* No progress while relaying */
+static int request_timeout_ms = 300000;    /* Whole request, from accept */
+static int listen_backlog = 4096;    /* Listen queue length */
+static int defer_accept_secs = 10;   /* Queue connections once data came */
+static int fastopen_qlen = 0;        /* TCP Fast Open queue, 0 = off */
+static int min_workers = 16;         /* Worker pool bounds */
+static int max_workers = 4096;
+static int worker_target_ms = 2;     /* Queue wait that grows the pool */
+static int worker_idle_ms = 10000;   /* Idle time before a worker exits */
+static size_t cache_size = MAX_CACHE_SIZE;    /* Cache budget in bytes */
+static size_t max_object = MAX_OBJECT_SIZE;   /* Largest cached response */
+
+/* In the thread of an HTTP/2 stream: the client of its connection */
+static __thread struct sockaddr_storage *h2_client = NULL;
+
 static const char *user_agent_hdr = "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
 
 /*
  * Function prototypes
  */
-int parse_uri(char *uri, char *target_addr, char *path, char  *port);
-void format_log_entry(char *logstring, char *ipstr, char *uri, int size);
-void logFile(char *ipaddr, char *uri, int size);
-int send_data(rio_t rios, int fd, int clientfd, char *newRequest);
-int startsWith(const char *pre, const char *str);
-void *fetch(void *thread_fd);
+void logFile(char *ipaddr, char *uri, int size, char *extra);
+int send_data(rio_t *rios, int fd, char *uri, struct clientReq *req,
+              req_timing_t *timing);
+void capture_add(struct capture *c, char *p, size_t n);
+void capture_free(struct capture *c);
+int gz_to_capture(void *arg, char *buf, size_t len);
+int gz_to_client(void *arg, char *buf, size_t len);
+void variant_key(char *key, char *uri);
+void store_response(char *uri, struct reqData *data, char *hdrs,
+                    struct capture *body, struct capture *gzbody);
+cache_obj_t *make_gzip_variant(char *uri, char *key);
+int serve_cached(int fd, char *uri, struct clientReq *req);
+void fetch(void *arg);
+int h2_stream(int fd, struct sockaddr_storage *client);
+int handle_request(int fd, deadline_t *deadline, req_timing_t *timing);
+int handle_connect(int fd, rio_t *rioc, char *authority,
+                   req_timing_t *timing);
+int handle_reverse(int fd, char *path, struct clientReq *req,
+                   req_timing_t *timing);
+int handle_admin(int fd, char *method, char *uri, struct clientReq *req);
+int fetch_via_peer(int fd, char *target, char *host, char *key,
+                   struct clientReq *req, req_timing_t *timing);
+void prefetch_url(char *url);
+int finish_request(int fd, char *uri, char *hostname, int bytesRead,
+                   req_timing_t *timing, char *note);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 char* getIpAddr(int fd);
+int open_upstream(char *hostname, char *port, req_timing_t *timing);
+int deadline_ms(req_timing_t *timing, int ms);
+void serve_stats(int fd);
+void drain(int listenfd);
+void save_snapshot(void);
+void stop_handler(int sig);
+void usage(char *prog);
+size_t parse_size(char *s);
 
 /*
  * main - Main routine for the proxy program
  */
 int main(int argc, char **argv)
 {
-    int listenfd, *connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int listenfd = -1, connfd, c, i, n;
+    struct conn *conn;
+    static accepted_t batch[LISTENER_BATCH];
+    uint64_t now;
+    struct pollfd pfd[3];
     //char hostname[MAXLINE], port[MAXLINE];
+    static struct option longopts[] = {
+        {"slow-ms",    required_argument, NULL, 's'},
+        {"log-timing", no_argument,       NULL, 't'},
+        {"gzip-level", required_argument, NULL, 'z'},
+        {"tunnel-idle", required_argument, NULL, 'i'},
+        {"backend",    required_argument, NULL, 'b'},
+        {"balance",    required_argument, NULL, 'B'},
+        {"route",      required_argument, NULL, 'r'},
+        {"peers",      required_argument, NULL, 'P'},
+        {"self",       required_argument, NULL, 'S'},
+        {"peer-timeout", required_argument, NULL, 'T'},
+        {"upgrade-socket", required_argument, NULL, 'U'},
+        {"drain",      required_argument, NULL, 'D'},
+        {"max-conns",  required_argument, NULL, 'C'},
+        {"max-upstream", required_argument, NULL, 'M'},
+        {"codel-target", required_argument, NULL, 'Q'},
+        {"codel-interval", required_argument, NULL, 'I'},
+        {"rate-limit", required_argument, NULL, 'L'},
+        {"prefetch",   required_argument, NULL, 'p'},
+        {"prefetch-per-page", required_argument, NULL, 'G'},
+        {"query-keys", required_argument, NULL, 'K'},
+        {"neg-ttl",    required_argument, NULL, 'N'},
+        {"breaker-failures", required_argument, NULL, 'F'},
+        {"snapshot",   required_argument, NULL, 'W'},
+        {"snapshot-interval", required_argument, NULL, 'V'},
+        {"numa",       no_argument,       NULL, 'A'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"connect-timeout", required_argument, NULL, 'O'},
+        {"first-byte-timeout", required_argument, NULL, 'Y'},
+        {"idle-timeout", required_argument, NULL, 'E'},
+        {"request-timeout", required_argument, NULL, 'R'},
+        {"backlog",    required_argument, NULL, 'k'},
+        {"defer-accept", required_argument, NULL, 'd'},
+        {"fastopen",   required_argument, NULL, 'f'},
+        {"min-workers", required_argument, NULL, 'm'},
+        {"max-workers", required_argument, NULL, 'x'},
+        {"worker-target", required_argument, NULL, 'q'},
+        {"worker-idle", required_argument, NULL, 'j'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"max-object", required_argument, NULL, 'o'},
+        {"purge-from", required_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0}
+    };
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(0);
+    while ((c = getopt_long(argc, argv, "s:tz:i:b:r:P:U:L:p:", longopts, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            slow_request_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+            break;
+        case 't':
+            log_timing = 1;
+            break;
+        case 'z':
+            gzip_level = atoi(optarg);
+            if (gzip_level < 0 || gzip_level > 9)
+                usage(argv[0]);
+            break;
+        case 'i':
+            tunnel_idle_ms = atoi(optarg) * 1000;
+            break;
+        case 'b':
+            if (pool_define(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'B':
+            if (pool_policy(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if (route_add(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'P':
+            if (peer_define(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            if (peer_self(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'T':
+            peer_timeout_ms = atoi(optarg);
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'D':
+            drain_secs = atoi(optarg);
+            break;
+        case 'C':
+            max_conns = atoi(optarg);
+            break;
+        case 'M':
+            max_upstream = atoi(optarg);
+            break;
+        case 'Q':
+            codel_target_ms = atoi(optarg);
+            break;
+        case 'I':
+            codel_interval_ms = atoi(optarg);
+            if (codel_interval_ms <= 0)
+                usage(argv[0]);
+            break;
+        case 'L':
+            if (ratelimit_rule(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'p':
+            prefetch_threads = atoi(optarg);
+            break;
+        case 'G':
+            prefetch_per_page = atoi(optarg);
+            break;
+        case 'K':
+            if (!strcmp(optarg, "keep"))
+                key_query_mode(KEY_QUERY_KEEP);
+            else if (!strcmp(optarg, "sort"))
+                key_query_mode(KEY_QUERY_SORT);
+            else if (!strcmp(optarg, "strip"))
+                key_query_mode(KEY_QUERY_STRIP);
+            else
+                usage(argv[0]);
+            break;
+        case 'N':
+            neg_ttl_secs = atoi(optarg);
+            break;
+        case 'F':
+            breaker_failures = atoi(optarg);
+            break;
+        case 'W':
+            snapshot_path = optarg;
+            break;
+        case 'V':
+            snapshot_interval = atoi(optarg);
+            break;
+        case 'A':
+            numa_mode = 1;
+            break;
+        case 'H':
+            header_timeout_ms = atoi(optarg) * 1000;
+            break;
+        case 'O':
+            connect_timeout_ms = atoi(optarg) * 1000;
+            break;
+        case 'Y':
+            first_byte_timeout_ms = atoi(optarg) * 1000;
+            break;
+        case 'E':
+            idle_timeout_ms = atoi(optarg) * 1000;
+            break;
+        case 'R':
+            request_timeout_ms = atoi(optarg) * 1000;
+            break;
+        case 'k':
+            listen_backlog = atoi(optarg);
+            break;
+        case 'd':
+            defer_accept_secs = atoi(optarg);
+            break;
+        case 'f':
+            fastopen_qlen = atoi(optarg);
+            break;
+        case 'm':
+            min_workers = atoi(optarg);
+            break;
+        case 'x':
+            max_workers = atoi(optarg);
+            break;
+        case 'q':
+            worker_target_ms = atoi(optarg);
+            break;
+        case 'j':
+            worker_idle_ms = atoi(optarg) * 1000;
+            break;
+        case 'c':
+            if ((cache_size = parse_size(optarg)) == 0)
+                usage(argv[0]);
+            break;
+        case 'o':
+            if ((max_object = parse_size(optarg)) == 0)
+                usage(argv[0]);
+            break;
+        case 'a':
+            if (admin_allow(optarg) < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || min_workers < 1 || max_workers < min_workers)
+        usage(argv[0]);
+
+    pools_finish();
+    if (peers_finish(argv[optind]) < 0)
+        exit(1);
+    if (numa_mode)
+      numa_init();
+    cache_init(cache_size, max_object, numa_nodes());
+    if (snapshot_path) { //save on the way out (loaded once we have the listener)
+      if (pipe(stop_pipe) < 0)
+        unix_error("pipe");
+      Signal(SIGTERM, stop_handler);
+      Signal(SIGINT, stop_handler);
+    }
+    overload_init(max_conns, max_upstream, codel_target_ms, codel_interval_ms);
+    prefetch_init(prefetch_threads, prefetch_per_page, prefetch_url);
+    neg_init(neg_ttl_secs, breaker_failures);
+    deadline_init();
+    h2_init(h2_stream, idle_timeout_ms);
+    workers_init(fetch, min_workers, max_workers, worker_target_ms,
+                 worker_idle_ms);
+
+    /* Take the listener over from a running proxy, or open our own */
+    if (upgrade_path && (listenfd = handoff_take(upgrade_path)) >= 0)
+      fprintf(stderr, "took over the listening socket via %s\n", upgrade_path);
+    if (listenfd < 0)
+      listenfd = Open_listenfd(argv[optind]);
+    if (upgrade_path) {
+      if (handoff_offer(upgrade_path, listenfd,
+                        snapshot_path ? save_snapshot : NULL) < 0) {
+        fprintf(stderr, "cannot serve handoffs on %s\n", upgrade_path);
+        exit(1);
+      }
+    }
+    //warm start: after a handoff the old process has just saved the snapshot
+    if (snapshot_path) {
+      snapshot_load(snapshot_path);
+      snapshot_start(snapshot_path, snapshot_interval);
     }
+    //non-blocking, so a wakeup drains the queue (and two processes may share it)
+    listener_tune(listenfd, listen_backlog, defer_accept_secs, fastopen_qlen);
 
-    listenfd = Open_listenfd(argv[1]);
+    //SIGPIPE - client disconnects prematurely
+    signal(SIGPIPE, SIG_IGN); //catching SIGPIPE and ignoring it
+
+    pfd[0].fd = listenfd;
+    pfd[1].fd = upgrade_path ? handoff_fd() : -1;
+    pfd[2].fd = stop_pipe[0];
+    pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
     while (1) {
-      //SIGPIPE - client disconnects prematurely
-      signal(SIGPIPE, SIG_IGN); //catching SIGPIPE and ignoring it
+      if (poll(pfd, 3, -1) < 0)
+        continue;
+      if (pfd[1].revents) //a new process has the listener now
+        break;
+      if (pfd[2].revents) { //SIGTERM/SIGINT with a snapshot to write
+        snapshot_save(snapshot_path);
+        exit(0);
+      }
+      n = listener_accept(listenfd, batch, LISTENER_BATCH);
+      now = timing_now();
+      for (i = 0; i < n; i++) {
+        connfd = batch[i].fd;
+        if (!conn_admit()) { //over the cap: canned 503, no thread
+          overload_reject(connfd, SHED_CONNS);
+          Close(connfd);
+          continue;
+        }
+        conn = Malloc(sizeof(struct conn));
+        conn->fd = connfd;
+        conn->accepted = now;
+        memcpy(&conn->addr, &batch[i].addr, batch[i].addrlen);
+        conn->node = -1;
+        conn->h2 = 0;
+        if (numa_mode && (conn->node = numa_socket_node(connfd)) < 0)
+          conn->node = numa_node(); //the listener's node
+        workers_submit(conn, now);
+      }
+    }
+    drain(listenfd);
+    return 0;
+}
+
+/*
+ * stop_handler - SIGTERM/SIGINT: let the main loop save the snapshot
+ */
+void stop_handler(int sig)
+{
+    if (write(stop_pipe[1], "x", 1) < 0)
+      _exit(1);
+}
 
-      clientlen = sizeof(struct sockaddr_storage);
-      connfd = Malloc(sizeof(int));
-      *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-      pthread_t tid;
-      Pthread_create(&tid,NULL,fetch,connfd);
+/*
+ * drain - after a handoff: stop accepting, give in-flight requests up
+ * to drain_secs to finish, then exit
+ */
+void drain(int listenfd)
+{
+    uint64_t deadline = timing_now() + (uint64_t)drain_secs * 1000000000ULL;
+    int left;
+
+    Close(listenfd);
+    fprintf(stderr, "listener handed off, draining %d connections\n",
+            conn_active());
+    while ((left = conn_active()) > 0 && timing_now() < deadline)
+      usleep(100000);
+    if (left > 0)
+      fprintf(stderr, "drain deadline passed, cutting %d connections\n", left);
+    exit(0); //the snapshot was saved for the new process before the handoff
+}
+
+/*
+ * save_snapshot - save the cache for the process taking the listener
+ * over, which loads it as soon as it has the listener
+ */
+void save_snapshot(void)
+{
+    snapshot_save(snapshot_path);
+}
+
+/*
+ * usage - print the command line synopsis and exit
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [options] <port>\n"
+            "  -s, --slow-ms N     dump the phase breakdown of requests "
+            "slower than N ms\n"
+            "  -t, --log-timing    append the phase breakdown to proxy.log\n"
+            "  -z, --gzip-level N  gzip level for compressible responses, "
+            "0 = off (default 6)\n"
+            "  -i, --tunnel-idle N close CONNECT tunnels idle for N s, "
+            "0 = never (default 60)\n"
+            "  -b, --backend NAME=HOST:PORT[,HOST:PORT...]\n"
+            "                      define a backend pool (reverse-proxy mode)\n"
+            "      --balance NAME=rr|least|hash\n"
+            "                      balancing policy of a pool (default rr)\n"
+            "  -r, --route [HOST]/PREFIX=NAME\n"
+            "                      send matching requests to a pool\n"
+            "  -P, --peers HOST:PORT[,HOST:PORT...]\n"
+            "                      share the cache with these proxies\n"
+            "      --self HOST:PORT\n"
+            "                      this proxy's entry in the peer list "
+            "(default localhost:<port>)\n"
+            "      --peer-timeout N\n"
+            "                      fall back to the origin after N ms "
+            "(default 500)\n"
+            "  -U, --upgrade-socket PATH\n"
+            "                      take over / hand off the listener on PATH\n"
+            "      --drain N       after a handoff, wait up to N s for "
+            "requests (default 30)\n"
+            "      --max-conns N   answer 503 beyond N connections "
+            "(default no limit)\n"
+            "      --max-upstream N\n"
+            "                      answer 503 beyond N upstream requests "
+            "(default no limit)\n"
+            "      --codel-target MS, --codel-interval MS\n"
+            "                      shed on queue delay above MS for an "
+            "interval (5, 100; 0 = off)\n"
+            "  -L, --rate-limit CIDR=REQS[,BYTES]\n"
+            "                      per-client limit per second for "
+            "addresses in CIDR\n"
+            "  -p, --prefetch N    prefetch assets linked from HTML pages "
+            "with N threads\n"
+            "      --prefetch-per-page N\n"
+            "                      queue at most N links per page "
+            "(default 16)\n"
+            "      --query-keys keep|sort|strip\n"
+            "                      how query strings enter cache keys "
+            "(default keep)\n"
+            "      --neg-ttl N     remember upstream failures and cache "
+            "404s for N s (default 5)\n"
+            "      --breaker-failures N\n"
+            "                      fail fast after N upstream errors "
+            "in a row (default 5)\n"
+            "      --snapshot PATH load the cache from PATH at startup, "
+            "save it there at exit\n"
+            "                      and before handing the listener over\n"
+            "      --snapshot-interval N\n"
+            "                      also save the snapshot every N s "
+            "(default 0 = only at exit)\n"
+            "      --numa          one cache shard per NUMA node, and serve "
+            "connections on\n"
+            "                      the node that received them\n"
+            "      --header-timeout N, --connect-timeout N\n"
+            "                      give up on a client's request headers "
+            "(10) or a connect (5) after N s\n"
+            "      --first-byte-timeout N, --idle-timeout N\n"
+            "                      give up on an upstream response (30) or "
+            "a stalled transfer (60)\n"
+            "      --request-timeout N\n"
+            "                      cut requests off N s after accept "
+            "(default 300; 0 = never)\n"
+            "      --backlog N     listen queue length (default 4096)\n"
+            "      --defer-accept N\n"
+            "                      only accept connections once they sent "
+            "data, waiting up to N s\n"
+            "                      (default 10; 0 = off)\n"
+            "      --fastopen N    accept TCP Fast Open with up to N "
+            "pending (default 0 = off)\n"
+            "      --min-workers N, --max-workers N\n"
+            "                      bounds of the connection worker pool "
+            "(default 16, 4096)\n"
+            "      --worker-target MS, --worker-idle N\n"
+            "                      grow the pool when connections wait "
+            "over MS (2), retire\n"
+            "                      workers idle for N s (10)\n"
+            "      --cache-size N[K|M|G], --max-object N[K|M|G]\n"
+            "                      cache budget (default 1049000) and "
+            "largest cached response\n"
+            "                      (default 100K)\n"
+            "      --purge-from CIDR[,CIDR...]\n"
+            "                      clients allowed to PURGE and list the "
+            "cache (default loopback)\n",
+            prog);
+    exit(0);
+}
+
+/*
+ * parse_size - a byte count with an optional K, M or G suffix, 0 if
+ * it is malformed
+ */
+size_t parse_size(char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    if (end == s)
+      return 0;
+    switch (*end) {
+    case 'G': case 'g':
+      n <<= 10;
+      /* fall through */
+    case 'M': case 'm':
+      n <<= 10;
+      /* fall through */
+    case 'K': case 'k':
+      n <<= 10;
+      end++;
+    }
+    return *end == '\0' ? (size_t)n : 0;
+}
+
+/*
+ * capture_add - append n bytes to a body being collected for the cache.
+ * Gives up (and frees the blocks) once it outgrows a cacheable object.
+ */
+void capture_add(struct capture *c, char *p, size_t n)
+{
+    struct iovec *last;
+    size_t k;
+
+    if (c->overflow)
+      return;
+    if (c->len + n > cache_max_object()) {
+      capture_free(c);
+      c->overflow = 1;
+      return;
+    }
+    while (n > 0) {
+      last = c->n ? &c->iov[c->n - 1] : NULL;
+      if (last && last->iov_len == c->cap && c->cap < CACHE_BLOCK) {
+        c->cap = c->cap * 2 < CACHE_BLOCK ? c->cap * 2 : CACHE_BLOCK;
+        last->iov_base = Realloc(last->iov_base, c->cap);
+      }
+      else if (last == NULL || last->iov_len == c->cap) {
+        if (c->n == c->max) {
+          c->max = c->max ? c->max * 2 : 8;
+          c->iov = Realloc(c->iov, c->max * sizeof(struct iovec));
+        }
+        c->cap = c->n ? CACHE_BLOCK : MAXBUF;
+        last = &c->iov[c->n++];
+        last->iov_base = Malloc(c->cap);
+        last->iov_len = 0;
+      }
+      k = c->cap - last->iov_len < n ? c->cap - last->iov_len : n;
+      memcpy((char *)last->iov_base + last->iov_len, p, k);
+      last->iov_len += k;
+      c->len += k;
+      p += k;
+      n -= k;
     }
 }
 
 /*
- * startsWith check if the second string has the first string as a predicate.
- * Takes two valid string constants and returns the bool value (int).
+ * capture_free - release the blocks of a capture
  */
-int startsWith(const char *pre, const char *str)
+void capture_free(struct capture *c)
 {
-    size_t lenpre = strlen(pre),
-    lenstr = strlen(str);
-    return lenstr < lenpre ? 0 : strncmp(pre, str, lenpre) == 0;
+    int i;
+
+    for (i = 0; i < c->n; i++)
+      free(c->iov[i].iov_base);
+    free(c->iov);
+    c->iov = NULL;
+    c->n = c->max = 0;
+    c->len = c->cap = 0;
 }
 
 /*
- * send_data first sends the header data, and uses that data to extract
- * the necessary information, and then sends html data line by line
- * and all other data in MAXLINE increments.
+ * gz_to_capture - gzip emitter: collect the compressed output for the
+ * cache only
+ */
+int gz_to_capture(void *arg, char *buf, size_t len)
+{
+    struct capture *c = (struct capture *)arg;
+
+    capture_add(c, buf, len);
+    return c->overflow ? -1 : 0;
+}
+
+/*
+ * gz_to_client - gzip emitter: send compressed output to the client
+ * and keep a copy for the cache
+ */
+int gz_to_client(void *arg, char *buf, size_t len)
+{
+    struct gz_sink *sink = (struct gz_sink *)arg;
+
+    capture_add(sink->cap, buf, len);
+    if (rio_writen(sink->fd, buf, len) < 0)
+      return -1;
+    sink->sent += len;
+    return 0;
+}
+
+/*
+ * variant_key - cache key of the gzip variant of uri
+ */
+void variant_key(char *key, char *uri)
+{
+    sprintf(key, "%s gzip", uri);
+}
+
+/*
+ * store_response - cache a complete response: its identity copy and,
+ * when one was produced, its gzip variant. Frees the captured bodies.
+ */
+void store_response(char *uri, struct reqData *data, char *hdrs,
+                    struct capture *body, struct capture *gzbody)
+{
+    char key[MAXLINE + 8], gzhdrs[MAXBUF];
+    time_t expires = data->hdr.maxage >= 0 ? time(NULL) + data->hdr.maxage : 0;
+    size_t n;
+
+    if (data->hdr.maxage < 0 && neg_cacheable(data->hdr.status))
+      expires = time(NULL) + neg_ttl(); //negative entry: short TTL
+    if ((data->hdr.status != 200 && !neg_cacheable(data->hdr.status)) ||
+        data->hdr.nostore || data->hdr.maxage == 0 ||
+        data->hdr.chunked || !data->complete || body->overflow ||
+        (data->hdr.len >= 0 && (size_t)data->hdr.len != body->len)) {
+      capture_free(body);
+      capture_free(gzbody);
+      return;
+    }
+
+    cache_insertv(uri, hdrs, strlen(hdrs), body->iov, body->n, time(NULL),
+                  expires);
+    if (gzbody->iov && !gzbody->overflow) {
+      n = gz_headers(hdrs, gzhdrs, sizeof(gzhdrs), 1, gzbody->len);
+      variant_key(key, uri);
+      cache_insertv(key, gzhdrs, n, gzbody->iov, gzbody->n, time(NULL),
+                    expires);
+    }
+    capture_free(body);
+    capture_free(gzbody);
+}
+
+/*
+ * send_data first reads the header data and uses it to extract the
+ * necessary information, then sends the headers and relays the body
+ * in MAXBUF increments. Compressible responses are gzipped on the way
+ * when the client accepts gzip, and complete cacheable responses are
+ * stored in the cache (identity copy plus gzip variant).
+ *
+ * A Range request is answered from the same single full fetch: one
+ * range is streamed out of the body as it passes through, several are
+ * served from the completed fill. Either way the whole object still
+ * lands in the cache.
  *
- * Needs the rio buffer, the two file descriptors, and the request.
+ * Needs the rio buffer, the client file descriptor, the request URI
+ * (the cache key) and what the client asked for.
  *
- * Returns the number of bytes read.
+ * Returns the number of body bytes sent to the client.
  */
-int send_data(rio_t rios, int fd, int clientfd, char *newRequest)
+int send_data(rio_t *rios, int fd, char *uri, struct clientReq *req,
+              req_timing_t *timing)
 {
-    struct reqData *data = (struct reqData *)malloc(sizeof(struct reqData));
-    char content[MAXLINE];
-    ssize_t len = 0;
-
-    data->ishtml = 0;
-
-    int bytesRead = 0;
-    
-    while (rio_readlineb(&rios, content, MAXLINE)) {
-      rio_writen(fd, content, strlen(content)); //send it to client
-      if(startsWith("Content-Type: text/html",content)){
-        data->ishtml = 1;
-      }
-      if(startsWith("Content-Length:",content)){
-        char *tmp = strchr(content,' ');
-        data->len = atoi(tmp);
-        bytesRead += data->len; //bytes for text
+    struct reqData data;
+    struct capture body = CAPTURE_INITIALIZER, gzbody = CAPTURE_INITIALIZER;
+    struct gz_sink sink = {fd, &gzbody, 0};
+    char content[MAXBUF], hdrs[MAXBUF], out[MAXBUF];
+    size_t hdrlen = 0;
+    ssize_t n = 0, left;
+    long off = 0, first, last;
+    int bytesRead = 0, compress, vary, mode = RANGE_NONE, nr = 0;
+    byte_range_t r[MAX_RANGES];
+    gz_t gz;
+    deadline_t deadline = DEADLINE_INITIALIZER;
+
+    http_resp_init(&data.hdr);
+    data.compressible = data.complete = 0;
+
+    /* Collect the status line and headers */
+    deadline_arm(&deadline, DL_FIRST_BYTE,
+                 deadline_ms(timing, first_byte_timeout_ms), rios->rio_fd, -1);
+    workers_blocking(1);
+    n = rio_readlineb(rios, content, MAXLINE);
+    workers_blocking(0);
+    timing_mark(timing, PH_TTFB);
+    if (n <= 0) {
+      deadline_cancel(&deadline);
+      req->timeout = deadline_fired(&deadline);
+      return 0;
+    }
+    //from here on only a stall in either direction ends it early
+    deadline_arm(&deadline, DL_IDLE, idle_timeout_ms, rios->rio_fd, fd);
+    data.hdr.status = http_status(content);
+    req->status = data.hdr.status;
+    do {
+      if (hdrlen + n >= sizeof(hdrs)) { //too big to rewrite or cache
+        rio_writen(fd, hdrs, hdrlen);
+        hdrlen = 0;
+        data.hdr.nostore = 1;
       }
-      if(strcmp(content,"\r\n")==0)
+      memcpy(hdrs + hdrlen, content, n);
+      hdrlen += n;
+      if (strcmp(content, "\r\n") == 0 || strcmp(content, "\n") == 0)
         break;
+      http_resp_header(&data.hdr, content);
+    } while ((n = rio_readlineb(rios, content, MAXLINE)) > 0);
+    hdrs[hdrlen] = '\0';
+    data.compressible = gz_compressible(data.hdr.type);
+
+    /* Identity responses that could be compressed vary on the encoding */
+    vary = gzip_level > 0 && data.compressible && !data.hdr.encoded &&
+           data.hdr.status == 200 && !data.hdr.nostore;
+    compress = req->gzip_ok && vary && !data.hdr.chunked &&
+               (data.hdr.len < 0 || data.hdr.len >= GZIP_MIN_SIZE);
+    if (vary) {
+      hdrlen = gz_headers(hdrs, out, sizeof(out), 0, -1);
+      strcpy(hdrs, out);
+    }
+
+    /* Ranges need the full length up front */
+    if (req->range.n && data.hdr.status == 200 && !data.hdr.chunked &&
+        data.hdr.len >= 0 && range_if_match(req->if_range, hdrs)) {
+      nr = range_resolve(&req->range, data.hdr.len, r);
+      if (nr == 0)
+        mode = RANGE_416;
+      else if (nr == 1)
+        mode = RANGE_STREAM;
+      else if ((size_t)data.hdr.len <= cache_max_object())
+        mode = RANGE_BUFFER;
     }
 
-    if(data->ishtml){
-      while (rio_readlineb(&rios, content, MAXLINE))
-        rio_writen(fd, content, strlen(content)); //send it to client
+    if (compress && gz_init(&gz, gzip_level, gz_to_client, &sink) < 0)
+      compress = 0;
+    if (compress) {
+      n = gz_headers(hdrs, out, sizeof(out), 1, -1);
+      rio_writen(fd, out, n);
+    }
+    else if (mode == RANGE_STREAM) {
+      n = range_headers(hdrs, out, sizeof(out), r, 1, data.hdr.len);
+      rio_writen(fd, out, n);
     }
-    else{
-      while (rio_readnb(&rios, content, MAXLINE) && data->len > 0) {
-        ssize_t tmp = rio_writen(fd, content, MAXLINE); //send it to client
-        len -= tmp;
-        bytesRead += tmp; //bytes for binary data
+    else if (mode == RANGE_416)
+      range_not_satisfiable(fd, data.hdr.len);
+    else if (mode == RANGE_NONE)
+      rio_writen(fd, hdrs, hdrlen);
+
+    /* Relay the body, up to Content-Length or EOF */
+    left = data.hdr.len;
+    while (left != 0 &&
+           (n = rio_readnb(rios, content,
+                           left > 0 && left < MAXBUF ? left : MAXBUF)) > 0) {
+      deadline_touch(&deadline);
+      if (left > 0)
+        left -= n;
+      capture_add(&body, content, n);
+      if (compress) {
+        if (gz_write(&gz, content, n) < 0)
+          break;
+      }
+      else if (mode == RANGE_STREAM) { //only the part inside the range
+        first = off > r[0].first ? off : r[0].first;
+        last = off + n - 1 < r[0].last ? off + n - 1 : r[0].last;
+        if (first <= last) {
+          if (rio_writen(fd, content + (first - off), last - first + 1) < 0)
+            break;
+          bytesRead += last - first + 1;
+        }
+      }
+      else if (mode == RANGE_NONE) {
+        if (rio_writen(fd, content, n) < 0)
+          break;
+        bytesRead += n;
       }
+      off += n;
     }
+    deadline_cancel(&deadline);
+    req->timeout = deadline_fired(&deadline);
+    data.complete = (left == 0 || (left < 0 && n == 0)) && !req->timeout;
+    if (compress) {
+      if (data.complete && gz_finish(&gz) < 0)
+        data.complete = 0;
+      gz_end(&gz);
+      bytesRead = sink.sent;
+    }
+    if (mode == RANGE_BUFFER && data.complete && !body.overflow)
+      bytesRead = range_send(fd, hdrs, body.iov, body.n, body.len, r, nr);
+    timing_mark(timing, PH_TRANSFER);
+
+    if (req->nostore)
+      data.hdr.nostore = 1;
+    else if (data.hdr.ishtml && data.hdr.status == 200 && data.complete &&
+             !data.hdr.encoded && body.iov && !req->no_prefetch &&
+             prefetch_enabled())
+      prefetch_scan(uri, body.iov[0].iov_base, body.iov[0].iov_len); //first block
+    store_response(uri, &data, hdrs, &body, &gzbody);
     return bytesRead;
 }
 
@@ -130,6 +906,8 @@ char* getIpAddr(int fd){
        perror("Getpeername Error!\n");
        return NULL;
     }
+    if (addr.ss_family == AF_UNIX && h2_client) //an HTTP/2 stream
+       memcpy(&addr, h2_client, sizeof(addr));
 
     if (addr.ss_family == AF_INET) {
        struct sockaddr_in *s = (struct sockaddr_in *)&addr;
@@ -145,7 +923,7 @@ char* getIpAddr(int fd){
 /*
  * logFile - logs each client request
  */
-void logFile(char *ipaddr, char *uri, int size) {
+void logFile(char *ipaddr, char *uri, int size, char *extra) {
     FILE *logFile;
     char *logstring = (char *) malloc(sizeof(char) * MAXLINE);
 
@@ -154,7 +932,7 @@ void logFile(char *ipaddr, char *uri, int size) {
         printf("Cannot open log file\n");
     }
 
-    format_log_entry(logstring, ipaddr, uri, size);
+    format_log_entry(logstring, ipaddr, uri, size, extra);
     fprintf(logFile, "%s", logstring);
 
     free(ipaddr);
@@ -163,36 +941,210 @@ void logFile(char *ipaddr, char *uri, int size) {
 }
 
 /*
- * fetch - getting content from host and send it to client
+ * fetch - worker routine for one client connection: handle its request,
+ * then close it
  */
-void *fetch(void *thread_fd){
-    int fd = *((int *)thread_fd);
-    Pthread_detach(pthread_self());
-    Free(thread_fd);
-    
+void fetch(void *arg){
+    struct conn *conn = (struct conn *)arg;
+    int fd = conn->fd;
+    req_timing_t timing;
+    rl_bucket_t *bucket;
+    deadline_t deadline = DEADLINE_INITIALIZER;
+    if (conn->node >= 0 && conn->node != numa_node())
+      numa_bind_thread(conn->node);
+    h2_client = conn->h2 ? &conn->addr : NULL;
+    timing_start(&timing, conn->accepted);
+    timing_mark(&timing, PH_ACCEPT);
+    deadline_arm(&deadline, DL_HEADER,
+                 deadline_ms(&timing, header_timeout_ms), fd, -1);
+
+    if (!queue_admit(timing.ns[PH_ACCEPT], timing.last))
+      overload_reject(fd, SHED_QUEUE);
+    else if (!ratelimit_admit((SA *)&conn->addr, timing.last, &bucket))
+      ratelimit_reject(fd);
+    else
+      ratelimit_charge(bucket, handle_request(fd, &deadline, &timing));
+    deadline_cancel(&deadline);
+    h2_client = NULL;
+    Free(conn);
+    Close(fd);
+    conn_done();
+}
+
+/*
+ * h2_stream - start serving one HTTP/2 stream: fd carries its request
+ * and response as HTTP/1.0, and it is admitted and queued for a worker
+ * like a connection of its own. Returns -1 (the stream is refused) when
+ * over the connection cap or when the pool is full.
+ */
+int h2_stream(int fd, struct sockaddr_storage *client)
+{
+    struct conn *conn;
+    uint64_t now = timing_now();
+
+    if (!conn_admit())
+      return -1;
+    conn = Malloc(sizeof(struct conn));
+    conn->fd = fd;
+    conn->accepted = now;
+    memcpy(&conn->addr, client, sizeof(conn->addr));
+    conn->node = -1;
+    conn->h2 = 1;
+    if (workers_try_submit(conn, now) < 0) {
+      Free(conn);
+      conn_done();
+      return -1;
+    }
+    return 0;
+}
+
+/*
+ * handle_request - getting content from the cache or the host and
+ * send it to client. deadline guards the connection: it bounds reading
+ * the request, then the whole request. Returns the body bytes sent.
+ */
+int handle_request(int fd, deadline_t *deadline, req_timing_t *timing)
+{
     char request[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char hostname[MAXLINE], pathname[MAXLINE];
-    char* port = (char*)malloc(sizeof(char)*20);
+    char hostname[MAXLINE], pathname[MAXLINE], port[20];
+    char content[MAXLINE], key[MAXLINE], *val;
+    char fields[MAXBUF], *upgrade; //header lines an h2c upgrade passes on
+    size_t nfields = 0, n;
     rio_t rioc; //for client
+    struct clientReq req;
 
     int clientfd; //for this proxy to connect to web server
+    int bytesRead, why, upid, id;
 
     /* Read request line and headers */
     rio_readinitb(&rioc, fd);
     if (!rio_readlineb(&rioc, request, MAXLINE)) //read request
-      return NULL;
+      return 0;
+    if (h2_is_preface(request)) { //HTTP/2 with prior knowledge
+      deadline_cancel(deadline);
+      return h2_serve(fd, &rioc, NULL, NULL);
+    }
 
     sscanf(request, "%s %s %s", method, uri, version);   //parsing request
-    if (strcasecmp(method, "GET")) {                 //checks method
+    if (strcasecmp(method, "GET") && strcasecmp(method, "CONNECT") &&
+        strcasecmp(method, "PURGE")) { //checks method
       clienterror(fd, method, "501", "Not Implemented","Proxy does not support this request");
-      return NULL;
+      return 0;
+    }
+
+    req.gzip_ok = 0;
+    req.range.n = 0;
+    req.if_range[0] = '\0';
+    req.host[0] = '\0';
+    req.status = 0;
+    req.from_peer = req.nostore = req.no_prefetch = 0;
+    req.timeout = DL_NONE;
+    req.h2 = req.h2_upgrade = 0;
+    req.h2_settings[0] = '\0';
+    while (rio_readlineb(&rioc, content, MAXLINE) > 0) {
+      if (!strcmp(content, "\r\n") || !strcmp(content, "\n"))
+        break;
+      id = http_header_id(content, (const char **)&val);
+      if (id != HDR_UPGRADE && id != HDR_HTTP2_SETTINGS &&
+          id != HDR_CONNECTION && nfields < sizeof(fields)) {
+        if ((n = strlen(content)) < sizeof(fields) - nfields)
+          memcpy(fields + nfields, content, n);
+        nfields += n; //past sizeof(fields): too many to upgrade
+      }
+      switch (id) {
+      case HDR_ACCEPT_ENCODING:
+        req.gzip_ok = gzip_level > 0 && gz_accepts(val);
+        break;
+      case HDR_RANGE:
+        range_parse(val, &req.range);
+        break;
+      case HDR_IF_RANGE:
+        val[strcspn(val, "\r\n")] = '\0';
+        strcpy(req.if_range, val);
+        break;
+      case HDR_HOST:
+        val[strcspn(val, " \t\r\n")] = '\0';
+        strcpy(req.host, val);
+        break;
+      case HDR_X_PROXY_PEER: //PEER_HEADER
+        req.from_peer = 1;
+        break;
+      case HDR_X_PROXY_H2: //H2_HEADER
+        req.h2 = 1;
+        break;
+      case HDR_UPGRADE:
+        req.h2_upgrade = strstr(val, "h2c") != NULL;
+        break;
+      case HDR_HTTP2_SETTINGS:
+        val[strcspn(val, " \t\r\n")] = '\0';
+        strcpy(req.h2_settings, val);
+        break;
+      }
+    }
+    if (deadline_fired(deadline)) { //headers cut off by the deadline
+      clienterror(fd, method, "408", "Request Timeout",
+                  "Proxy did not receive the request in time");
+      return 0;
+    }
+    if (req.range.n)
+      req.gzip_ok = 0; //ranges are served from the identity copy
+
+    if (!strcasecmp(method, "CONNECT")) { //tunnels have their own idle limit
+      deadline_cancel(deadline);
+      return handle_connect(fd, &rioc, uri, timing);
+    }
+    if (req.h2_upgrade && req.h2_settings[0] && !req.h2 &&
+        !strcmp(version, "HTTP/1.1") && nfields < sizeof(fields)) {
+      //h2c: this request, with its own headers, becomes stream 1
+      n = strlen(method) + strlen(uri) + nfields + 64;
+      upgrade = Malloc(n);
+      snprintf(upgrade, n, "%s %s HTTP/1.0\r\n" H2_HEADER ": 1\r\n%.*s\r\n",
+               method, uri, (int)nfields, fields);
+      deadline_cancel(deadline);
+      n = h2_serve(fd, &rioc, upgrade, req.h2_settings);
+      Free(upgrade);
+      return n;
+    }
+    deadline_arm(deadline, DL_REQUEST, deadline_ms(timing, 0), fd, -1);
+
+    if (!strcmp(uri, STATS_PATH)) { //request for the proxy itself
+      serve_stats(fd);
+      return 0;
+    }
+    if (!strcasecmp(method, "PURGE") ||
+        (!strncmp(uri, CACHE_PATH, strlen(CACHE_PATH)) &&
+         (uri[strlen(CACHE_PATH)] == '\0' || uri[strlen(CACHE_PATH)] == '?')))
+      return handle_admin(fd, method, uri, &req); //cache administration
+    if (req.from_peer)
+      peer_served();
+
+    if (uri[0] == '/' && pools_defined()) //origin-form: reverse proxy
+      return handle_reverse(fd, uri, &req, timing);
+    if (uri[0] == '/' && req.h2 && req.host[0]) { //h2c clients see an origin
+      if (snprintf(content, sizeof(content), "http://%s%s", req.host, uri) >=
+          (int)sizeof(content)) {
+        clienterror(fd, uri, "414", "URI Too Long",
+                    "Proxy cannot handle a URL this long");
+        return 0;
+      }
+      strcpy(uri, content);
     }
 
     int stat = parse_uri(uri,hostname,pathname,port); //get hostname and pathname from uri
     if(stat!=0){ //returns -1 if problem
       clienterror(fd, uri, "505", "??????",".....");
-      return NULL;
+      return 0;
+    }
+    if (key_normalize(uri, key, sizeof(key)) < 0) //cache key
+      strcpy(key, uri);
+    timing_mark(timing, PH_PARSE);
+
+    if ((bytesRead = serve_cached(fd, key, &req)) >= 0) {
+      timing_mark(timing, PH_TRANSFER);
+      return finish_request(fd, uri, hostname, bytesRead, timing, NULL);
     }
+    if ((bytesRead = fetch_via_peer(fd, uri, hostname, key, &req, timing)) >= 0)
+      return finish_request(fd, uri, hostname, bytesRead, timing, "peer");
 
     char newRequest[MAXBUF];
     char *v = "HTTP/1.0";
@@ -204,90 +1156,544 @@ void *fetch(void *thread_fd){
                        "Proxy-Connection: close\r\n\r\n",
                        method,pathname,v,hostname,user_agent_hdr);
 
+    if (!upstream_admit()) {
+      overload_reject(fd, SHED_UPSTREAM);
+      return 0;
+    }
+    if ((why = neg_check(hostname, port, &upid)) != NEG_NONE) { //known bad
+      upstream_done();
+      neg_reject(fd, why);
+      return finish_request(fd, uri, hostname, 0, timing, "negative");
+    }
+
     //now need to make connection with web server
-    clientfd = open_clientfd(hostname, port);
+    clientfd = open_upstream(hostname, port, timing);
+    if (clientfd < 0) {
+      upstream_done();
+      neg_done(upid, clientfd == -2 ? NEG_DNS : NEG_CONNECT);
+      clienterror(fd, hostname, "502", "Bad Gateway",
+                  "Proxy could not connect to the server");
+      return 0;
+    }
 
     rio_t rios;
     rio_writen(clientfd, newRequest, strlen(newRequest)); //send request
     rio_readinitb(&rios, clientfd);
-    int bytesRead = send_data(rios,fd,clientfd,newRequest);
+    bytesRead = send_data(&rios, fd, key, &req, timing);
+    Close(clientfd);
+    upstream_done();
+    neg_done(upid, neg_result(req.status));
+    if (req.status == 0 && req.timeout == DL_FIRST_BYTE)
+      clienterror(fd, hostname, "504", "Gateway Timeout",
+                  "Server did not answer in time");
 
-    logFile(getIpAddr(fd), hostname, bytesRead);
+    return finish_request(fd, uri, hostname, bytesRead, timing, NULL);
+}
 
-    Free(port);
-    Close(clientfd);
-    Close(fd);
-    return NULL;
+/*
+ * url_decode - decode %XX escapes and '+' of a query value in place
+ */
+static void url_decode(char *s)
+{
+    char *out = s;
+    unsigned int c;
+
+    for (; *s; s++)
+      if (*s == '%' && isxdigit((unsigned char)s[1]) &&
+          isxdigit((unsigned char)s[2]) && sscanf(s + 1, "%2x", &c) == 1) {
+        *out++ = c;
+        s += 2;
+      } else
+        *out++ = *s == '+' ? ' ' : *s;
+    *out = '\0';
 }
 
 /*
- * parse_uri - URI parser
- *
- * Given a URI from an HTTP proxy GET request (i.e., a URL), extract
- * the host name, path name, and port.  The memory for hostname and
- * pathname must already be allocated and should be at least MAXLINE
- * bytes. Return -1 if there are any problems.
+ * handle_admin - PURGE of a URL (a trailing '*' purges every URL
+ * starting with the rest), or the listing of the cache under
+ * CACHE_PATH?prefix=URL, for clients allowed by --purge-from
  */
-int parse_uri(char *uri, char *hostname, char *pathname, char *port)
+int handle_admin(int fd, char *method, char *uri, struct clientReq *req)
 {
-    char *hostbegin;
-    char *hostend;
-    char *pathbegin;
-    int len;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char url[MAXLINE], key[MAXLINE], variant[MAXLINE + 8], *q;
+    size_t len;
+    int prefix = 0;
 
-    if (strncasecmp(uri, "http://", 7) != 0) {
-        hostname[0] = '\0';
-        return -1;
+    if (getpeername(fd, (struct sockaddr *)&addr, &addrlen) < 0)
+      return 0;
+    if (addr.ss_family == AF_UNIX && h2_client) //an HTTP/2 stream
+      memcpy(&addr, h2_client, sizeof(addr));
+    if (!admin_allowed((struct sockaddr *)&addr)) {
+      admin_deny(fd);
+      return 0;
     }
 
-    /* Extract the host name */
-    hostbegin = uri + 7;
-    hostend = strpbrk(hostbegin, " :/\r\n\0");
-    len = hostend - hostbegin;
-    strncpy(hostname, hostbegin, len);
-    hostname[len] = '\0';
+    if (strcasecmp(method, "PURGE")) { //the listing
+      url[0] = '\0';
+      if ((q = strstr(uri, "?prefix=")) || (q = strstr(uri, "&prefix="))) {
+        snprintf(url, sizeof(url), "%.*s", (int)strcspn(q + 8, "&"), q + 8);
+        url_decode(url);
+      }
+      if (url[0] == '\0' || key_normalize(url, key, sizeof(key)) < 0)
+        strcpy(key, url);
+      admin_list(fd, key);
+      return 0;
+    }
 
-    /* Extract the port number */
-    if (*hostend == ':')
-        strcpy(port,(hostend + 1));
-    else
-        strcpy(port,"80");/* default */
+    if (uri[0] == '/') { //origin-form: the URL is on the Host
+      if (!req->host[0] ||
+          snprintf(url, sizeof(url), "http://%s%s", req->host, uri) >=
+          (int)sizeof(url)) {
+        clienterror(fd, uri, "400", "Bad Request",
+                    "Proxy needs an absolute URL or a Host to purge");
+        return 0;
+      }
+    } else
+      strcpy(url, uri);
+    len = strlen(url);
+    if (len > 0 && url[len - 1] == '*') {
+      url[len - 1] = '\0';
+      prefix = 1;
+    }
+    if (key_normalize(url, key, sizeof(key)) < 0)
+      strcpy(key, url);
+    variant_key(variant, key);
+    admin_purge(fd, key, prefix ? NULL : variant, prefix);
+    return 0;
+}
 
-    /* Extract the path */
-    pathbegin = strchr(hostbegin, '/');
-    if (pathbegin == NULL) {
-        pathname[0] = '\0';
+/*
+ * handle_connect - open a CONNECT tunnel to host:port and relay it in
+ * both directions until either side closes or it goes idle. Returns
+ * the bytes relayed.
+ */
+int handle_connect(int fd, rio_t *rioc, char *authority, req_timing_t *timing)
+{
+    char hostname[MAXLINE], port[20], note[MAXLINE];
+    char *ok = "HTTP/1.0 200 Connection established\r\n\r\n";
+    long early = 0, up, down;
+    int serverfd, why, upid;
+
+    if (parse_authority(authority, hostname, port) < 0) {
+      clienterror(fd, authority, "400", "Bad Request",
+                  "Proxy cannot parse the CONNECT target");
+      return 0;
     }
+    timing_mark(timing, PH_PARSE);
+
+    if ((why = neg_check(hostname, port, &upid)) != NEG_NONE) {
+      neg_reject(fd, why);
+      return finish_request(fd, authority, authority, 0, timing, "negative");
+    }
+    if ((serverfd = open_upstream(hostname, port, timing)) < 0) {
+      neg_done(upid, serverfd == -2 ? NEG_DNS : NEG_CONNECT);
+      clienterror(fd, authority, "502", "Bad Gateway",
+                  "Proxy could not connect to the server");
+      return 0;
+    }
+    neg_done(upid, NEG_NONE);
+    rio_writen(fd, ok, strlen(ok));
+
+    /* Bytes the client sent right behind its request (often the TLS
+       ClientHello) are already in rio's buffer */
+    if (rioc->rio_cnt > 0) {
+      early = rioc->rio_cnt;
+      rio_writen(serverfd, rioc->rio_bufptr, early);
+    }
+    why = tunnel_relay(fd, serverfd, tunnel_idle_ms, &up, &down);
+    Close(serverfd);
+    timing_mark(timing, PH_TRANSFER);
+
+    sprintf(note, "tunnel up=%ld down=%ld%s", up + early, down,
+            why == TUNNEL_IDLE ? " idle-timeout" :
+            why == TUNNEL_ERROR ? " error" : "");
+    return finish_request(fd, authority, authority, up + early + down, timing, note);
+}
+
+/*
+ * handle_reverse - reverse-proxy an origin-form request: route it to a
+ * backend pool by Host and path, serve it from the cache if possible,
+ * otherwise fetch it from a server the pool's policy picks. A server
+ * that refuses the connection is reported and the next one is tried.
+ * Returns the body bytes sent.
+ */
+int handle_reverse(int fd, char *path, struct clientReq *req,
+                   req_timing_t *timing)
+{
+    char url[MAXLINE], key[MAXLINE], newRequest[MAXBUF + MAXLINE], *ip;
+    backend_t *tried[MAX_BACKENDS], *b;
+    pool_t *pool;
+    int serverfd = -1, ntried = 0, bytesRead;
+    rio_t rios;
+
+    if ((pool = route_match(req->host, path)) == NULL) {
+      clienterror(fd, path, "404", "Not Found",
+                  "Proxy has no route for this request");
+      return 0;
+    }
+    timing_mark(timing, PH_PARSE);
+
+    req->no_prefetch = 1; //links would have to be routed like this page
+
+    /* Cache by the public URL, which does not depend on the server */
+    if (snprintf(url, sizeof(url), "http://%s%s",
+                 req->host[0] ? req->host : pool->name, path) >= (int)sizeof(url)) {
+      clienterror(fd, pool->name, "414", "URI Too Long",
+                  "Proxy cannot handle a URL this long");
+      return 0;
+    }
+    if (key_normalize(url, key, sizeof(key)) < 0)
+      strcpy(key, url);
+    if ((bytesRead = serve_cached(fd, key, req)) >= 0) {
+      timing_mark(timing, PH_TRANSFER);
+      return finish_request(fd, url, url, bytesRead, timing, NULL);
+    }
+    if ((bytesRead = fetch_via_peer(fd, path, req->host, key, req, timing)) >= 0) {
+      return finish_request(fd, url, url, bytesRead, timing, "peer");
+    }
+
+    if (!upstream_admit()) {
+      overload_reject(fd, SHED_UPSTREAM);
+      return 0;
+    }
+    while ((b = pool_pick(pool, key, tried, ntried)) != NULL) {
+      tried[ntried++] = b;
+      if ((serverfd = open_upstream(b->host, b->port, timing)) >= 0)
+        break;
+      pool_done(b, 0);
+    }
+    if (serverfd < 0) {
+      upstream_done();
+      clienterror(fd, pool->name, "502", "Bad Gateway",
+                  "Proxy could not connect to any backend");
+      return 0;
+    }
+
+    ip = getIpAddr(fd);
+    snprintf(newRequest, sizeof(newRequest), "GET %s HTTP/1.0\r\n"
+                        "Host: %s\r\n"
+                        "User-Agent: %s\r\n"
+                        "X-Forwarded-For: %s\r\n"
+                        "Connection: close\r\n\r\n",
+                        path, req->host[0] ? req->host : b->host,
+                        user_agent_hdr, ip ? ip : "unknown");
+    free(ip);
+    rio_writen(serverfd, newRequest, strlen(newRequest));
+    rio_readinitb(&rios, serverfd);
+    bytesRead = send_data(&rios, fd, key, req, timing);
+    Close(serverfd);
+    upstream_done();
+    pool_done(b, req->status > 0 && req->status < 500);
+    if (req->status == 0 && req->timeout == DL_FIRST_BYTE)
+      clienterror(fd, b->host, "504", "Gateway Timeout",
+                  "Backend did not answer in time");
+
+    return finish_request(fd, url, url, bytesRead, timing, NULL);
+}
+
+/*
+ * fetch_via_peer - on a cache miss for key, fetch it through the peer
+ * that owns it: GET target with the given Host, marked as a peer fetch
+ * so the peer serves it from its cache or the origin and never passes
+ * it on. Nothing is cached here; the owner keeps the copy. Returns the
+ * body bytes sent, or -1 if this proxy owns key or the peer failed
+ * before anything reached the client, so the caller goes to the origin.
+ */
+int fetch_via_peer(int fd, char *target, char *host, char *key,
+                   struct clientReq *req, req_timing_t *timing)
+{
+    char request[MAXBUF + MAXLINE];
+    int peer, peerfd, bytesRead;
+    rio_t rios;
+
+    if (req->from_peer || (peer = peer_owner(key)) < 0)
+      return -1;
+    if ((peerfd = peer_connect(peer, peer_timeout_ms)) < 0) {
+      peer_done(peer, 0);
+      return -1;
+    }
+    timing_mark(timing, PH_CONNECT);
+
+    snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n"
+                     "Host: %s\r\n"
+                     PEER_HEADER ": %s\r\n"
+                     "%s"
+                     "Connection: close\r\n\r\n",
+                     target, host, peer_name(-1),
+                     req->gzip_ok ? "Accept-Encoding: gzip\r\n" : "");
+    rio_writen(peerfd, request, strlen(request));
+    rio_readinitb(&rios, peerfd);
+    req->nostore = 1;
+    bytesRead = send_data(&rios, fd, key, req, timing);
+    req->nostore = 0;
+    Close(peerfd);
+
+    peer_done(peer, req->status != 0);
+    return req->status != 0 ? bytesRead : -1;
+}
+
+/*
+ * prefetch_url - prefetch worker callback: fetch url from its origin
+ * into the cache, discarding the response itself. Skipped when the
+ * upstream cap is reached, since client requests come first.
+ */
+void prefetch_url(char *url)
+{
+    char hostname[MAXLINE], pathname[MAXLINE], port[20], request[MAXBUF + MAXLINE];
+    struct clientReq req;
+    req_timing_t timing;
+    int serverfd, nullfd, upid;
+    rio_t rios;
+
+    if (parse_uri(url, hostname, pathname, port) < 0)
+      return;
+    if (snprintf(request, sizeof(request), "GET /%s HTTP/1.0\r\n"
+                 "Host: %s\r\n"
+                 "User-Agent: %s\r\n"
+                 "Connection: close\r\n\r\n",
+                 pathname, hostname, user_agent_hdr) >= (int)sizeof(request))
+      return; //too long to send whole: not worth a prefetch
+    if (!upstream_admit())
+      return;
+    if (neg_check(hostname, port, &upid) != NEG_NONE) {
+      upstream_done();
+      return;
+    }
+    timing_start(&timing, timing_now());
+    if ((serverfd = open_upstream(hostname, port, &timing)) < 0)
+      neg_done(upid, serverfd == -2 ? NEG_DNS : NEG_CONNECT);
     else {
-        pathbegin++;
-        strcpy(pathname, pathbegin);
+      if ((nullfd = open("/dev/null", O_WRONLY)) >= 0) {
+        rio_writen(serverfd, request, strlen(request));
+        rio_readinitb(&rios, serverfd);
+        memset(&req, 0, sizeof(req));
+        req.no_prefetch = 1;
+        send_data(&rios, nullfd, url, &req, &timing);
+        Close(nullfd);
+        neg_done(upid, neg_result(req.status));
+      }
+      Close(serverfd);
     }
+    upstream_done();
+}
 
-    return 0;
+/*
+ * finish_request - record the timing of a served request and log it,
+ * with an optional note appended to the log entry. Returns bytesRead.
+ */
+int finish_request(int fd, char *uri, char *hostname, int bytesRead,
+                   req_timing_t *timing, char *note)
+{
+    char breakdown[MAXLINE], extra[2 * MAXLINE];
+
+    timing_record(timing);
+    timing_format(timing, breakdown, sizeof(breakdown));
+    if (slow_request_ns && timing_total(timing) >= slow_request_ns)
+      fprintf(stderr, "slow request %s: %s\n", uri, breakdown);
+
+    if (note && log_timing)
+      sprintf(extra, "%s %s", note, breakdown);
+    else if (note || log_timing)
+      strcpy(extra, note ? note : breakdown);
+    logFile(getIpAddr(fd), hostname, bytesRead,
+            (note || log_timing) ? extra : NULL);
+    return bytesRead;
+}
+
+/*
+ * make_gzip_variant - build and cache the gzip variant of a cached
+ * identity object, so later gzip hits cost no CPU. Returns the variant
+ * (referenced) or NULL if there is nothing worth compressing.
+ */
+cache_obj_t *make_gzip_variant(char *uri, char *key)
+{
+    cache_obj_t *obj;
+    char value[MAXLINE], hdrs[MAXBUF];
+    struct capture gzbody = CAPTURE_INITIALIZER;
+    gz_t gz;
+    size_t n;
+    int i, ok = 1;
+
+    if ((obj = cache_lookup(uri)) == NULL)
+      return NULL;
+    if (obj->bodylen < GZIP_MIN_SIZE ||
+        http_header(obj->hdrs, "Content-Encoding", value, sizeof(value)) ||
+        !http_header(obj->hdrs, "Content-Type", value, sizeof(value)) ||
+        !gz_compressible(value) ||
+        gz_init(&gz, gzip_level, gz_to_capture, &gzbody) < 0) {
+      cache_release(obj);
+      return NULL;
+    }
+    for (i = 1; i < obj->niov && ok; i++) //block by block
+      ok = gz_write(&gz, obj->iov[i].iov_base, obj->iov[i].iov_len) == 0;
+    if (ok)
+      ok = gz_finish(&gz) == 0;
+    gz_end(&gz);
+    if (ok) {
+      n = gz_headers(obj->hdrs, hdrs, sizeof(hdrs), 1, gzbody.len);
+      cache_insertv(key, hdrs, n, gzbody.iov, gzbody.n, time(NULL),
+                    obj->expires);
+    }
+    capture_free(&gzbody);
+    cache_release(obj);
+    return ok ? cache_lookup(key) : NULL;
 }
 
 /*
- * format_log_entry - Create a formatted log entry in logstring. 
- * 
- * The inputs are the socket address of the requesting client
- * (sockaddr), the URI from the request (uri), and the size in bytes
- * of the response from the server (size).
+ * serve_cached - answer from the cache if possible. A client that
+ * accepts gzip gets the gzip variant when there is one (made from the
+ * identity copy on first use). Byte ranges are cut straight out of the
+ * cached identity copy. Returns the body bytes sent, or -1 on a cache
+ * miss.
  */
-void format_log_entry(char *logstring, char* ipaddr, char *uri, int size)
+int serve_cached(int fd, char *uri, struct clientReq *req)
 {
-    time_t now;
-    char time_str[MAXLINE];
+    char key[MAXLINE + 8];
+    cache_obj_t *obj = NULL;
+    byte_range_t r[MAX_RANGES];
+    int n, nr;
+
+    if (req->range.n && (obj = cache_lookup(uri)) != NULL &&
+        obj->status == 200 && //not a negative entry
+        range_if_match(req->if_range, obj->hdrs)) {
+      if ((nr = range_resolve(&req->range, obj->bodylen, r)) == 0) {
+        range_not_satisfiable(fd, obj->bodylen);
+        n = 0;
+      }
+      else
+        n = range_send(fd, obj->hdrs, obj->iov + 1, obj->niov - 1,
+                       obj->bodylen, r, nr);
+      cache_release(obj);
+      return n;
+    }
+
+    if (obj == NULL && req->gzip_ok) {
+      variant_key(key, uri);
+      if ((obj = cache_lookup(key)) == NULL)
+        obj = make_gzip_variant(uri, key);
+    }
+    if (obj == NULL && (obj = cache_lookup(uri)) == NULL)
+      return -1;
+
+    http_writev(fd, obj->iov, obj->niov, 0, obj->hdrlen + obj->bodylen);
+    n = obj->bodylen;
+    cache_release(obj);
+    return n;
+}
+
+/*
+ * open_upstream - open_clientfd() split into its getaddrinfo() and
+ * connect() halves so that DNS and connect time are charged to their
+ * own phases. Each connect() gets connect_timeout_ms. Returns a
+ * connected descriptor, -2 if the name does not resolve, or -1 if no
+ * address accepts the connection.
+ */
+int open_upstream(char *hostname, char *port, req_timing_t *timing)
+{
+    int clientfd = -1, rc;
+    struct addrinfo hints, *listp, *p;
+    deadline_t deadline = DEADLINE_INITIALIZER;
+
+    workers_blocking(1);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    rc = getaddrinfo(hostname, port, &hints, &listp);
+    timing_mark(timing, PH_DNS);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n",
+                hostname, port, gai_strerror(rc));
+        workers_blocking(0);
+        return -2;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        deadline_arm(&deadline, DL_CONNECT,
+                     deadline_ms(timing, connect_timeout_ms), clientfd, -1);
+        rc = connect(clientfd, p->ai_addr, p->ai_addrlen);
+        deadline_cancel(&deadline);
+        if (rc != -1 && !deadline_fired(&deadline))
+            break;
+        close(clientfd);
+        clientfd = -1;
+    }
+    freeaddrinfo(listp);
+    timing_mark(timing, PH_CONNECT);
+    workers_blocking(0);
+    return clientfd;
+}
+
+/*
+ * deadline_ms - ms (0 = no limit), cut down to what is left of the
+ * request's total deadline
+ */
+int deadline_ms(req_timing_t *timing, int ms)
+{
+    long left;
+
+    if (request_timeout_ms <= 0)
+        return ms;
+    left = request_timeout_ms - (long)((timing_now() - timing->start) / 1000000);
+    if (left < 1)
+        left = 1;
+    return ms > 0 && ms < left ? ms : left;
+}
+
+/*
+ * serve_stats - answer a request for STATS_PATH with the proxy's
+ * latency histograms and cache counters as plain text
+ */
+void serve_stats(int fd)
+{
+    char buf[MAXLINE], body[MAXBUF];
+    int len;
 
-    /* Get a formatted time string */
-    now = time(NULL);
-    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime(&now));
+    len = timing_report(body, sizeof(body));
+    if (len < (int)sizeof(body))
+        len += cache_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += numa_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += deadline_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += snapshot_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += pool_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += peer_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += neg_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += overload_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += ratelimit_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += prefetch_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += h2_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += listener_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += workers_report(body + len, sizeof(body) - len);
+    if (len < (int)sizeof(body))
+        len += admin_report(body + len, sizeof(body) - len);
+    if (len >= (int)sizeof(body))
+        len = sizeof(body) - 1;
 
-    //storing the formatted log entry string in logstring
-    sprintf(logstring, "%s %s %s %d\n", time_str, ipaddr, uri, size);
+    sprintf(buf, "HTTP/1.0 200 OK\r\n"
+                 "Content-type: text/plain\r\n"
+                 "Content-length: %d\r\n\r\n", len);
+    rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, body, len);
 }
 
 /*
- * clienterror - returns an error message to the client
+ * clienterror - returns an error message to the client (a client that
+ * has gone away, or was cut off by a deadline, is not an error)
  */
 /* $begin clienterror */
 void clienterror(int fd, char *cause, char *errnum,
@@ -304,11 +1710,11 @@ void clienterror(int fd, char *cause, char *errnum,
 
     /* Print the HTTP response */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, body, strlen(body));
 }
 /* $end clienterror */
@@ -0,0 +1,225 @@
+/*
+ * range.c - HTTP byte-range requests (Range, If-Range, 206 responses)
+ *
+ * Ranges are served from a response that is entirely in memory (a
+ * cached object or a just-completed fill), held as a list of pieces:
+ * one range becomes a plain 206 with Content-Range, several become
+ * multipart/byteranges.
+ */
+#include "csapp.h"
+#include "http.h"
+#include "range.h"
+
+/*
+ * range_parse - parse a Range header value ("bytes=0-99,500-,-200").
+ * Returns 0 and fills rr, or -1 (rr->n = 0) if the header must be
+ * ignored because it is malformed or not in bytes.
+ */
+int range_parse(const char *value, range_req_t *rr)
+{
+    const char *p = value;
+    char *end;
+    range_spec_t *s;
+
+    rr->n = 0;
+    p += strspn(p, " \t");
+    if (strncasecmp(p, "bytes=", 6))
+        return -1;
+    p += 6;
+    while (*p && *p != '\r' && *p != '\n') {
+        p += strspn(p, " \t,");
+        if (!*p || *p == '\r' || *p == '\n')
+            break;
+        if (rr->n == MAX_RANGES)
+            goto bad;
+        s = &rr->spec[rr->n];
+        if (*p == '-') {                        /* suffix: -N */
+            s->first = -1;
+            s->last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || s->last < 0)
+                goto bad;
+        } else {
+            s->first = strtol(p, &end, 10);
+            if (end == p || *end != '-' || s->first < 0)
+                goto bad;
+            p = end + 1;
+            if (isdigit((unsigned char)*p)) {
+                s->last = strtol(p, &end, 10);
+                if (s->last < s->first)
+                    goto bad;
+            } else {
+                s->last = -1;
+                end = (char *)p;
+            }
+        }
+        p = end;
+        p += strspn(p, " \t");
+        if (*p && *p != ',' && *p != '\r' && *p != '\n')
+            goto bad;
+        rr->n++;
+    }
+    return rr->n ? 0 : -1;
+
+ bad:
+    rr->n = 0;
+    return -1;
+}
+
+/*
+ * range_resolve - turn the requested ranges into concrete byte ranges of
+ * a len-byte body. Returns how many are satisfiable (0 means 416).
+ */
+int range_resolve(range_req_t *rr, long len, byte_range_t *out)
+{
+    int i, n = 0;
+    range_spec_t *s;
+
+    for (i = 0; i < rr->n; i++) {
+        s = &rr->spec[i];
+        if (s->first < 0) {
+            if (s->last == 0 || len == 0)
+                continue;
+            out[n].first = s->last >= len ? 0 : len - s->last;
+            out[n].last = len - 1;
+        } else {
+            if (s->first >= len)
+                continue;
+            out[n].first = s->first;
+            out[n].last = (s->last < 0 || s->last >= len) ? len - 1 : s->last;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * range_if_match - may a range be served given an If-Range value and
+ * the response headers? A strong ETag or an exact Last-Modified date
+ * must match; otherwise the whole object is sent.
+ */
+int range_if_match(const char *if_range, const char *hdrs)
+{
+    char value[MAXLINE];
+
+    if (if_range == NULL || !*if_range)
+        return 1;
+    if (!strncmp(if_range, "W/", 2))
+        return 0;
+    if (*if_range == '"')
+        return http_header(hdrs, "ETag", value, sizeof(value)) &&
+               strncmp(value, "W/", 2) && !strcmp(value, if_range);
+    return http_header(hdrs, "Last-Modified", value, sizeof(value)) &&
+           !strcmp(value, if_range);
+}
+
+/*
+ * part_header - the boundary and headers that open one multipart part
+ */
+static int part_header(char *buf, size_t size, const char *ctype,
+                       byte_range_t *r, long len)
+{
+    return snprintf(buf, size, "\r\n--" RANGE_BOUNDARY "\r\n%s%s%s"
+                    "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                    ctype ? "Content-Type: " : "", ctype ? ctype : "",
+                    ctype ? "\r\n" : "", r->first, r->last, len);
+}
+
+#define PART_TRAILER "\r\n--" RANGE_BOUNDARY "--\r\n"
+
+/*
+ * range_headers - build the 206 header block for ranges r[0..n-1] of a
+ * len-byte body whose 200 headers are hdrs. Returns its length.
+ */
+size_t range_headers(const char *hdrs, char *out, size_t outlen,
+                     byte_range_t *r, int n, long len)
+{
+    char ctype[MAXLINE], part[MAXLINE];
+    const char *line, *eol;
+    size_t o = 0, l;
+    long clen = 0;
+    int i, has_type;
+
+    has_type = http_header(hdrs, "Content-Type", ctype, sizeof(ctype));
+    o += snprintf(out + o, outlen - o, "HTTP/1.0 206 Partial Content\r\n");
+
+    /* Copy the headers that still apply, skipping the status line */
+    line = strchr(hdrs, '\n');
+    line = line ? line + 1 : hdrs + strlen(hdrs);
+    while (*line && *line != '\r' && *line != '\n' && o < outlen) {
+        eol = strchr(line, '\n');
+        l = eol ? (size_t)(eol - line + 1) : strlen(line);
+        if (strncasecmp(line, "Content-Length:", 15) &&
+            strncasecmp(line, "Content-Range:", 14) &&
+            (n == 1 || strncasecmp(line, "Content-Type:", 13)))
+            o += snprintf(out + o, outlen - o, "%.*s", (int)l, line);
+        line += l;
+    }
+    if (o >= outlen)
+        return outlen - 1;
+
+    if (n == 1)
+        o += snprintf(out + o, outlen - o,
+                      "Content-Range: bytes %ld-%ld/%ld\r\n"
+                      "Content-Length: %ld\r\n\r\n",
+                      r[0].first, r[0].last, len, r[0].last - r[0].first + 1);
+    else {
+        for (i = 0; i < n; i++)
+            clen += part_header(part, sizeof(part), has_type ? ctype : NULL,
+                                &r[i], len) + r[i].last - r[i].first + 1;
+        clen += strlen(PART_TRAILER);
+        o += snprintf(out + o, outlen - o,
+                      "Content-Type: multipart/byteranges; boundary="
+                      RANGE_BOUNDARY "\r\nContent-Length: %ld\r\n\r\n", clen);
+    }
+    return o < outlen ? o : outlen - 1;
+}
+
+/*
+ * range_send - send a 206 response for ranges r[0..n-1] of an in-memory
+ * body of len bytes in the nbody pieces of body. Returns the number of
+ * body bytes sent.
+ */
+long range_send(int fd, const char *hdrs, const struct iovec *body,
+                int nbody, long len, byte_range_t *r, int n)
+{
+    char out[MAXBUF], ctype[MAXLINE];
+    long sent = 0;
+    size_t hlen;
+    int i, has_type, plen;
+
+    hlen = range_headers(hdrs, out, sizeof(out), r, n, len);
+    if (rio_writen(fd, out, hlen) < 0)
+        return 0;
+    if (n == 1) {
+        if (http_writev(fd, body, nbody, r[0].first,
+                        r[0].last - r[0].first + 1) < 0)
+            return 0;
+        return r[0].last - r[0].first + 1;
+    }
+
+    has_type = http_header(hdrs, "Content-Type", ctype, sizeof(ctype));
+    for (i = 0; i < n; i++) {
+        plen = part_header(out, sizeof(out), has_type ? ctype : NULL, &r[i], len);
+        if (rio_writen(fd, out, plen) < 0 ||
+            http_writev(fd, body, nbody, r[i].first,
+                        r[i].last - r[i].first + 1) < 0)
+            return sent;
+        sent += plen + r[i].last - r[i].first + 1;
+    }
+    if (rio_writen(fd, PART_TRAILER, strlen(PART_TRAILER)) >= 0)
+        sent += strlen(PART_TRAILER);
+    return sent;
+}
+
+/*
+ * range_not_satisfiable - answer 416 for a len-byte object
+ */
+void range_not_satisfiable(int fd, long len)
+{
+    char buf[MAXLINE];
+
+    sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                 "Content-Range: bytes */%ld\r\n"
+                 "Content-Length: 0\r\n\r\n", len);
+    rio_writen(fd, buf, strlen(buf));
+}
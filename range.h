@@ -0,0 +1,38 @@
+/*
+ * range.h - HTTP byte-range requests (Range, If-Range, 206 responses)
+ */
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define MAX_RANGES 16
+#define RANGE_BOUNDARY "3d6b6a416f9b5f1a"
+
+/* One byte-range-spec as written by the client */
+typedef struct {
+    long first;   /* -1 for a suffix range ("-N") */
+    long last;    /* -1 for an open range ("N-"); N for a suffix range */
+} range_spec_t;
+
+typedef struct {
+    int n;                          /* 0 = no usable Range header */
+    range_spec_t spec[MAX_RANGES];
+} range_req_t;
+
+/* A range resolved against a known length: bytes first..last inclusive */
+typedef struct {
+    long first, last;
+} byte_range_t;
+
+int range_parse(const char *value, range_req_t *rr);
+int range_resolve(range_req_t *rr, long len, byte_range_t *out);
+int range_if_match(const char *if_range, const char *hdrs);
+size_t range_headers(const char *hdrs, char *out, size_t outlen,
+                     byte_range_t *r, int n, long len);
+long range_send(int fd, const char *hdrs, const struct iovec *body,
+                int nbody, long len, byte_range_t *r, int n);
+void range_not_satisfiable(int fd, long len);
+
+#endif /* __RANGE_H__ */
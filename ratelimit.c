@@ -0,0 +1,335 @@
+/*
+ * ratelimit.c - Per-client token-bucket rate limiting
+ *
+ * Limits are given per CIDR block as requests/s and bytes/s; a client
+ * gets the limit of the longest matching block. Each client address
+ * has a request bucket and a byte bucket, both holding up to one
+ * second's worth of tokens and refilled lazily on use. Requests take a
+ * request token up front; bytes are charged once the response is sent,
+ * so a client in byte debt is refused until the refill covers it.
+ *
+ * Buckets live in a fixed open-addressing table keyed by a hash of the
+ * address. Slots are claimed with compare-and-swap and all counters
+ * are atomics, so the check takes no locks: one hash, a short probe
+ * and a few atomic operations. The longest-prefix match is done once,
+ * when a bucket is set up. A slot idle for RL_IDLE_SECS can be taken
+ * over by a new address; if every slot in an address's probe window is
+ * busy, the request is let through and counted.
+ */
+#include "csapp.h"
+#include "ratelimit.h"
+
+typedef struct {
+    unsigned char net[16];     /* IPv6, or IPv4-mapped IPv6 */
+    int plen;
+    double reqs_per_ns, bytes_per_ns;   /* In token units */
+    int64_t req_burst, byte_burst;
+    unsigned long limited;
+    char spec[64];
+} rl_rule_t;
+
+static rl_rule_t rules[RL_RULES];      /* Longest prefix first */
+static int nrules = 0;
+static rl_bucket_t table[RL_SLOTS];
+static unsigned long table_full = 0;
+
+/* Sent as is to every client over its limit */
+static const char reply_429[] =
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 18\r\n"
+    "Connection: close\r\n\r\n"
+    "Too many requests\n";
+
+/*
+ * addr16 - the client address as 16 bytes (IPv4 mapped into IPv6)
+ */
+static void addr16(const struct sockaddr *sa, unsigned char *a)
+{
+    memset(a, 0, 16);
+    if (sa->sa_family == AF_INET6)
+        memcpy(a, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+    else {
+        a[10] = a[11] = 0xff;
+        memcpy(a + 12, &((struct sockaddr_in *)sa)->sin_addr, 4);
+    }
+}
+
+static int prefix_match(const unsigned char *a, const unsigned char *net, int plen)
+{
+    int i;
+
+    for (i = 0; plen >= 8; i++, plen -= 8)
+        if (a[i] != net[i])
+            return 0;
+    return plen == 0 || ((a[i] ^ net[i]) & (0xff << (8 - plen))) == 0;
+}
+
+/*
+ * cidr_parse - parse "ADDR[/LEN]" (IPv4 or IPv6) into a 16-byte network
+ * (IPv4 mapped into IPv6) and its prefix length over those 16 bytes
+ */
+int cidr_parse(const char *s, unsigned char *net, int *plen)
+{
+    char addr[64], *slash;
+    int i, maxlen;
+
+    if (strlen(s) >= sizeof(addr))
+        return -1;
+    strcpy(addr, s);
+    memset(net, 0, 16);
+    if ((slash = strchr(addr, '/')) != NULL)
+        *slash = '\0';
+    if (inet_pton(AF_INET, addr, net + 12) == 1) {
+        net[10] = net[11] = 0xff;
+        maxlen = 32;
+    } else if (inet_pton(AF_INET6, addr, net) == 1)
+        maxlen = 128;
+    else
+        return -1;
+    *plen = slash ? atoi(slash + 1) : maxlen;
+    if (*plen < 0 || *plen > maxlen)
+        return -1;
+    *plen += 128 - maxlen;
+    for (i = 0; i < 16; i++)        /* Clear the host bits */
+        if (i * 8 >= *plen)
+            net[i] = 0;
+        else if (i * 8 + 8 > *plen)
+            net[i] &= 0xff << (8 - (*plen - i * 8));
+    return 0;
+}
+
+/*
+ * cidr_match - is the address in sa within the network from cidr_parse()
+ */
+int cidr_match(const struct sockaddr *sa, const unsigned char *net, int plen)
+{
+    unsigned char a[16];
+
+    addr16(sa, a);
+    return prefix_match(a, net, plen);
+}
+
+/*
+ * ratelimit_rule - add a limit from "CIDR=REQS[,BYTES]" (per second,
+ * 0 = unlimited), e.g. "10.0.0.0/8=100,1000000" or "::/0=20"
+ */
+int ratelimit_rule(char *spec)
+{
+    char addr[64], *eq = strchr(spec, '='), *end;
+    rl_rule_t r, tmp;
+    double reqs, bytes = 0;
+    int i;
+
+    memset(&r, 0, sizeof(r));
+    if (eq == NULL || (size_t)(eq - spec) >= sizeof(addr) || nrules == RL_RULES)
+        return -1;
+    memcpy(addr, spec, eq - spec);
+    addr[eq - spec] = '\0';
+    reqs = strtod(eq + 1, &end);
+    if (*end == ',')
+        bytes = strtod(end + 1, &end);
+    if (*end || reqs < 0 || bytes < 0)
+        return -1;
+
+    if (cidr_parse(addr, r.net, &r.plen) < 0)
+        return -1;
+
+    r.reqs_per_ns = reqs * RL_SCALE / 1e9;
+    r.bytes_per_ns = bytes * RL_SCALE / 1e9;
+    r.req_burst = reqs > 1 ? (int64_t)(reqs * RL_SCALE) : RL_SCALE;
+    r.byte_burst = (int64_t)(bytes * RL_SCALE);
+    snprintf(r.spec, sizeof(r.spec), "%.*s", (int)(eq - spec), spec);
+
+    /* Keep the list sorted longest prefix first */
+    rules[nrules++] = r;
+    for (i = nrules - 1; i > 0 && rules[i - 1].plen < rules[i].plen; i--) {
+        tmp = rules[i];
+        rules[i] = rules[i - 1];
+        rules[i - 1] = tmp;
+    }
+    return 0;
+}
+
+int ratelimit_enabled(void)
+{
+    return nrules > 0;
+}
+
+static uint64_t addr_hash(const unsigned char *a)
+{
+    uint64_t x, y;
+
+    memcpy(&x, a, 8);
+    memcpy(&y, a + 8, 8);
+    x ^= y * 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (x << 1) ? (x << 1) : 2;  /* Even and nonzero: see rl_bucket_t */
+}
+
+/*
+ * setup - fill in a freshly claimed slot and publish it under tag
+ */
+static void setup(rl_bucket_t *b, const unsigned char *a, uint64_t tag,
+                  uint64_t now)
+{
+    int i;
+
+    b->rule = -1;
+    for (i = 0; i < nrules; i++)
+        if (prefix_match(a, rules[i].net, rules[i].plen)) {
+            b->rule = i;
+            break;
+        }
+    b->reqs = b->rule >= 0 ? rules[b->rule].req_burst : 0;
+    b->bytes = b->rule >= 0 ? rules[b->rule].byte_burst : 0;
+    b->last = now;
+    __atomic_store_n(&b->tag, tag, __ATOMIC_RELEASE);
+}
+
+/*
+ * find - the bucket for an address, claiming a slot if it has none.
+ * NULL if it is still being set up or the probe window is full.
+ */
+static rl_bucket_t *find(const unsigned char *a, uint64_t now)
+{
+    uint64_t h = addr_hash(a), t, idle = (uint64_t)RL_IDLE_SECS * 1000000000ULL;
+    rl_bucket_t *b;
+    int i;
+
+    for (i = 0; i < RL_PROBE; i++) {
+        b = &table[(h + i) & (RL_SLOTS - 1)];
+        t = __atomic_load_n(&b->tag, __ATOMIC_ACQUIRE);
+        if (t == h)
+            return b;
+        if (t == (h | 1))
+            return NULL;
+        if (t == 0 || (!(t & 1) && now > __atomic_load_n(&b->last,
+                                   __ATOMIC_RELAXED) + idle)) {
+            if (__atomic_compare_exchange_n(&b->tag, &t, h | 1, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                setup(b, a, h, now);
+                return b;
+            }
+            if (t == h)
+                return b;
+        }
+    }
+    __atomic_fetch_add(&table_full, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * add_tokens - add n tokens, but hold no more than burst
+ */
+static void add_tokens(int64_t *tokens, int64_t n, int64_t burst)
+{
+    int64_t v = __atomic_add_fetch(tokens, n, __ATOMIC_RELAXED);
+
+    while (v > burst &&
+           !__atomic_compare_exchange_n(tokens, &v, burst, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * refill - add the tokens earned since the last refill
+ */
+static void refill(rl_bucket_t *b, rl_rule_t *r, uint64_t now)
+{
+    uint64_t last = __atomic_load_n(&b->last, __ATOMIC_RELAXED), dt;
+
+    if (now <= last ||
+        !__atomic_compare_exchange_n(&b->last, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;             /* Someone else refilled for this interval */
+    dt = now - last;
+    if (dt > 3600000000000ULL)
+        dt = 3600000000000ULL;  /* Keeps the products below in range */
+    if (r->reqs_per_ns > 0)
+        add_tokens(&b->reqs, (int64_t)(dt * r->reqs_per_ns), r->req_burst);
+    if (r->bytes_per_ns > 0)
+        add_tokens(&b->bytes, (int64_t)(dt * r->bytes_per_ns), r->byte_burst);
+}
+
+/*
+ * ratelimit_admit - may the client at sa make a request now? *bp is set
+ * to its bucket (NULL if unlimited) for ratelimit_charge().
+ */
+int ratelimit_admit(const struct sockaddr *sa, uint64_t now, rl_bucket_t **bp)
+{
+    unsigned char a[16];
+    rl_bucket_t *b;
+    rl_rule_t *r;
+
+    *bp = NULL;
+    if (nrules == 0)
+        return 1;
+    addr16(sa, a);
+    if ((b = find(a, now)) == NULL || b->rule < 0)
+        return 1;
+    r = &rules[b->rule];
+    refill(b, r, now);
+
+    if (r->reqs_per_ns > 0 &&
+        __atomic_sub_fetch(&b->reqs, RL_SCALE, __ATOMIC_RELAXED) < 0) {
+        __atomic_add_fetch(&b->reqs, RL_SCALE, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&r->limited, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (r->bytes_per_ns > 0 && __atomic_load_n(&b->bytes, __ATOMIC_RELAXED) < 0) {
+        if (r->reqs_per_ns > 0)
+            __atomic_add_fetch(&b->reqs, RL_SCALE, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&r->limited, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *bp = b;
+    return 1;
+}
+
+/*
+ * ratelimit_charge - take the bytes a response used from the client's
+ * byte bucket
+ */
+void ratelimit_charge(rl_bucket_t *b, long bytes)
+{
+    int rule = b ? __atomic_load_n(&b->rule, __ATOMIC_RELAXED) : -1;
+
+    /* The slot may have been reused for another client meanwhile; the
+       charge then lands there, which is harmless */
+    if (rule >= 0 && bytes > 0 && rules[rule].bytes_per_ns > 0)
+        __atomic_sub_fetch(&b->bytes, (int64_t)bytes * RL_SCALE, __ATOMIC_RELAXED);
+}
+
+/*
+ * ratelimit_reject - send the canned 429; the caller closes fd
+ */
+void ratelimit_reject(int fd)
+{
+    send(fd, reply_429, sizeof(reply_429) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * ratelimit_report - render the limits and their refusals as text
+ */
+int ratelimit_report(char *buf, size_t len)
+{
+    int i, used = 0, n = 0;
+
+    if (nrules == 0)
+        return 0;
+    for (i = 0; i < RL_SLOTS; i++)
+        if (table[i].tag)
+            used++;
+    n = snprintf(buf, len, "ratelimit clients=%d/%d table-full=%lu\n",
+                 used, RL_SLOTS, table_full);
+    for (i = 0; i < nrules && (size_t)n < len; i++)
+        n += snprintf(buf + n, len - n, "  limit   %s reqs/s=%.0f bytes/s=%.0f "
+                      "limited=%lu\n", rules[i].spec,
+                      rules[i].reqs_per_ns * 1e9 / RL_SCALE,
+                      rules[i].bytes_per_ns * 1e9 / RL_SCALE, rules[i].limited);
+    return n;
+}
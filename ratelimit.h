@@ -0,0 +1,35 @@
+/*
+ * ratelimit.h - Per-client token-bucket rate limiting
+ */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define RL_RULES  64
+#define RL_SLOTS  65536        /* Bucket table size (power of 2) */
+#define RL_PROBE  8            /* Slots searched per address */
+#define RL_IDLE_SECS 60        /* An idle bucket may be reused after this */
+#define RL_SCALE  1000         /* Token units per request / per byte */
+
+/* One client's buckets; fields are updated with atomics */
+typedef struct {
+    uint64_t tag;              /* Address hash; 0 = free, odd = being set up */
+    uint64_t last;             /* Last refill (timing_now() ns) */
+    int64_t reqs;              /* Request tokens */
+    int64_t bytes;             /* Byte tokens, negative = in debt */
+    int rule;                  /* Matching limit, -1 = unlimited */
+} rl_bucket_t;
+
+int cidr_parse(const char *s, unsigned char *net, int *plen);
+int cidr_match(const struct sockaddr *sa, const unsigned char *net, int plen);
+int ratelimit_rule(char *spec);
+int ratelimit_enabled(void);
+int ratelimit_admit(const struct sockaddr *sa, uint64_t now, rl_bucket_t **bp);
+void ratelimit_charge(rl_bucket_t *b, long bytes);
+void ratelimit_reject(int fd);
+int ratelimit_report(char *buf, size_t len);
+
+#endif /* __RATELIMIT_H__ */
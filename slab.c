@@ -0,0 +1,248 @@
+/*
+ * slab.c - Size-class slab allocator for cached objects
+ *
+ * Cached objects are stored in chunks carved from fixed-size pages of
+ * one region reserved at startup (one per cache shard, on its node),
+ * instead of with malloc: the memory the cache can hold is exactly the
+ * page budget, and evictions leave reusable chunks behind rather than
+ * holes in the heap. Chunk sizes grow by SLAB_GROWTH from
+ * SLAB_MIN_CHUNK up to the page size, and each page serves one class.
+ * Pages are handed to classes on first use until the budget is spent.
+ *
+ * After that a class can only grow by taking a page from another one.
+ * A class without pages, or starved (the caller has nothing of the
+ * class left to evict), takes one from the class holding the most; a
+ * class that has had to evict SLAB_MOVE_EVICTIONS times within a
+ * window takes one from the largest class that has not evicted at
+ * all. The page's objects are evicted by the cache, and once the last
+ * reference to them is dropped the page is carved for its new class.
+ */
+#include "csapp.h"
+#include <sys/mman.h>
+#include "numa.h"
+#include "slab.h"
+
+#define SLAB_WINDOW_SECS 10         /* Eviction counts start over this often */
+
+/*
+ * slab_init - reserve budget bytes of pages big enough for a chunk of
+ * max_chunk bytes on NUMA node node, and set up the classes
+ */
+void slab_init(slab_t *s, size_t budget, size_t max_chunk, int node)
+{
+    size_t size = SLAB_MIN_CHUNK;
+
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    s->node = node;
+    for (s->page_size = SLAB_MIN_PAGE; s->page_size < max_chunk; s->page_size *= 2)
+        ;
+    s->max_pages = budget / s->page_size > 0 ? budget / s->page_size : 1;
+    if ((s->region = numa_alloc((size_t)s->max_pages * s->page_size, node)) == NULL)
+        unix_error("slab_init: mmap");
+    s->pages = Malloc(s->max_pages * sizeof(struct slab_page));
+
+    while (size < s->page_size && s->nclasses < SLAB_MAX_CLASSES - 1) {
+        s->classes[s->nclasses++].size = size;
+        size = ((size_t)(size * SLAB_GROWTH) + 7) & ~(size_t)7;
+    }
+    s->classes[s->nclasses++].size = s->page_size;
+}
+
+/*
+ * slab_class - the smallest class whose chunks hold size bytes, or -1
+ */
+int slab_class(slab_t *s, size_t size)
+{
+    int lo = 0, hi = s->nclasses - 1, mid;
+
+    if (size > s->page_size)
+        return -1;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (s->classes[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t slab_chunk_size(slab_t *s, int cls)
+{
+    return s->classes[cls].size;
+}
+
+int slab_page(slab_t *s, const void *chunk)
+{
+    return ((const char *)chunk - s->region) / s->page_size;
+}
+
+/*
+ * carve - give page pg to class cls and put its chunks on the free list.
+ * Caller holds s->lock.
+ */
+static void carve(slab_t *s, int pg, int cls)
+{
+    struct slab_class *c = &s->classes[cls];
+    char *p = s->region + (size_t)pg * s->page_size;
+    int i, n = s->page_size / c->size;
+
+    s->pages[pg].cls = cls;
+    s->pages[pg].live = 0;
+    s->pages[pg].target = -1;
+    for (i = n - 1; i >= 0; i--) {
+        *(void **)(p + i * c->size) = c->free;
+        c->free = p + i * c->size;
+    }
+    c->nfree += n;
+    c->pages++;
+}
+
+/*
+ * slab_alloc - a chunk of class cls, or NULL if the class has none free
+ * and the page budget is spent
+ */
+void *slab_alloc(slab_t *s, int cls)
+{
+    struct slab_class *c = &s->classes[cls];
+    void *p;
+
+    pthread_mutex_lock(&s->lock);
+    if (c->free == NULL && s->carved < s->max_pages)
+        carve(s, s->carved++, cls);
+    if ((p = c->free) != NULL) {
+        c->free = *(void **)p;
+        c->nfree--;
+        c->used++;
+        s->pages[slab_page(s, p)].live++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return p;
+}
+
+/*
+ * slab_free - return a chunk; the last one out of a moving page hands
+ * the page to its new class
+ */
+void slab_free(slab_t *s, void *chunk)
+{
+    struct slab_page *pg = &s->pages[slab_page(s, chunk)];
+    struct slab_class *c;
+
+    pthread_mutex_lock(&s->lock);
+    c = &s->classes[pg->cls];
+    c->used--;
+    pg->live--;
+    if (pg->target < 0) {
+        *(void **)chunk = c->free;
+        c->free = chunk;
+        c->nfree++;
+    } else if (pg->live == 0) {
+        c->pages--;
+        carve(s, pg - s->pages, pg->target);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * pick_page - the page of class donor that is cheapest to empty
+ */
+static int pick_page(slab_t *s, int donor)
+{
+    int i, best = -1;
+
+    for (i = 0; i < s->carved; i++)
+        if (s->pages[i].cls == donor && s->pages[i].target < 0 &&
+            (best < 0 || s->pages[i].live < s->pages[best].live))
+            best = i;
+    return best;
+}
+
+/*
+ * move_page - start moving page pg to class cls: its free chunks leave
+ * the old class's list, and it is carved once its live chunks are freed
+ */
+static void move_page(slab_t *s, int pg, int cls)
+{
+    struct slab_class *c = &s->classes[s->pages[pg].cls];
+    char *lo = s->region + (size_t)pg * s->page_size, *hi = lo + s->page_size;
+    void **pp = &c->free;
+
+    while (*pp)
+        if ((char *)*pp >= lo && (char *)*pp < hi) {
+            *pp = *(void **)*pp;
+            c->nfree--;
+        } else
+            pp = (void **)*pp;
+    s->pages[pg].target = cls;
+    if (s->pages[pg].live == 0) {
+        c->pages--;
+        carve(s, pg, cls);
+    }
+    s->moves++;
+}
+
+/*
+ * slab_rebalance - class cls is out of chunks and the budget is spent;
+ * starved if none of its chunks can be evicted. Returns a page that is
+ * being moved to cls, whose objects the caller must evict; -1 if the
+ * caller should evict from cls itself; -2 if a page is already on its
+ * way to cls.
+ */
+int slab_rebalance(slab_t *s, int cls, int starved)
+{
+    struct slab_class *c = &s->classes[cls];
+    time_t now = time(NULL);
+    int i, donor = -1, need, pg = -1;
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < s->carved; i++)
+        if (s->pages[i].target == cls) {
+            pthread_mutex_unlock(&s->lock);
+            return -2;
+        }
+    if (now - s->window_start >= SLAB_WINDOW_SECS) {
+        for (i = 0; i < s->nclasses; i++)
+            s->classes[i].window = 0;
+        s->window_start = now;
+    }
+
+    need = (c->pages == 0 || starved) ? 1 :
+           c->window >= SLAB_MOVE_EVICTIONS ? 2 : 0;
+    for (i = 0; need && i < s->nclasses; i++)
+        if (i != cls && s->classes[i].pages >= need &&
+            (need == 1 || s->classes[i].window == 0) &&
+            (donor < 0 || s->classes[i].pages > s->classes[donor].pages))
+            donor = i;
+    if (donor >= 0 && (pg = pick_page(s, donor)) >= 0) {
+        move_page(s, pg, cls);
+        for (i = 0; i < s->nclasses; i++)
+            s->classes[i].window = 0;
+    } else {
+        c->evictions++;
+        c->window++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return pg >= 0 ? pg : -1;
+}
+
+/*
+ * slab_report - render the page budget and the classes in use as text
+ */
+int slab_report(slab_t *s, char *buf, size_t len)
+{
+    int i, n;
+
+    pthread_mutex_lock(&s->lock);
+    n = snprintf(buf, len, "slab      node=%d page=%zuK pages=%d/%d moves=%lu\n",
+                 s->node, s->page_size / 1024, s->carved, s->max_pages, s->moves);
+    for (i = 0; i < s->nclasses && (size_t)n < len; i++)
+        if (s->classes[i].pages || s->classes[i].evictions)
+            n += snprintf(buf + n, len - n, "  class   %zu pages=%d used=%d "
+                          "free=%d evictions=%lu\n", s->classes[i].size,
+                          s->classes[i].pages, s->classes[i].used,
+                          s->classes[i].nfree, s->classes[i].evictions);
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
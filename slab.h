@@ -0,0 +1,51 @@
+/*
+ * slab.h - Size-class slab allocator for cached objects
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SLAB_MIN_PAGE (64 * 1024)   /* Pages are a power of 2, at least this */
+#define SLAB_MIN_CHUNK 128
+#define SLAB_GROWTH 1.25            /* Ratio between class chunk sizes */
+#define SLAB_MAX_CLASSES 64
+#define SLAB_MOVE_EVICTIONS 8       /* Evictions before a class may take a page */
+
+struct slab_page {
+    int cls;                        /* Class it is carved for */
+    int live;                       /* Chunks handed out */
+    int target;                     /* Class it moves to once empty, or -1 */
+};
+
+struct slab_class {
+    size_t size;
+    int pages, used, nfree;
+    void *free;                     /* Free chunks, linked through their first word */
+    unsigned long evictions, window;
+};
+
+/* One region of pages and its classes, under one lock */
+typedef struct {
+    pthread_mutex_t lock;
+    char *region;
+    size_t page_size;
+    struct slab_page *pages;
+    int max_pages, carved, nclasses, node;
+    struct slab_class classes[SLAB_MAX_CLASSES];
+    unsigned long moves;
+    time_t window_start;
+} slab_t;
+
+void slab_init(slab_t *s, size_t budget, size_t max_chunk, int node);
+int slab_class(slab_t *s, size_t size);
+size_t slab_chunk_size(slab_t *s, int cls);
+void *slab_alloc(slab_t *s, int cls);
+void slab_free(slab_t *s, void *chunk);
+int slab_page(slab_t *s, const void *chunk);
+int slab_rebalance(slab_t *s, int cls, int starved);
+int slab_report(slab_t *s, char *buf, size_t len);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,230 @@
+/*
+ * snapshot.c - Cache snapshots for warm restarts
+ *
+ * The cache can be written to a snapshot file on shutdown and every
+ * interval seconds, and loaded back at startup so a restarted proxy
+ * serves hits right away instead of sending a miss storm to the
+ * origins. The file is an index of entries (hottest first) followed by
+ * the keys, headers and bodies, under a versioned header with a
+ * checksum of everything after it.
+ *
+ * Loading maps the file and, once it checks out, copies the objects
+ * into the cache's slabs straight from the mapping, which is then
+ * dropped. Entries already expired are skipped; the rest expire lazily
+ * like any other object. Saves write a temporary file and rename it
+ * over the old one, so a crash mid-save leaves the previous snapshot
+ * intact.
+ */
+#include "csapp.h"
+#include <sys/mman.h>
+#include "cache.h"
+#include "cachekey.h"
+#include "snapshot.h"
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *snap_path = NULL;
+static int interval = 0;
+static int loaded = 0;
+static unsigned long saves = 0, failures = 0;
+static int last_count = 0;
+static size_t last_size = 0;
+static time_t last_save = 0;
+
+/*
+ * check - does the mapped snapshot of size bytes hold together?
+ */
+static int check(const char *map, size_t size)
+{
+    const snap_header_t *h = (const snap_header_t *)map;
+    const snap_entry_t *e = (const snap_entry_t *)(h + 1);
+    size_t data;
+    uint32_t i;
+
+    if (size < sizeof(*h) || memcmp(h->magic, SNAPSHOT_MAGIC, 8) ||
+        h->version != SNAPSHOT_VERSION || h->size != size ||
+        h->count > SNAPSHOT_MAX_OBJECTS)
+        return -1;
+    data = sizeof(*h) + (size_t)h->count * sizeof(*e);
+    if (data > size ||
+        key_hash(map + sizeof(*h), size - sizeof(*h)) != h->checksum)
+        return -1;
+    for (i = 0; i < h->count; i++, e++)
+        if (e->key_off < data || e->key_off + e->key_len >= size ||
+            map[e->key_off + e->key_len] != '\0' ||
+            e->hdrs_off < data || e->hdrs_off + e->hdr_len >= size ||
+            map[e->hdrs_off + e->hdr_len] != '\0' ||
+            e->body_off < data || e->body_off + e->body_len > size)
+            return -1;
+    return 0;
+}
+
+/*
+ * snapshot_load - fill the cache from the snapshot at path. Returns
+ * the objects loaded, or -1 (with a message) if there is no usable
+ * snapshot.
+ */
+int snapshot_load(const char *path)
+{
+    struct stat st;
+    const snap_header_t *h;
+    const snap_entry_t *e;
+    time_t now = time(NULL);
+    char *map;
+    int fd, i, stale = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;                          /* None yet: a cold start */
+    if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        fprintf(stderr, "snapshot %s: unreadable, ignored\n", path);
+        return -1;
+    }
+    close(fd);
+    if (check(map, st.st_size) < 0) {
+        munmap(map, st.st_size);
+        fprintf(stderr, "snapshot %s: corrupt or from another version, "
+                "ignored\n", path);
+        return -1;
+    }
+
+    /* Coldest first, so the hottest objects come out most recently used */
+    h = (const snap_header_t *)map;
+    e = (const snap_entry_t *)(h + 1);
+    for (i = h->count - 1; i >= 0; i--) {
+        if (e[i].expires && e[i].expires <= now) {
+            stale++;
+            continue;
+        }
+        if (cache_insert_copy(map + e[i].key_off, map + e[i].hdrs_off,
+                              e[i].hdr_len, map + e[i].body_off,
+                              e[i].body_len, e[i].stored, e[i].expires) == 0)
+            loaded++;
+    }
+    munmap(map, st.st_size);
+    fprintf(stderr, "snapshot %s: loaded %d objects (%d expired)\n",
+            path, loaded, stale);
+    return loaded;
+}
+
+static int by_last_use(const void *a, const void *b)
+{
+    uint64_t x = (*(cache_obj_t **)a)->last_use, y = (*(cache_obj_t **)b)->last_use;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * snapshot_save - write the cache to path. Returns the objects saved,
+ * or -1 on error.
+ */
+int snapshot_save(const char *path)
+{
+    char tmp[MAXLINE], *buf, *p;
+    cache_obj_t **v = Malloc(SNAPSHOT_MAX_OBJECTS * sizeof(cache_obj_t *));
+    snap_header_t *h;
+    snap_entry_t *e;
+    size_t size;
+    int n, i, j, fd, ok, rc = -1;
+
+    pthread_mutex_lock(&save_lock);
+    n = cache_collect(v, SNAPSHOT_MAX_OBJECTS);
+    qsort(v, n, sizeof(*v), by_last_use);
+    size = sizeof(*h) + n * sizeof(*e);
+    for (i = 0; i < n; i++)
+        size += strlen(v[i]->key) + 1 + v[i]->hdrlen + 1 + v[i]->bodylen;
+
+    buf = Calloc(1, size);
+    h = (snap_header_t *)buf;
+    e = (snap_entry_t *)(h + 1);
+    p = (char *)(e + n);
+    for (i = 0; i < n; i++) {
+        e[i].key_len = strlen(v[i]->key);
+        e[i].key_off = p - buf;
+        memcpy(p, v[i]->key, e[i].key_len + 1);
+        p += e[i].key_len + 1;
+        e[i].hdr_len = v[i]->hdrlen;
+        e[i].hdrs_off = p - buf;
+        memcpy(p, v[i]->hdrs, v[i]->hdrlen);
+        p += v[i]->hdrlen + 1;
+        e[i].body_len = v[i]->bodylen;
+        e[i].body_off = p - buf;
+        for (j = 1; j < v[i]->niov; j++) {
+            memcpy(p, v[i]->iov[j].iov_base, v[i]->iov[j].iov_len);
+            p += v[i]->iov[j].iov_len;
+        }
+        e[i].stored = v[i]->stored;
+        e[i].expires = v[i]->expires;
+        cache_release(v[i]);
+    }
+    memcpy(h->magic, SNAPSHOT_MAGIC, 8);
+    h->version = SNAPSHOT_VERSION;
+    h->count = n;
+    h->created = time(NULL);
+    h->size = size;
+    h->checksum = key_hash(buf + sizeof(*h), size - sizeof(*h));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        ok = rio_writen(fd, buf, size) == (ssize_t)size && fsync(fd) == 0;
+        if (close(fd) < 0)          /* Exactly once: fd may be reused */
+            ok = 0;
+        if (ok && rename(tmp, path) == 0)
+            rc = n;
+        else
+            unlink(tmp);
+    }
+    if (rc < 0) {
+        failures++;
+        fprintf(stderr, "snapshot %s: cannot save: %s\n", path, strerror(errno));
+    } else {
+        saves++;
+        last_count = n;
+        last_size = size;
+        last_save = h->created;
+    }
+    pthread_mutex_unlock(&save_lock);
+    free(buf);
+    free(v);
+    return rc;
+}
+
+/*
+ * snapshot_thread - save the cache every interval seconds
+ */
+static void *snapshot_thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+        sleep(interval);
+        snapshot_save(snap_path);
+    }
+    return NULL;
+}
+
+/*
+ * snapshot_start - remember path for the report and, if interval_secs
+ * is positive, save to it that often in the background
+ */
+void snapshot_start(const char *path, int interval_secs)
+{
+    pthread_t tid;
+
+    snap_path = path;
+    interval = interval_secs;
+    if (interval > 0)
+        Pthread_create(&tid, NULL, snapshot_thread, NULL);
+}
+
+/*
+ * snapshot_report - render the snapshot counters as text into buf
+ */
+int snapshot_report(char *buf, size_t len)
+{
+    if (snap_path == NULL)
+        return 0;
+    return snprintf(buf, len, "snapshot  loaded=%d saves=%lu failures=%lu "
+                    "objects=%d bytes=%zu age=%lds\n", loaded, saves, failures,
+                    last_count, last_size,
+                    last_save ? (long)(time(NULL) - last_save) : -1L);
+}
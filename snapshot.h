@@ -0,0 +1,36 @@
+/*
+ * snapshot.h - Cache snapshots for warm restarts
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "PXYSNAP"      /* 8 bytes with the NUL */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_OBJECTS 65536
+
+/* File layout: header, count entries (hottest first), then the data
+   the entries point into. Offsets are from the start of the file. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    int64_t created;
+    uint64_t size;                    /* Of the whole file */
+    uint64_t checksum;                /* key_hash() of all after the header */
+} snap_header_t;
+
+typedef struct {
+    uint64_t key_off, hdrs_off, body_off, body_len;
+    uint32_t key_len, hdr_len;        /* Key and hdrs are NUL-terminated */
+    int64_t stored, expires;
+} snap_entry_t;
+
+int snapshot_load(const char *path);
+int snapshot_save(const char *path);
+void snapshot_start(const char *path, int interval_secs);
+int snapshot_report(char *buf, size_t len);
+
+#endif /* __SNAPSHOT_H__ */
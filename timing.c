@@ -0,0 +1,174 @@
+/*
+ * timing.c - Per-phase request timing for the proxy
+ *
+ * Timestamps come from CLOCK_MONOTONIC, which is served from the vDSO
+ * and costs a few tens of nanoseconds. Histograms are shared by all
+ * threads and updated with atomic adds, so recording takes no locks.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "timing.h"
+
+#define HIST_BUCKETS 32  /* Bucket i holds [2^i, 2^(i+1)) microseconds */
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t bucket[HIST_BUCKETS];
+} hist_t;
+
+const char *phase_names[NPHASES] = {
+    "accept", "parse", "dns", "connect", "ttfb", "transfer"
+};
+
+static hist_t hists[NPHASES];
+static hist_t total_hist;
+
+/*
+ * timing_now - current monotonic time in nanoseconds
+ */
+uint64_t timing_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * timing_start - begin timing a request that was accepted at "accepted"
+ */
+void timing_start(req_timing_t *t, uint64_t accepted)
+{
+    int i;
+
+    t->start = t->last = accepted;
+    t->mask = 0;
+    for (i = 0; i < NPHASES; i++)
+        t->ns[i] = 0;
+}
+
+/*
+ * timing_mark - close phase ph: charge it the time since the last mark
+ */
+void timing_mark(req_timing_t *t, phase_t ph)
+{
+    uint64_t now = timing_now();
+
+    t->ns[ph] += now - t->last;
+    t->mask |= 1u << ph;
+    t->last = now;
+}
+
+/*
+ * timing_total - time from accept to the last phase boundary
+ */
+uint64_t timing_total(req_timing_t *t)
+{
+    return t->last - t->start;
+}
+
+/*
+ * hist_add - fold one sample (in microseconds) into a histogram
+ */
+static void hist_add(hist_t *h, uint64_t us)
+{
+    int b = 0;
+    uint64_t v = us, max;
+
+    while (v > 1 && b < HIST_BUCKETS - 1) {
+        v >>= 1;
+        b++;
+    }
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while (us > max &&
+           !__atomic_compare_exchange_n(&h->max_us, &max, us, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * timing_record - feed a finished request into the per-phase histograms.
+ * Phases the request never reached are not recorded.
+ */
+void timing_record(req_timing_t *t)
+{
+    int i;
+
+    for (i = 0; i < NPHASES; i++)
+        if (t->mask & (1u << i))
+            hist_add(&hists[i], t->ns[i] / 1000);
+    hist_add(&total_hist, timing_total(t) / 1000);
+}
+
+/*
+ * timing_format - write a one-line "phase=Nus ..." breakdown into buf.
+ * Returns the number of characters written.
+ */
+int timing_format(req_timing_t *t, char *buf, size_t len)
+{
+    int i, n = 0;
+
+    for (i = 0; i < NPHASES && (size_t)n < len; i++)
+        n += snprintf(buf + n, len - n, "%s%s=%luus", i ? " " : "",
+                      phase_names[i], (unsigned long)(t->ns[i] / 1000));
+    if ((size_t)n < len)
+        n += snprintf(buf + n, len - n, " total=%luus",
+                      (unsigned long)(timing_total(t) / 1000));
+    return n;
+}
+
+/*
+ * hist_percentile - upper bound (us) of the bucket holding quantile q
+ */
+static uint64_t hist_percentile(hist_t *h, uint64_t count, double q)
+{
+    uint64_t seen = 0, want = (uint64_t)(q * count);
+    int b;
+
+    if (want < q * count || want == 0)
+        want++;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+        if (seen >= want)
+            return 2ULL << b;
+    }
+    return 2ULL << (HIST_BUCKETS - 1);
+}
+
+static int hist_line(char *buf, size_t len, const char *name, hist_t *h)
+{
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+
+    if (count == 0)
+        return snprintf(buf, len, "%-9s count=0\n", name);
+    return snprintf(buf, len,
+                    "%-9s count=%lu mean=%luus p50<%luus p90<%luus "
+                    "p99<%luus max=%luus\n", name,
+                    (unsigned long)count, (unsigned long)(sum / count),
+                    (unsigned long)hist_percentile(h, count, 0.50),
+                    (unsigned long)hist_percentile(h, count, 0.90),
+                    (unsigned long)hist_percentile(h, count, 0.99),
+                    (unsigned long)__atomic_load_n(&h->max_us, __ATOMIC_RELAXED));
+}
+
+/*
+ * timing_report - render all phase histograms as text into buf.
+ * Returns the number of characters written.
+ */
+int timing_report(char *buf, size_t len)
+{
+    int i, n = 0;
+
+    for (i = 0; i < NPHASES && (size_t)n < len; i++)
+        n += hist_line(buf + n, len - n, phase_names[i], &hists[i]);
+    if ((size_t)n < len)
+        n += hist_line(buf + n, len - n, "total", &total_hist);
+    return n;
+}
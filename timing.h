@@ -0,0 +1,42 @@
+/*
+ * timing.h - Per-phase request timing for the proxy
+ *
+ * Each request carries a req_timing_t that is stamped at every phase
+ * boundary of fetch(). Finished requests are folded into one
+ * log2-bucketed latency histogram per phase.
+ */
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Request phases, in the order fetch() walks through them */
+typedef enum {
+    PH_ACCEPT,    /* accept() returned -> worker picked up the fd */
+    PH_PARSE,     /* request line read and URI parsed */
+    PH_DNS,       /* getaddrinfo() for the origin */
+    PH_CONNECT,   /* connect() to the origin */
+    PH_TTFB,      /* request sent -> first response byte */
+    PH_TRANSFER,  /* first response byte -> last byte relayed */
+    NPHASES
+} phase_t;
+
+typedef struct {
+    uint64_t start;          /* Timestamp of accept() (ns) */
+    uint64_t last;           /* Timestamp of the last phase boundary */
+    uint64_t ns[NPHASES];    /* Time spent in each phase */
+    unsigned mask;           /* Phases that were actually reached */
+} req_timing_t;
+
+extern const char *phase_names[NPHASES];
+
+uint64_t timing_now(void);
+void timing_start(req_timing_t *t, uint64_t accepted);
+void timing_mark(req_timing_t *t, phase_t ph);
+uint64_t timing_total(req_timing_t *t);
+void timing_record(req_timing_t *t);
+int timing_format(req_timing_t *t, char *buf, size_t len);
+int timing_report(char *buf, size_t len);
+
+#endif /* __TIMING_H__ */
@@ -0,0 +1,174 @@
+/*
+ * trie.c - Radix trie over string keys, for prefix queries
+ *
+ * The cache's hash table answers "is this URL cached", but invalidating
+ * everything under "http://host/static/" would have to scan it whole.
+ * The trie indexes the same keys by their bytes: each edge carries the
+ * run of bytes its subtree shares, so a prefix is found by following
+ * at most one edge per distinct run, and every key under it is in the
+ * subtree reached. Children are kept in an unordered sibling list;
+ * nodes are split on insert and merged back on removal, so there is
+ * never a valueless node with a single child.
+ *
+ * The trie does no locking of its own: the cache changes it under a
+ * shard's write lock and walks it under the read lock.
+ */
+#include "csapp.h"
+#include "trie.h"
+
+static trie_node_t *new_node(const char *label, size_t len, void *val,
+                             trie_node_t *next)
+{
+    trie_node_t *n = Malloc(sizeof(trie_node_t) + len);
+
+    memcpy(n->label, label, len);
+    n->len = len;
+    n->val = val;
+    n->child = NULL;
+    n->next = next;
+    return n;
+}
+
+/*
+ * sibling - the link to the node among *pp and its siblings whose
+ * label starts with c (the link to NULL if none)
+ */
+static trie_node_t **sibling(trie_node_t **pp, char c)
+{
+    for (; *pp && (*pp)->label[0] != c; pp = &(*pp)->next)
+        ;
+    return pp;
+}
+
+/*
+ * trie_insert - map key (not empty) to val, replacing any value it had
+ */
+void trie_insert(trie_node_t **root, const char *key, void *val)
+{
+    size_t len = strlen(key), i;
+    trie_node_t **pp = root, *n, *split;
+
+    while (1) {
+        pp = sibling(pp, key[0]);
+        if ((n = *pp) == NULL) {
+            *pp = new_node(key, len, val, NULL);
+            return;
+        }
+        for (i = 0; i < n->len && i < len && n->label[i] == key[i]; i++)
+            ;
+        if (i < n->len) {           /* Split the edge where key leaves it */
+            split = new_node(n->label, i, NULL, n->next);
+            split->child = new_node(n->label + i, n->len - i, n->val, NULL);
+            split->child->child = n->child;
+            free(n);
+            *pp = n = split;
+        }
+        if (i == len) {
+            n->val = val;
+            return;
+        }
+        key += i;
+        len -= i;
+        pp = &n->child;
+    }
+}
+
+/*
+ * tidy - after a removal under *pp: drop the node if it is now empty,
+ * or merge it with its only child
+ */
+static void tidy(trie_node_t **pp)
+{
+    trie_node_t *n = *pp, *c = n->child, *m;
+
+    if (n->val)
+        return;
+    if (c == NULL) {
+        *pp = n->next;
+        free(n);
+    } else if (c->next == NULL) {
+        m = Malloc(sizeof(trie_node_t) + n->len + c->len);
+        memcpy(m->label, n->label, n->len);
+        memcpy(m->label + n->len, c->label, c->len);
+        m->len = n->len + c->len;
+        m->val = c->val;
+        m->child = c->child;
+        m->next = n->next;
+        *pp = m;
+        free(n);
+        free(c);
+    }
+}
+
+static void *remove_at(trie_node_t **pp, const char *key, size_t len)
+{
+    trie_node_t *n;
+    void *val;
+
+    pp = sibling(pp, key[0]);
+    if ((n = *pp) == NULL || len < n->len || memcmp(n->label, key, n->len))
+        return NULL;
+    if (len == n->len) {
+        val = n->val;
+        n->val = NULL;
+    } else
+        val = remove_at(&n->child, key + n->len, len - n->len);
+    if (val != NULL)
+        tidy(pp);
+    return val;
+}
+
+/*
+ * trie_remove - unmap key. Returns its value, or NULL if it had none.
+ */
+void *trie_remove(trie_node_t **root, const char *key)
+{
+    return *key ? remove_at(root, key, strlen(key)) : NULL;
+}
+
+/*
+ * visit - call fn on the values of n and its subtree (not its siblings)
+ */
+static int visit(trie_node_t *n, trie_fn_t fn, void *arg)
+{
+    trie_node_t *c;
+    int count = 0;
+
+    if (n->val) {
+        fn(n->val, arg);
+        count++;
+    }
+    for (c = n->child; c; c = c->next)
+        count += visit(c, fn, arg);
+    return count;
+}
+
+/*
+ * trie_walk - call fn on the value of every key that starts with
+ * prefix ("" = all keys). Returns how many there were.
+ */
+int trie_walk(trie_node_t *root, const char *prefix, trie_fn_t fn, void *arg)
+{
+    size_t len = strlen(prefix), i;
+    trie_node_t *n = root;
+    int count = 0;
+
+    while (len > 0) {
+        for (; n && n->label[0] != prefix[0]; n = n->next)
+            ;
+        if (n == NULL)
+            return 0;
+        for (i = 0; i < n->len && i < len && n->label[i] == prefix[i]; i++)
+            ;
+        if (i == len)               /* The prefix ends on this edge */
+            return visit(n, fn, arg);
+        if (i < n->len)
+            return 0;
+        prefix += i;
+        len -= i;
+        n = n->child;
+    }
+    for (; n; n = n->next)
+        count += visit(n, fn, arg);
+    return count;
+}
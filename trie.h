@@ -0,0 +1,26 @@
+/*
+ * trie.h - Radix trie over string keys, for prefix queries
+ */
+#ifndef __TRIE_H__
+#define __TRIE_H__
+
+#include <stddef.h>
+
+/* A node: the edge label leading to it, and the value of the key that
+   ends here, if any. A trie is a pointer to its first top-level node. */
+typedef struct trie_node {
+    struct trie_node *child;        /* First child */
+    struct trie_node *next;         /* Next sibling */
+    void *val;                      /* NULL = no key ends here */
+    size_t len;
+    char label[];                   /* Edge label, len bytes */
+} trie_node_t;
+
+/* Called for each value under a prefix */
+typedef void (*trie_fn_t)(void *val, void *arg);
+
+void trie_insert(trie_node_t **root, const char *key, void *val);
+void *trie_remove(trie_node_t **root, const char *key);
+int trie_walk(trie_node_t *root, const char *prefix, trie_fn_t fn, void *arg);
+
+#endif /* __TRIE_H__ */
@@ -0,0 +1,146 @@
+/*
+ * tunnel.c - Byte relay for CONNECT tunnels
+ *
+ * Both directions of a tunnel are moved with splice() through a pipe
+ * per direction, so tunnelled bytes go socket -> pipe -> socket inside
+ * the kernel and are never copied through user space. One thread
+ * drives both directions with poll(); a tunnel with no traffic for
+ * idle_ms is torn down. A socket with nothing to wait for is left out
+ * of the poll set, since poll() reports a hangup even when no events
+ * are asked for and would otherwise return at once, over and over.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+
+#define PIPE_CHUNK 65536  /* Most bytes moved per splice() call */
+
+/* One direction of the tunnel */
+struct flow {
+    int src, dst;
+    int pipe[2];
+    long pending;   /* Bytes sitting in the pipe */
+    long moved;     /* Bytes delivered to dst */
+    int eof;        /* src has shut down its sending side */
+    int shut;       /* EOF passed on to dst */
+};
+
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * flow_fill - splice what src has into the pipe. Returns -1 on error.
+ */
+static int flow_fill(struct flow *f)
+{
+    ssize_t n = splice(f->src, NULL, f->pipe[1], NULL, PIPE_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (n > 0)
+        f->pending += n;
+    else if (n == 0)
+        f->eof = 1;
+    else if (errno != EAGAIN && errno != EINTR)
+        return -1;
+    return 0;
+}
+
+/*
+ * flow_drain - splice the pipe's contents to dst. Returns -1 on error.
+ */
+static int flow_drain(struct flow *f)
+{
+    ssize_t n = splice(f->pipe[0], NULL, f->dst, NULL, f->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (n > 0) {
+        f->pending -= n;
+        f->moved += n;
+    } else if (n < 0 && errno != EAGAIN && errno != EINTR)
+        return -1;
+    return 0;
+}
+
+/*
+ * tunnel_relay - relay bytes between the client cfd and the server sfd
+ * until both sides have closed, an error occurs, or nothing has moved
+ * for idle_ms (<= 0: no limit). Bytes delivered client->server go to
+ * *up, server->client to *down. Returns a TUNNEL_* reason.
+ */
+int tunnel_relay(int cfd, int sfd, int idle_ms, long *up, long *down)
+{
+    struct flow f[2] = {
+        {cfd, sfd, {-1, -1}, 0, 0, 0, 0},
+        {sfd, cfd, {-1, -1}, 0, 0, 0, 0}
+    };
+    struct pollfd pfd[2];
+    int i, rc = TUNNEL_ERROR, n;
+
+    if (set_nonblock(cfd) < 0 || set_nonblock(sfd) < 0 ||
+        pipe2(f[0].pipe, O_CLOEXEC) < 0)
+        goto out;
+    if (pipe2(f[1].pipe, O_CLOEXEC) < 0)
+        goto out;
+
+    while (!(f[0].shut && f[1].shut)) {
+        pfd[0].events = pfd[1].events = 0;
+        for (i = 0; i < 2; i++) {
+            if (!f[i].eof && f[i].pending < PIPE_CHUNK)
+                pfd[i].events |= POLLIN;           /* f[i].src == pfd[i] */
+            if (f[i].pending > 0)
+                pfd[1 - i].events |= POLLOUT;      /* f[i].dst == pfd[1-i] */
+        }
+        pfd[0].fd = pfd[0].events ? cfd : -1;
+        pfd[1].fd = pfd[1].events ? sfd : -1;
+
+        n = poll(pfd, 2, idle_ms > 0 ? idle_ms : -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            goto out;
+        if (n == 0) {
+            rc = TUNNEL_IDLE;
+            goto out;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                (pfd[i].events & POLLIN) && flow_fill(&f[i]) < 0)
+                goto out;
+            /* Hung up while its pipe is full: once nothing is left
+               unread, that is the end of this flow's input */
+            if ((pfd[i].revents & POLLHUP) && !(pfd[i].events & POLLIN) &&
+                !f[i].eof && ioctl(f[i].src, FIONREAD, &n) == 0 && n == 0)
+                f[i].eof = 1;
+            if ((pfd[1 - i].revents & (POLLOUT | POLLERR)) && f[i].pending > 0 &&
+                flow_drain(&f[i]) < 0)
+                goto out;
+            if (f[i].eof && f[i].pending == 0 && !f[i].shut) {
+                shutdown(f[i].dst, SHUT_WR);
+                f[i].shut = 1;
+            }
+        }
+    }
+    rc = TUNNEL_CLOSED;
+
+ out:
+    for (i = 0; i < 2; i++) {
+        if (f[i].pipe[0] >= 0) {
+            close(f[i].pipe[0]);
+            close(f[i].pipe[1]);
+        }
+    }
+    *up = f[0].moved;
+    *down = f[1].moved;
+    return rc;
+}
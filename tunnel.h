@@ -0,0 +1,12 @@
+/*
+ * tunnel.h - Byte relay for CONNECT tunnels
+ */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+/* Why tunnel_relay() returned */
+enum { TUNNEL_CLOSED, TUNNEL_IDLE, TUNNEL_ERROR };
+
+int tunnel_relay(int cfd, int sfd, int idle_ms, long *up, long *down);
+
+#endif /* __TUNNEL_H__ */
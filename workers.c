@@ -0,0 +1,339 @@
+/*
+ * workers.c - Elastic pool of connection worker threads
+ *
+ * Connections used to get a thread each. Now they are served by a pool
+ * of workers whose size follows the load between a minimum and a
+ * maximum. workers_submit() hands a connection straight to the most
+ * recently idle worker, or queues it when every worker is busy. Every
+ * WORKERS_TICK_MS a controller thread looks at how long the oldest
+ * queued connection has waited and grows the pool when:
+ *   - that wait exceeded the target on two reviews in a row, or
+ *   - connections are queued and at least 3/4 of the workers are
+ *     blocked on an upstream (DNS, connect() or the first byte, as
+ *     reported through workers_blocking()), the usual sign of a slow
+ *     origin rather than too little CPU.
+ * It adds as many workers as there are queued connections, at most
+ * doubling the pool per review.
+ *
+ * The pool shrinks from the other end. Idle workers wait on a LIFO
+ * list, so the ones at its bottom stay idle during moderate load; a
+ * worker that has been idle for idle_ms exits, at most one per tick,
+ * never below the minimum and not within idle_ms of the last growth.
+ * Growing on a short, sustained signal and shrinking only on a long
+ * one keeps the size from flapping.
+ */
+#include "csapp.h"
+#include "timing.h"
+#include "workers.h"
+
+#define TICK_NS (WORKERS_TICK_MS * 1000000ULL)
+
+enum { GROW_WAIT, GROW_BLOCKED, NGROW };
+
+struct worker {
+    struct worker *next, *prev;     /* Idle list, most recent first */
+    pthread_cond_t cond;
+    void *arg;                      /* Handed over by workers_submit() */
+    int blocked;
+};
+
+struct job {
+    void *arg;
+    uint64_t queued;                /* timing_now() when submitted */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static worker_fn_t serve;
+static int min_threads, max_threads;
+static uint64_t target_ns, idle_ns;
+static int threads = 0, busy = 0, nidle = 0, blocked = 0;
+static struct worker *idle_head = NULL;
+static struct job *queue = NULL;    /* Ring of connections waiting */
+static size_t qcap = 0, qhead = 0, qlen = 0;
+static uint64_t last_grow = 0, last_shrink = 0;
+static uint64_t wait_avg_ns = 0, wait_max_ns = 0;
+static unsigned long grown[NGROW], at_max = 0, shrunk = 0;
+static unsigned long handed = 0, queued = 0;
+static __thread struct worker *self = NULL;
+
+static const char *grow_names[NGROW] = { "wait", "blocked" };
+
+static void push_idle(struct worker *w)
+{
+    w->prev = NULL;
+    if ((w->next = idle_head) != NULL)
+        idle_head->prev = w;
+    idle_head = w;
+    nidle++;
+}
+
+static void unlink_idle(struct worker *w)
+{
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        idle_head = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    nidle--;
+}
+
+/*
+ * take - pop the oldest queued connection and account for its wait.
+ * Caller holds the lock and has checked qlen.
+ */
+static void *take(void)
+{
+    struct job *j = &queue[qhead];
+    uint64_t wait = timing_now() - j->queued;
+
+    qhead = (qhead + 1) % qcap;
+    qlen--;
+    wait_avg_ns += ((int64_t)wait - (int64_t)wait_avg_ns) / 8;
+    if (wait > wait_max_ns)
+        wait_max_ns = wait;
+    return j->arg;
+}
+
+/*
+ * worker_thread - serve connections until idle for idle_ms while the
+ * pool may shrink
+ */
+static void *worker_thread(void *vargp)
+{
+    struct worker w;
+    struct timespec ts;
+    uint64_t now, wait = idle_ns;
+    void *arg;
+
+    Pthread_detach(pthread_self());
+    memset(&w, 0, sizeof(w));
+    pthread_cond_init(&w.cond, NULL);
+    self = &w;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        if (qlen > 0)
+            arg = take();
+        else {
+            w.arg = NULL;
+            push_idle(&w);
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += wait / 1000000000ULL;
+            ts.tv_nsec += wait % 1000000000ULL;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            while (w.arg == NULL &&
+                   pthread_cond_timedwait(&w.cond, &lock, &ts) != ETIMEDOUT)
+                ;
+            if ((arg = w.arg) == NULL) {    /* Idle the whole time */
+                unlink_idle(&w);
+                now = timing_now();
+                wait = idle_ns;
+                if (threads > min_threads && now - last_grow >= idle_ns) {
+                    if (now - last_shrink >= TICK_NS) {
+                        threads--;
+                        shrunk++;
+                        last_shrink = now;
+                        break;
+                    }
+                    wait = TICK_NS;     /* Another one just left */
+                }
+                continue;
+            }
+            wait = idle_ns;
+        }
+        busy++;
+        pthread_mutex_unlock(&lock);
+        serve(arg);
+        workers_blocking(0);
+        pthread_mutex_lock(&lock);
+        busy--;
+    }
+    pthread_mutex_unlock(&lock);
+    pthread_cond_destroy(&w.cond);
+    return NULL;
+}
+
+/*
+ * spawn - start up to n workers. Caller holds the lock. Returns how
+ * many were started.
+ */
+static int spawn(int n)
+{
+    pthread_t tid;
+    int i, rc;
+
+    for (i = 0; i < n; i++) {
+        if ((rc = pthread_create(&tid, NULL, worker_thread, NULL)) != 0) {
+            fprintf(stderr, "cannot start a worker: %s\n", strerror(rc));
+            break;
+        }
+        threads++;
+    }
+    return i;
+}
+
+/*
+ * controller - review the pool size every tick and grow it when the
+ * queue wait or the share of blocked workers calls for it
+ */
+static void *controller(void *vargp)
+{
+    uint64_t now, wait;
+    int over = 0, why, n;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(WORKERS_TICK_MS * 1000);
+        pthread_mutex_lock(&lock);
+        now = timing_now();
+        wait = qlen > 0 ? now - queue[qhead].queued : 0;
+        why = -1;
+        if (qlen > 0 && wait > target_ns) {
+            if (++over >= 2)
+                why = GROW_WAIT;
+        } else
+            over = 0;
+        if (why < 0 && qlen > 0 &&
+            __atomic_load_n(&blocked, __ATOMIC_RELAXED) * 4 >= threads * 3)
+            why = GROW_BLOCKED;
+        if (why >= 0 && threads >= max_threads)
+            at_max++;
+        else if (why >= 0) {
+            n = qlen < (size_t)threads ? (int)qlen : threads;
+            if (n > max_threads - threads)
+                n = max_threads - threads;
+            grown[why] += spawn(n > 0 ? n : 1);
+            last_grow = now;
+            over = 0;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/*
+ * workers_init - start min workers that run fn on each submitted item,
+ * and the controller that keeps their number between min and max.
+ * target_ms is the queue wait that makes the pool grow, idle_ms how
+ * long a worker idles before it exits.
+ */
+void workers_init(worker_fn_t fn, int min, int max, int target_ms,
+                  int idle_ms)
+{
+    pthread_t tid;
+
+    serve = fn;
+    min_threads = min > 0 ? min : 1;
+    max_threads = max > min_threads ? max : min_threads;
+    target_ns = (uint64_t)target_ms * 1000000ULL;
+    idle_ns = (uint64_t)(idle_ms > 0 ? idle_ms : 1) * 1000000ULL;
+    qcap = 1024;
+    queue = Malloc(qcap * sizeof(struct job));
+
+    pthread_mutex_lock(&lock);
+    spawn(min_threads);
+    pthread_mutex_unlock(&lock);
+    Pthread_create(&tid, NULL, controller, NULL);
+}
+
+/*
+ * submit - hand arg to an idle worker or queue it; with must_grow set
+ * only queue it if the pool can still grow. Returns -1 if it did not.
+ */
+static int submit(void *arg, uint64_t now, int must_grow)
+{
+    struct worker *w;
+    struct job *q;
+    size_t i;
+
+    pthread_mutex_lock(&lock);
+    if ((w = idle_head) != NULL) {
+        unlink_idle(w);
+        w->arg = arg;
+        handed++;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    if (must_grow && threads >= max_threads) {
+        at_max++;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    if (qlen == qcap) {             /* Grow the ring, oldest first */
+        q = Malloc(2 * qcap * sizeof(struct job));
+        for (i = 0; i < qlen; i++)
+            q[i] = queue[(qhead + i) % qcap];
+        free(queue);
+        queue = q;
+        qhead = 0;
+        qcap *= 2;
+    }
+    queue[(qhead + qlen) % qcap].arg = arg;
+    queue[(qhead + qlen) % qcap].queued = now;
+    qlen++;
+    queued++;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+ * workers_submit - have arg served by an idle worker, or queue it
+ * (now is when it arrived) until one is free
+ */
+void workers_submit(void *arg, uint64_t now)
+{
+    submit(arg, now, 0);
+}
+
+/*
+ * workers_try_submit - like workers_submit(), but for work that other
+ * workers wait on (HTTP/2 streams): refuse it, returning -1, rather
+ * than queue it behind a pool that is already at its maximum
+ */
+int workers_try_submit(void *arg, uint64_t now)
+{
+    return submit(arg, now, 1);
+}
+
+/*
+ * workers_blocking - the calling worker starts (1) or stops (0)
+ * waiting on an upstream. No-op on threads outside the pool.
+ */
+void workers_blocking(int on)
+{
+    if (self == NULL || self->blocked == on)
+        return;
+    self->blocked = on;
+    __atomic_fetch_add(&blocked, on ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+/*
+ * workers_report - render the pool size, load and scaling decisions as
+ * text into buf
+ */
+int workers_report(char *buf, size_t len)
+{
+    int i, n;
+
+    if (queue == NULL)
+        return 0;
+    pthread_mutex_lock(&lock);
+    n = snprintf(buf, len, "workers  threads=%d (%d-%d) busy=%d blocked=%d "
+                 "idle=%d queued=%zu wait-avg=%.3fms wait-max=%.3fms "
+                 "handed=%lu waited=%lu grown",
+                 threads, min_threads, max_threads, busy,
+                 __atomic_load_n(&blocked, __ATOMIC_RELAXED), nidle, qlen,
+                 wait_avg_ns / 1e6, wait_max_ns / 1e6, handed, queued);
+    for (i = 0; i < NGROW && (size_t)n < len; i++)
+        n += snprintf(buf + n, len - n, " %s=%lu", grow_names[i], grown[i]);
+    if ((size_t)n < len)
+        n += snprintf(buf + n, len - n, " at-max=%lu shrunk=%lu\n",
+                      at_max, shrunk);
+    pthread_mutex_unlock(&lock);
+    return n;
+}
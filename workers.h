@@ -0,0 +1,22 @@
+/*
+ * workers.h - Elastic pool of connection worker threads
+ */
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WORKERS_TICK_MS 10          /* How often the pool size is reviewed */
+
+/* Serves one queued item (a connection) on a worker thread */
+typedef void (*worker_fn_t)(void *arg);
+
+void workers_init(worker_fn_t fn, int min, int max, int target_ms,
+                  int idle_ms);
+void workers_submit(void *arg, uint64_t now);
+int workers_try_submit(void *arg, uint64_t now);
+void workers_blocking(int blocked);
+int workers_report(char *buf, size_t len);
+
+#endif /* __WORKERS_H__ */